@@ -6,6 +6,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
+#include "../../Common/rotate.h"
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -30,6 +33,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -67,6 +71,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -98,6 +103,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -112,10 +118,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
-}
-
-unsigned int map2Dto1D(unsigned int x, unsigned int y, unsigned int imageWidth, unsigned int imageHeight) {
-    return (imageHeight - y) * imageWidth + x;
+    traceEnd(&span);
 }
 
 int main() {
@@ -127,14 +130,24 @@ int main() {
     readBitmap("Fig2.20.bmp", &bitmapHeader, &dipHeader, colorTable, &imageData);
 
     // Image processing
-    uint8_t *newImageData = malloc(dipHeader.imageSize);
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            newImageData[map2Dto1D(dipHeader.imageHeight - y, x, dipHeader.imageWidth, dipHeader.imageHeight)] =
-                    imageData[map2Dto1D(x, y, dipHeader.imageWidth, dipHeader.imageHeight)];
-        }
-    }
+    // The width and height swap, so the padded row size has to be recomputed
+    struct DipHeader newDipHeader = dipHeader;
+    newDipHeader.imageWidth = dipHeader.imageHeight;
+    newDipHeader.imageHeight = dipHeader.imageWidth;
+    unsigned int rowSize = (unsigned int) (floor((double) (dipHeader.imageWidth * 8 + 31) / 32) * 4);
+    unsigned int newRowSize = (unsigned int) (floor((double) (newDipHeader.imageWidth * 8 + 31) / 32) * 4);
+    newDipHeader.imageSize = newRowSize * newDipHeader.imageHeight;
+
+    struct BitmapHeader newBitmapHeader = bitmapHeader;
+    newBitmapHeader.fileSize = newDipHeader.imageSize + bitmapHeader.offset;
+
+    // The pixel array is stored bottom-up, so a clockwise turn on screen is a counterclockwise turn in memory
+    uint8_t *newImageData = malloc(newDipHeader.imageSize);
+    rotate270(imageData, rowSize, newImageData, newRowSize, dipHeader.imageWidth, dipHeader.imageHeight);
+
+    writeBitmap("Result.bmp", &newBitmapHeader, &newDipHeader, colorTable, newImageData);
 
-    writeBitmap("Result.bmp", &bitmapHeader, &dipHeader, colorTable, newImageData);
+    free(imageData);
+    free(newImageData);
     return 0;
 }
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -35,6 +36,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -72,6 +74,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -103,6 +106,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -117,6 +121,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
+    traceEnd(&span);
 }
 
 // Mapping the x-y coordinate system to 1D array
@@ -171,5 +176,8 @@ int main() {
     }
 
     writeBitmap("Result.bmp", &newBitmapHeader, &newDipHeader, colorTable, newImageData);
+
+    free(imageData);
+    free(newImageData);
     return 0;
 }
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include "../../Common/image.h"
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -26,6 +28,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -67,6 +70,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -98,6 +102,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -112,6 +117,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
+    traceEnd(&span);
 }
 
 // Mapping the x-y coordinate system to 1D array
@@ -128,35 +134,29 @@ int main() {
 
     readBitmap("Fig3.43(a).bmp", &bitmapHeader, &dipHeader, colorTable, &imageData);
 
+    int width = (int) dipHeader.imageWidth, height = (int) dipHeader.imageHeight;
+    int stride = (int) (floor((double) (dipHeader.imageWidth * 8 + 31) / 32) * 4);
+
+    // The halo repeats the edge pixels, so the border is filtered by the same loop as the inside
+    struct Image *image = createImage(width, height, 1, NULL);
+    loadImage(image, imageData, stride);
+    fillHalo(image, HALO_REPLICATE, 0);
+
     uint8_t *newImageData = malloc(dipHeader.imageSize);
 
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            if (x > 0 && x < dipHeader.imageWidth - 1 && y > 0 && y < dipHeader.imageHeight - 1) {
-                int gx = imageData[m(x + 1, y - 1, dipHeader)] +
-                         2 * imageData[m(x + 1, y, dipHeader)] +
-                         imageData[m(x + 1, y + 1, dipHeader)] -
-                         imageData[m(x - 1, y - 1, dipHeader)] -
-                         2 * imageData[m(x - 1, y, dipHeader)] -
-                         imageData[m(x - 1, y + 1, dipHeader)];
-
-                int gy = imageData[m(x - 1, y - 1, dipHeader)] +
-                         2 * imageData[m(x, y - 1, dipHeader)] +
-                         imageData[m(x + 1, y - 1, dipHeader)] -
-                         imageData[m(x - 1, y + 1, dipHeader)] -
-                         2 * imageData[m(x, y + 1, dipHeader)] -
-                         imageData[m(x + 1, y + 1, dipHeader)];
-
-                int calc = abs(gx) + abs(gy);
-
-                if (calc > 255) {
-                    newImageData[m(x, y, dipHeader)] = 255;
-                } else if (calc < 0) {
-                    newImageData[m(x, y, dipHeader)] = 0;
-                } else {
-                    newImageData[m(x, y, dipHeader)] = calc;
-                }
-            }
+    for (int y = 0; y < height; y++) {
+        const uint8_t *previous = imageRow(image, y - 1), *row = imageRow(image, y), *next = imageRow(image, y + 1);
+        uint8_t *out = newImageData + (size_t) y * stride;
+        for (int x = 0; x < width; x++) {
+            int gx = previous[x + 1] + 2 * row[x + 1] + next[x + 1] -
+                     previous[x - 1] - 2 * row[x - 1] - next[x - 1];
+
+            int gy = previous[x - 1] + 2 * previous[x] + previous[x + 1] -
+                     next[x - 1] - 2 * next[x] - next[x + 1];
+
+            int calc = abs(gx) + abs(gy);
+
+            out[x] = saturatePixel(calc);
         }
     }
 
@@ -164,5 +164,6 @@ int main() {
 
     free(imageData);
     free(newImageData);
+    destroyImage(image);
     return 0;
 }
\ No newline at end of file
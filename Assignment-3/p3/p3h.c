@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include "../../Common/pipeline.h"
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -26,6 +28,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -67,6 +70,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -98,6 +102,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -112,6 +117,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
+    traceEnd(&span);
 }
 
 // Mapping the x-y coordinate system to 1D array
@@ -128,103 +134,30 @@ int main() {
 
     readBitmap("Fig3.43(a).bmp", &bitmapHeader, &dipHeader, colorTable, &imageData);
 
-    uint8_t *cImageData = malloc(dipHeader.imageSize);
-    uint8_t *sobelImageData = malloc(dipHeader.imageSize);
-    uint8_t *blurImageData = malloc(dipHeader.imageSize);
-    uint8_t *powerLawImageData = malloc(dipHeader.imageSize);
-
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            if (x > 0 && x < dipHeader.imageWidth - 1 && y > 0 && y < dipHeader.imageHeight - 1) {
-                int calc = imageData[m(x, y, dipHeader)] * 4 -
-                           (imageData[m(x, y - 1, dipHeader)] +
-                            imageData[m(x, y + 1, dipHeader)] +
-                            imageData[m(x - 1, y, dipHeader)] +
-                            imageData[m(x + 1, y, dipHeader)]);
-
-                calc = imageData[m(x, y, dipHeader)] - calc;
-
-                if (calc > 255) {
-                    cImageData[m(x, y, dipHeader)] = 255;
-                } else if (calc < 0) {
-                    cImageData[m(x, y, dipHeader)] = 0;
-                } else {
-                    cImageData[m(x, y, dipHeader)] = calc;
-                }
-            }
-        }
-    }
-
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            if (x > 0 && x < dipHeader.imageWidth - 1 && y > 0 && y < dipHeader.imageHeight - 1) {
-                int gx = imageData[m(x + 1, y - 1, dipHeader)] +
-                         2 * imageData[m(x + 1, y, dipHeader)] +
-                         imageData[m(x + 1, y + 1, dipHeader)] -
-                         imageData[m(x - 1, y - 1, dipHeader)] -
-                         2 * imageData[m(x - 1, y, dipHeader)] -
-                         imageData[m(x - 1, y + 1, dipHeader)];
-
-                int gy = imageData[m(x - 1, y - 1, dipHeader)] +
-                         2 * imageData[m(x, y - 1, dipHeader)] +
-                         imageData[m(x + 1, y - 1, dipHeader)] -
-                         imageData[m(x - 1, y + 1, dipHeader)] -
-                         2 * imageData[m(x, y + 1, dipHeader)] -
-                         imageData[m(x + 1, y + 1, dipHeader)];
-
-                int calc = abs(gx) + abs(gy);
-
-                if (calc > 255) {
-                    sobelImageData[m(x, y, dipHeader)] = 255;
-                } else if (calc < 0) {
-                    sobelImageData[m(x, y, dipHeader)] = 0;
-                } else {
-                    sobelImageData[m(x, y, dipHeader)] = calc;
-                }
-            }
-        }
-    }
+    struct ImagePool *pool = createImagePool(0);
+    int width = (int) dipHeader.imageWidth, height = (int) dipHeader.imageHeight;
+    int stride = (int) (floor((double) (dipHeader.imageWidth * 8 + 31) / 32) * 4);
 
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            if (x > 0 && x < dipHeader.imageWidth - 1 && y > 0 && y < dipHeader.imageHeight - 1) {
-                blurImageData[m(x, y, dipHeader)] =
-                        (sobelImageData[m(x - 1, y - 1, dipHeader)] +
-                         sobelImageData[m(x, y - 1, dipHeader)] +
-                         sobelImageData[m(x + 1, y - 1, dipHeader)] +
-                         sobelImageData[m(x - 1, y, dipHeader)] +
-                         sobelImageData[m(x, y, dipHeader)] +
-                         sobelImageData[m(x + 1, y, dipHeader)] +
-                         sobelImageData[m(x - 1, y + 1, dipHeader)] +
-                         sobelImageData[m(x, y + 1, dipHeader)] +
-                         sobelImageData[m(x + 1, y + 1, dipHeader)]) / 9;
-            }
-        }
-    }
+    // The Laplacian and the Sobel branch are independent, the point operations after the blur run in its pass
+    struct Pipeline *pipeline = createPipeline(width, height, pool);
+    int image = pipelineInput(pipeline);
+    int c = pipelineStencil(pipeline, image, sharpenRow);
+    int blur = pipelineStencil(pipeline, pipelineStencil(pipeline, image, sobelRow), boxRow);
+    uint8_t gamma[256];
+    powerLawTable(gamma, 0.5);
+    int product = pipelineCombine(pipeline, c, blur, multiplyRows);
+    int powerLaw = pipelineMap(pipeline, pipelineCombine(pipeline, product, image, addRows), gamma);
 
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            int calc = cImageData[m(x, y, dipHeader)] * blurImageData[m(x, y, dipHeader)] / 255 +
-                       imageData[m(x, y, dipHeader)];
-
-            if (calc > 255) {
-                powerLawImageData[m(x, y, dipHeader)] = 255;
-            } else if (calc < 0) {
-                powerLawImageData[m(x, y, dipHeader)] = 0;
-            } else {
-                powerLawImageData[m(x, y, dipHeader)] = calc;
-            }
-
-            powerLawImageData[m(x, y, dipHeader)] = 256.0 * pow(powerLawImageData[m(x, y, dipHeader)] / 256.0, 0.5);
-        }
-    }
+    const uint8_t *inputs[] = {imageData};
+    uint8_t *powerLawImageData = poolAlloc(pool, dipHeader.imageSize);
+    runPipeline(pipeline, inputs, stride, powerLaw, powerLawImageData);
 
     writeBitmap("p3h.bmp", &bitmapHeader, &dipHeader, colorTable, powerLawImageData);
 
+    poolReport(pool, stdout, "Pool");
     free(imageData);
-    free(cImageData);
-    free(sobelImageData);
-    free(blurImageData);
-    free(powerLawImageData);
+    poolFree(pool, powerLawImageData);
+    destroyPipeline(pipeline);
+    destroyImagePool(pool);
     return 0;
-}
\ No newline at end of file
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include "../../Common/remap.h"
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -26,6 +28,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -63,6 +66,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -94,6 +98,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -108,6 +113,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
+    traceEnd(&span);
 }
 
 // Mapping the x-y coordinate system to 1D array
@@ -127,23 +133,13 @@ int main() {
     // Image processing
     // Rotate 5 degree clockwise
     int degree = -5;
+    int halfWidth = (int) dipHeader.imageWidth / 2;
+    int halfHeight = (int) dipHeader.imageWidth / 2;
     uint8_t *newImageData = malloc(dipHeader.imageSize);
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            double radian = degree * acos(-1) / 180; // PI = acos(-1)
-            int halfWidth = (int) dipHeader.imageWidth / 2;
-            int halfHeight = (int) dipHeader.imageWidth / 2;
-            int originX = x - halfWidth;
-            int originY = y - halfHeight;
-            int srcX = (int) (originX * cos(radian) - originY * sin(radian)) + halfWidth;
-            int srcY = (int) (originX * sin(radian) + originY * cos(radian)) + halfHeight;
-            if (srcX >= 0 && srcX < dipHeader.imageWidth && srcY >= 0 && srcY < dipHeader.imageHeight) {
-                newImageData[m(x, y, dipHeader)] = imageData[m(srcX, srcY, dipHeader)];
-            } else {
-                newImageData[m(x, y, dipHeader)] = 0;
-            }
-        }
-    }
+    // The mapping is built once and cached, repeated frames of the same size only gather pixels
+    struct RemapTransform transform = rotationTransform(degree, halfWidth, halfHeight, REMAP_NEAREST);
+    remap(&transform, imageData, newImageData, dipHeader.imageWidth, dipHeader.imageHeight,
+          (unsigned int) (floor((double) (dipHeader.imageWidth * 8 + 31) / 32) * 4), 0);
 
     // Multiply the original image
     for (int y = 0; y < dipHeader.imageHeight; y++) {
@@ -153,5 +149,8 @@ int main() {
     }
 
     writeBitmap("Result.bmp", &bitmapHeader, &dipHeader, colorTable, newImageData);
+
+    free(imageData);
+    free(newImageData);
     return 0;
 }
\ No newline at end of file
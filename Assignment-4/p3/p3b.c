@@ -3,6 +3,9 @@
 #include <stdint.h>
 #include <math.h>
 #include "fft.h"
+#include "../../Common/rfft.h"
+#include "../../Common/spectrum.h"
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -27,6 +30,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -64,6 +68,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -95,6 +100,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -109,6 +115,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
+    traceEnd(&span);
 }
 
 // Mapping the x-y coordinate system to 1D array
@@ -148,63 +155,38 @@ int main() {
         }
     }
 
-    // Show the spectrum and phase
-    COMPLEX *c = (COMPLEX *) malloc(dipHeader.imageWidth * dipHeader.imageHeight * sizeof(COMPLEX));
+    // Show the spectrum and phase, only the non-redundant half of the spectrum is kept
+    int width = (int) dipHeader.imageWidth, height = (int) dipHeader.imageHeight;
+    COMPLEX *c = (COMPLEX *) malloc(height * halfSpectrumWidth(width) * sizeof(COMPLEX));
     if (c == NULL) {
         exit(1);
     }
 
-    // Centering
+    // The spectrum is shown around its zero frequency, the image is not centred
     for (int y = 0; y < dipHeader.imageHeight; y++) {
+        double *row = realRow(c, height - y - 1, width);
         for (int x = 0; x < dipHeader.imageWidth; x++) {
-            c[m(x, y, dipHeader)].real = rotatedImageData[m(x, y, dipHeader)];
-            c[m(x, y, dipHeader)].imag = 0.0;
-            if ((x + y) % 2 == 1) {
-                c[m(x, y, dipHeader)].real = 0.0 - c[m(x, y, dipHeader)].real;
-            }
+            row[x] = rotatedImageData[m(x, y, dipHeader)];
         }
     }
 
-    if (!FFT2D(c, dipHeader.imageHeight, dipHeader.imageWidth, 1)) {
+    if (!RFFT2D(c, height, width, 1)) {
         printf("Stop!\n");
         exit(0);
     }
 
-    // Spectrum
-    double max = 0.0;
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            double value = sqrt(c[m(x, y, dipHeader)].real * c[m(x, y, dipHeader)].real +
-                                c[m(x, y, dipHeader)].imag + c[m(x, y, dipHeader)].imag);
-            if (value > max) {
-                max = value;
-            }
-        }
-    }
-    printf("max = %f\n", max);
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            int temp = (int) (30 * log(1 + 10000 *
-                                           sqrt(c[m(x, y, dipHeader)].real * c[m(x, y, dipHeader)].real +
-                                                c[m(x, y, dipHeader)].imag + c[m(x, y, dipHeader)].imag) / max));
-            if (temp > 255) temp = 255;
-            if (temp < 0) temp = 0;
-            spectrumImageData[m(x, y, dipHeader)] = (uint8_t) temp;
-        }
-    }
-
-    // Phase
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            int temp = (int) (127 * atan2(c[m(x, y, dipHeader)].imag, c[m(x, y, dipHeader)].real) / acos(-1) + 127);
-            if (temp > 255) temp = 255;
-            if (temp < 0) temp = 0;
-            phaseImageData[m(x, y, dipHeader)] = (uint8_t) temp;
-        }
-    }
+    // Spectrum and phase, rows of m()
+    int stride = (int) (floor((double) (dipHeader.imageWidth * 8 + 31) / 32) * 4);
+    printf("max = %f\n", spectrumImages(c, height, width, spectrumImageData, phaseImageData, stride));
 
     writeBitmap("a.bmp", &bitmapHeader, &dipHeader, colorTable, rotatedImageData);
     writeBitmap("b-spectrum.bmp", &bitmapHeader, &dipHeader, colorTable, spectrumImageData);
     writeBitmap("b-phase.bmp", &bitmapHeader, &dipHeader, colorTable, phaseImageData);
+
+    free(imageData);
+    free(rotatedImageData);
+    free(spectrumImageData);
+    free(phaseImageData);
+    free(c);
     return 0;
 }
\ No newline at end of file
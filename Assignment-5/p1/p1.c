@@ -17,6 +17,8 @@
 #include <math.h>
 #include <string.h>
 #include "fft.h"
+#include "../../Common/filterbank.h"
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -41,6 +43,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -82,6 +85,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -113,6 +117,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -127,6 +132,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
+    traceEnd(&span);
 }
 
 // Mapping the x-y coordinate system to 1D array
@@ -135,6 +141,49 @@ unsigned int m(unsigned int x, unsigned int y, struct DipHeader dipHeader) {
            (unsigned int) (floor((double) (dipHeader.imageWidth * 8 + 31) / 32) * 4) + x;
 }
 
+// Largest magnitude of the high-pass filtered spectrum, the mirrored columns have the same magnitudes
+double highpassMax(const COMPLEX *spectrum, const double *lowpass, int width, int height) {
+    size_t count = (size_t) height * halfSpectrumWidth(width);
+    double max = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        double h = 1.0 - lowpass[i];
+        double real = spectrum[i].real * h, imag = spectrum[i].imag * h;
+        double magnitude = real * real + imag * imag;
+        if (magnitude > max) {
+            max = magnitude;
+        }
+    }
+    return sqrt(max);
+}
+
+struct SweepContext {
+    struct BitmapHeader *bitmapHeader;
+    struct DipHeader *dipHeader;
+    uint8_t *colorTable;
+    uint8_t *outputImageData;
+    const int *targets;
+};
+
+// Write ILPF_<radius>.bmp
+void writeLowpass(int index, COMPLEX *c, void *context) {
+    struct SweepContext *sweep = context;
+    struct DipHeader dipHeader = *sweep->dipHeader;
+    int width = (int) dipHeader.imageWidth, height = (int) dipHeader.imageHeight;
+    for (int y = 0; y < height; y++) {
+        double *row = realRow(c, height - y - 1, width);
+        for (int x = 0; x < width; x++) {
+            int temp = (int) row[x];
+            if (temp > 255) temp = 255;
+            if (temp < 0) temp = 0;
+            sweep->outputImageData[m(x, y, dipHeader)] = temp;
+        }
+    }
+
+    char filename[20];
+    snprintf(filename, sizeof filename, "ILPF_%d.bmp", sweep->targets[index]);
+    writeBitmap(filename, sweep->bitmapHeader, sweep->dipHeader, sweep->colorTable, sweep->outputImageData);
+}
+
 int main() {
     struct BitmapHeader bitmapHeader;
     struct DipHeader dipHeader;
@@ -143,132 +192,43 @@ int main() {
 
     readBitmap("testpattern1024.bmp", &bitmapHeader, &dipHeader, colorTable, &imageData);
 
-    int targets[5] = {10, 30, 60, 160, 460};
-    for (int i = 0; i < 5; i++) {
-        uint8_t *spectrumImageData = malloc(dipHeader.imageSize);
-        uint8_t *phaseImageData = malloc(dipHeader.imageSize);
-        uint8_t *invFTc1ImageData = malloc(dipHeader.imageSize);
-        uint8_t *invFTc2ImageData = malloc(dipHeader.imageSize);
-
-        COMPLEX *c1 = (COMPLEX *) malloc(dipHeader.imageWidth * dipHeader.imageHeight * sizeof(COMPLEX));
-        COMPLEX *c2 = (COMPLEX *) malloc(dipHeader.imageWidth * dipHeader.imageHeight * sizeof(COMPLEX));
-        if (c1 == NULL || c2 == NULL) {
-            exit(1);
-        }
-
-        // Centering
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                c1[m(x, y, dipHeader)].real = imageData[m(x, y, dipHeader)];
-                c1[m(x, y, dipHeader)].imag = 0.0;
-                if ((x + y) % 2 == 1) {
-                    c1[m(x, y, dipHeader)].real = 0.0 - c1[m(x, y, dipHeader)].real;
-                }
-            }
-        }
-
-        if (!FFT2D(c1, (int) dipHeader.imageHeight, (int) dipHeader.imageWidth, 1)) {
-            printf("Stop!\n");
-            exit(0);
-        }
-
-        // Set c2 = 0
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                c2[m(x, y, dipHeader)].real = 0.0;
-                c2[m(x, y, dipHeader)].imag = 0.0;
-            }
-        }
-
-        // Remove
-        double d0 = targets[i];
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                double d = sqrt((y - dipHeader.imageHeight / 2) * (y - dipHeader.imageHeight / 2) +
-                                (x - dipHeader.imageWidth / 2) * (x - dipHeader.imageWidth / 2));
-                if (d <= d0) {
-                    c2[m(x, y, dipHeader)].real = c1[m(x, y, dipHeader)].real;
-                    c2[m(x, y, dipHeader)].imag = c1[m(x, y, dipHeader)].imag;
-                    c1[m(x, y, dipHeader)].real = 0.0;
-                    c1[m(x, y, dipHeader)].imag = 0.0;
-                }
-            }
-        }
-
-        // Spectrum
-        double max = 0.0;
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                double value = sqrt(c1[m(x, y, dipHeader)].real * c1[m(x, y, dipHeader)].real +
-                                    c1[m(x, y, dipHeader)].imag + c1[m(x, y, dipHeader)].imag);
-                if (value > max) {
-                    max = value;
-                }
-            }
-        }
-        printf("max = %f\n", max);
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                int temp = (int) (30 * log(1 + 10000 *
-                                               sqrt(c1[m(x, y, dipHeader)].real * c1[m(x, y, dipHeader)].real +
-                                                    c1[m(x, y, dipHeader)].imag + c1[m(x, y, dipHeader)].imag) / max));
-                if (temp > 255) temp = 255;
-                if (temp < 0) temp = 0;
-                spectrumImageData[m(x, y, dipHeader)] = (uint8_t) temp;
-            }
-        }
+    // The test pattern is transformed once, the inverse transforms of two radii run at a time
+    int width = (int) dipHeader.imageWidth, height = (int) dipHeader.imageHeight;
+    struct FilterBank *bank = createFilterBank(width, height, 2);
+    if (bank == NULL) {
+        printf("Stop!\n");
+        exit(0);
+    }
 
-        // Phase
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                int temp = (int) (127 * atan2(c1[m(x, y, dipHeader)].imag, c1[m(x, y, dipHeader)].real) / acos(-1) +
-                                  127);
-                if (temp > 255) temp = 255;
-                if (temp < 0) temp = 0;
-                phaseImageData[m(x, y, dipHeader)] = (uint8_t) temp;
-            }
+    // The filters address the spectrum around its zero frequency, the image is not centred
+    for (int y = 0; y < dipHeader.imageHeight; y++) {
+        double *row = filterBankRow(bank, height - y - 1);
+        for (int x = 0; x < dipHeader.imageWidth; x++) {
+            row[x] = imageData[m(x, y, dipHeader)];
         }
+    }
+    filterBankForward(bank);
 
-        // Inverse Fourier transform over c1
-        if (!FFT2D(c1, (int) dipHeader.imageHeight, (int) dipHeader.imageWidth, -1)) {
-            printf("Stop!\n");
-            exit(0);
-        }
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                if ((x + y) % 2 == 1) {
-                    c1[m(x, y, dipHeader)].real = 0.0 - c1[m(x, y, dipHeader)].real;
-                }
-                int temp = (int) c1[m(x, y, dipHeader)].real;
-                if (temp > 255) temp = 255;
-                if (temp < 0) temp = 0;
-                invFTc1ImageData[m(x, y, dipHeader)] = temp;
-            }
-        }
+    int targets[5] = {10, 30, 60, 160, 460};
+    struct FilterBankFilter filters[5];
+    for (int i = 0; i < 5; i++) {
+        struct FilterSpec ideal = {.band = FILTER_LOWPASS, .response = FILTER_IDEAL, .d0 = targets[i]};
+        filters[i].transfer = NULL;
+        filters[i].context = NULL;
+        filters[i].table = makeTransfer(&ideal, width, height, 1);
+        printf("max = %f\n", highpassMax(bank->spectrum, filters[i].table, width, height));
+    }
 
-        // Inverse Fourier transform over c2
-        if (!FFT2D(c2, (int) dipHeader.imageHeight, (int) dipHeader.imageWidth, -1)) {
-            printf("Stop!\n");
-            exit(0);
-        }
-        for (int y = 0; y < dipHeader.imageHeight; y++) {
-            for (int x = 0; x < dipHeader.imageWidth; x++) {
-                if ((x + y) % 2 == 1) {
-                    c2[m(x, y, dipHeader)].real = 0.0 - c2[m(x, y, dipHeader)].real;
-                }
-                int temp = (int) c2[m(x, y, dipHeader)].real;
-                if (temp > 255) temp = 255;
-                if (temp < 0) temp = 0;
-                invFTc2ImageData[m(x, y, dipHeader)] = temp;
-            }
-        }
+    uint8_t *outputImageData = malloc(dipHeader.imageSize);
+    struct SweepContext sweep = {&bitmapHeader, &dipHeader, colorTable, outputImageData, targets};
+    runFilterBank(bank, filters, 5, NULL, writeLowpass, &sweep);
 
-        char filename[20] = "ILPF_", radii[5];
-        itoa(targets[i], radii, 10);
-        strcat(filename, radii);
-        strcat(filename, ".bmp");
-        writeBitmap(filename, &bitmapHeader, &dipHeader, colorTable, invFTc2ImageData);
+    destroyFilterBank(bank);
+    for (int i = 0; i < 5; i++) {
+        free((double *) filters[i].table);
     }
-
+    freeDistanceMaps();
+    free(outputImageData);
+    free(imageData);
     return 0;
-}
\ No newline at end of file
+}
@@ -16,6 +16,10 @@
 #include <stdint.h>
 #include <math.h>
 #include "fft.h"
+#include "../../Common/rfft.h"
+#include "../../Common/filters.h"
+#include "../../Common/spectrum.h"
+#include "../../Common/trace.h"
 
 struct BitmapHeader {
     char format[2];
@@ -40,6 +44,7 @@ struct DipHeader {
 
 void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                 uint8_t *colorTable, uint8_t **imageData) {
+    struct TraceSpan span = traceBegin("readBitmap");
     FILE *fptr = fopen(filename, "rb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the file!\n");
@@ -81,6 +86,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     *imageData = (uint8_t *) malloc(dipHeader->imageSize);
     fread(*imageData, dipHeader->imageSize, 1, fptr);
     fclose(fptr);
+    traceEnd(&span);
 
     // Print header information
     printf("Format: %c%c\n", bitmapHeader->format[0], bitmapHeader->format[1]);
@@ -112,6 +118,7 @@ void readBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
 
 void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct DipHeader *dipHeader,
                  uint8_t *colorTable, uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
     FILE *fptr = fopen(filename, "wb");
     if (fptr == NULL) {
         fprintf(stderr, "Cannot open the output file!\n");
@@ -126,6 +133,7 @@ void writeBitmap(const char *filename, struct BitmapHeader *bitmapHeader, struct
     fwrite(imageData, dipHeader->imageSize, 1, fptr);
 
     fclose(fptr);
+    traceEnd(&span);
 }
 
 // Mapping the x-y coordinate system to 1D array
@@ -142,43 +150,36 @@ int main() {
 
     readBitmap("Fig0464(a).bmp", &bitmapHeader, &dipHeader, colorTable, &imageData);
 
+    // Only the non-redundant half of each spectrum is kept
+    int width = (int) dipHeader.imageWidth, height = (int) dipHeader.imageHeight;
+    int hw = halfSpectrumWidth(width);
+
     uint8_t *spectrumImageData = malloc(dipHeader.imageSize);
     uint8_t *phaseImageData = malloc(dipHeader.imageSize);
     uint8_t *invFTc1ImageData = malloc(dipHeader.imageSize);
     uint8_t *invFTc2ImageData = malloc(dipHeader.imageSize);
 
-    COMPLEX *c1 = (COMPLEX *) malloc(dipHeader.imageWidth * dipHeader.imageHeight * sizeof(COMPLEX));
-    COMPLEX *c2 = (COMPLEX *) malloc(dipHeader.imageWidth * dipHeader.imageHeight * sizeof(COMPLEX));
+    COMPLEX *c1 = (COMPLEX *) malloc(height * hw * sizeof(COMPLEX));
+    COMPLEX *c2 = (COMPLEX *) malloc(height * hw * sizeof(COMPLEX));
     if (c1 == NULL || c2 == NULL) {
         exit(1);
     }
 
-    // Centering
+    // The filters and the spectrum image address the spectrum around its zero frequency, the
+    // image is not centred
     for (int y = 0; y < dipHeader.imageHeight; y++) {
+        double *row = realRow(c1, height - y - 1, width);
         for (int x = 0; x < dipHeader.imageWidth; x++) {
-            c1[m(x, y, dipHeader)].real = imageData[m(x, y, dipHeader)];
-            c1[m(x, y, dipHeader)].imag = 0.0;
-            if ((x + y) % 2 == 1) {
-                c1[m(x, y, dipHeader)].real = 0.0 - c1[m(x, y, dipHeader)].real;
-            }
+            row[x] = imageData[m(x, y, dipHeader)];
         }
     }
 
-    if (!FFT2D(c1, (int) dipHeader.imageHeight, (int) dipHeader.imageWidth, 1)) {
+    if (!RFFT2D(c1, height, width, 1)) {
         printf("Stop!\n");
         exit(0);
     }
 
-    // Set c2 = 0
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            c2[m(x, y, dipHeader)].real = 0.0;
-            c2[m(x, y, dipHeader)].imag = 0.0;
-        }
-    }
-
-    // Remove
-    int d0 = 9, n = 4;
+    // Remove, c1 keeps the image without the notches and c2 the notches
     int points[8][2] = {
             {43,  83},
             {84,  86},
@@ -189,70 +190,38 @@ int main() {
             {171, 170},
             {213, 173},
     };
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            double h = 1;
-            int isInCircle = 0;
-            for (int i = 0; i < 8; i++) {
-                double dk = sqrt((y - points[i][0]) * (y - points[i][0]) +
-                                 (x - points[i][1]) * (x - points[i][1]));
-                h *= (1 / (1 + pow(d0 / dk, n)));
-                if (dk < d0)
-                    isInCircle = 1;
-            }
-            if (isInCircle) {
-                c2[m(x, y, dipHeader)].real = 1 - (c1[m(x, y, dipHeader)].real * h);
-                c2[m(x, y, dipHeader)].imag = 1 - (c1[m(x, y, dipHeader)].imag * h);
-                c1[m(x, y, dipHeader)].real *= h;
-                c1[m(x, y, dipHeader)].imag *= h;
-            }
-        }
+    // (row, column) of the displayed spectrum -> offset from the zero frequency
+    // Radius 9, order 2: (D0 / Dk)^4 as before
+    double notches[8][2];
+    for (int i = 0; i < 8; i++) {
+        notches[i][0] = points[i][1] - width / 2;
+        notches[i][1] = (height - points[i][0] - 1) - height / 2;
     }
+    struct FilterSpec reject = {.band = FILTER_NOTCHREJECT, .response = FILTER_BUTTERWORTH, .d0 = 9, .order = 2,
+                                .notches = (const double (*)[2]) notches, .notchCount = 8};
+    struct FilterSpec pass = reject;
+    pass.band = FILTER_NOTCHPASS;
+    double *rejectTable = makeTransfer(&reject, width, height, 1);
+    double *passTable = makeTransfer(&pass, width, height, 1);
+    memcpy(c2, c1, height * hw * sizeof(COMPLEX));
+    applyTransfer(c1, rejectTable, width, height, 1);
+    applyTransfer(c2, passTable, width, height, 1);
+    free(rejectTable);
+    free(passTable);
 
-    // Spectrum
-    double max = 0.0;
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            double value = sqrt(c1[m(x, y, dipHeader)].real * c1[m(x, y, dipHeader)].real +
-                                c1[m(x, y, dipHeader)].imag + c1[m(x, y, dipHeader)].imag);
-            if (value > max) {
-                max = value;
-            }
-        }
-    }
-    printf("max = %f\n", max);
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            int temp = (int) (30 * log(1 + 10000 *
-                                           sqrt(c1[m(x, y, dipHeader)].real * c1[m(x, y, dipHeader)].real +
-                                                c1[m(x, y, dipHeader)].imag + c1[m(x, y, dipHeader)].imag) / max));
-            if (temp > 255) temp = 255;
-            if (temp < 0) temp = 0;
-            spectrumImageData[m(x, y, dipHeader)] = (uint8_t) temp;
-        }
-    }
-
-    // Phase
-    for (int y = 0; y < dipHeader.imageHeight; y++) {
-        for (int x = 0; x < dipHeader.imageWidth; x++) {
-            int temp = (int) (127 * atan2(c1[m(x, y, dipHeader)].imag, c1[m(x, y, dipHeader)].real) / acos(-1) + 127);
-            if (temp > 255) temp = 255;
-            if (temp < 0) temp = 0;
-            phaseImageData[m(x, y, dipHeader)] = (uint8_t) temp;
-        }
-    }
+    // Spectrum and phase, rows of m()
+    int stride = (int) (floor((double) (dipHeader.imageWidth * 8 + 31) / 32) * 4);
+    printf("max = %f\n", spectrumImages(c1, height, width, spectrumImageData, phaseImageData, stride));
 
     // Inverse Fourier transform over c1
-    if (!FFT2D(c1, (int) dipHeader.imageHeight, (int) dipHeader.imageWidth, -1)) {
+    if (!RFFT2D(c1, height, width, -1)) {
         printf("Stop!\n");
         exit(0);
     }
     for (int y = 0; y < dipHeader.imageHeight; y++) {
+        double *row = realRow(c1, height - y - 1, width);
         for (int x = 0; x < dipHeader.imageWidth; x++) {
-            if ((x + y) % 2 == 1) {
-                c1[m(x, y, dipHeader)].real = 0.0 - c1[m(x, y, dipHeader)].real;
-            }
-            int temp = (int) c1[m(x, y, dipHeader)].real;
+            int temp = (int) row[x];
             if (temp > 255) temp = 255;
             if (temp < 0) temp = 0;
             invFTc1ImageData[m(x, y, dipHeader)] = temp;
@@ -260,16 +229,14 @@ int main() {
     }
 
     // Inverse Fourier transform over c2
-    if (!FFT2D(c2, (int) dipHeader.imageHeight, (int) dipHeader.imageWidth, -1)) {
+    if (!RFFT2D(c2, height, width, -1)) {
         printf("Stop!\n");
         exit(0);
     }
     for (int y = 0; y < dipHeader.imageHeight; y++) {
+        double *row = realRow(c2, height - y - 1, width);
         for (int x = 0; x < dipHeader.imageWidth; x++) {
-            if ((x + y) % 2 == 1) {
-                c2[m(x, y, dipHeader)].real = 0.0 - c2[m(x, y, dipHeader)].real;
-            }
-            int temp = (int) c2[m(x, y, dipHeader)].real;
+            int temp = (int) row[x];
             if (temp > 255) temp = 255;
             if (temp < 0) temp = 0;
             invFTc2ImageData[m(x, y, dipHeader)] = temp;
@@ -283,5 +250,7 @@ int main() {
     free(phaseImageData);
     free(invFTc1ImageData);
     free(invFTc2ImageData);
+    free(c1);
+    free(c2);
     return 0;
-}
\ No newline at end of file
+}
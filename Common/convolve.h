@@ -0,0 +1,392 @@
+/*
+ * Digital Image Processing
+ * 2D convolution which picks a direct stencil or overlap-add FFT convolution by cost
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type. Link with -pthread.
+ * Images are height rows of width doubles. The kernel is applied as a mask like the 3x3 filters
+ * of Assignment-3, anchored at (ax, ay) = (kernel width / 2, kernel height / 2):
+ * dst(x, y) = sum of weights[j][i] * src(x + i - ax, y + j - ay)
+ * Pixels outside the image are 0 (CONVOLVE_ZERO) or the nearest edge pixel (CONVOLVE_REPLICATE).
+ * Both methods read the source through convolveSample(), so the border is handled the same way
+ * and the results only differ by rounding.
+ *
+ * The direct method builds the border-extended source rows one at a time in a ring of kernel
+ * height rows, and sums the non-zero taps of a kernel row in a register before adding them to
+ * the output row. Build with -mavx2 to do 4 pixels per instruction.
+ * The FFT method cuts the extended image into tiles, transforms every tile padded to N x N with
+ * the real FFT of rfft.h, multiplies it by the spectrum of the kernel and adds the result into
+ * the output. Only one tile spectrum per thread is kept, so the memory does not grow with the
+ * image and images too large for one full-frame transform can be filtered.
+ * convolveCost() estimates both from the number of non-zero taps and the tile size, the
+ * constants are nanoseconds measured at 1024 x 1024. There the direct method wins up to dense
+ * 11 x 11 kernels with AVX2 and 5 x 5 kernels without, the FFT method takes 30-60 ms for any
+ * kernel up to 63 x 63.
+ */
+#ifndef DIP_CONVOLVE_H
+#define DIP_CONVOLVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rfft.h"
+#include "parallel.h"
+#include "trace.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef __AVX2__
+#define CONVOLVE_TAP_COST 0.22    // One multiply-add of the direct method per pixel
+#else
+#define CONVOLVE_TAP_COST 0.95
+#endif
+#define CONVOLVE_ROW_COST 3.0     // Building one extended source pixel and clearing the output
+#define CONVOLVE_FFT_COST 0.55    // Real FFT of N x N, per N^2 * log2(N^2)
+#define CONVOLVE_TILE_COST 10.0   // Filling, multiplying and adding back, per tile pixel
+#define CONVOLVE_TILE_OVERHEAD 4000.0
+#define CONVOLVE_MAX_TILE 4096
+
+enum ConvolveBorder {
+    CONVOLVE_ZERO,
+    CONVOLVE_REPLICATE
+};
+
+enum ConvolveMethod {
+    CONVOLVE_AUTO,
+    CONVOLVE_DIRECT,
+    CONVOLVE_FFT
+};
+
+struct ConvolveKernel {
+    int width;
+    int height;
+    const double *weights;  // height rows of width weights
+};
+
+int convolveThreads = 1;
+
+// Threads used by convolve() from now on
+void setConvolveThreads(int threads) {
+    convolveThreads = threads;
+}
+
+// Source pixel (x, y), which may lie outside the image
+double convolveSample(const double *src, int width, int height, int x, int y, enum ConvolveBorder border) {
+    if (x < 0 || x >= width || y < 0 || y >= height) {
+        if (border == CONVOLVE_ZERO) {
+            return 0.0;
+        }
+        x = x < 0 ? 0 : (x >= width ? width - 1 : x);
+        y = y < 0 ? 0 : (y >= height ? height - 1 : y);
+    }
+    return src[(size_t) y * width + x];
+}
+
+int convolveTaps(const struct ConvolveKernel *kernel) {
+    int taps = 0;
+    for (int i = 0; i < kernel->width * kernel->height; i++) {
+        if (kernel->weights[i] != 0.0) taps++;
+    }
+    return taps;
+}
+
+// Smallest tile edge N of the FFT method, a tile row must only overlap the next one
+int convolveMinTile(const struct ConvolveKernel *kernel) {
+    int n = 2;
+    while (n < kernel->width || n < 2 * kernel->height - 1) n *= 2;
+    return n;
+}
+
+// Estimated nanoseconds of the FFT method with N x N tiles
+double convolveFFTCost(int width, int height, const struct ConvolveKernel *kernel, int n) {
+    int bx = n - kernel->width + 1, by = n - kernel->height + 1;
+    double tiles = ceil((double) (width + kernel->width - 1) / bx) * ceil((double) (height + kernel->height - 1) / by);
+    double pixels = (double) n * n;
+    return tiles * (2 * CONVOLVE_FFT_COST * pixels * log2(pixels) + CONVOLVE_TILE_COST * pixels +
+                    CONVOLVE_TILE_OVERHEAD);
+}
+
+// Tile edge of the lowest cost, up to the first one which holds the whole extended image
+int convolveBestTile(int width, int height, const struct ConvolveKernel *kernel) {
+    int best = convolveMinTile(kernel);
+    for (int n = best * 2; n <= CONVOLVE_MAX_TILE; n *= 2) {
+        if (convolveFFTCost(width, height, kernel, n) < convolveFFTCost(width, height, kernel, best)) {
+            best = n;
+        }
+        if (n - kernel->width + 1 >= width + kernel->width - 1 && n - kernel->height + 1 >= height + kernel->height - 1) {
+            break;
+        }
+    }
+    return best;
+}
+
+// Estimated nanoseconds of one method, CONVOLVE_AUTO gives the cheaper one
+double convolveCost(int width, int height, const struct ConvolveKernel *kernel, enum ConvolveMethod method) {
+    double direct = (double) width * height * convolveTaps(kernel) * CONVOLVE_TAP_COST +
+                    (double) (width + kernel->width - 1) * (height + kernel->height - 1) * CONVOLVE_ROW_COST;
+    double fft = convolveFFTCost(width, height, kernel, convolveBestTile(width, height, kernel));
+    if (method == CONVOLVE_DIRECT) return direct;
+    if (method == CONVOLVE_FFT) return fft;
+    return direct < fft ? direct : fft;
+}
+
+enum ConvolveMethod chooseConvolveMethod(int width, int height, const struct ConvolveKernel *kernel) {
+    return convolveCost(width, height, kernel, CONVOLVE_DIRECT) <= convolveCost(width, height, kernel, CONVOLVE_FFT)
+           ? CONVOLVE_DIRECT : CONVOLVE_FFT;
+}
+
+struct ConvolveContext {
+    const double *src;
+    double *dst;
+    int width;
+    int height;
+    const struct ConvolveKernel *kernel;
+    enum ConvolveBorder border;
+    // Direct method: non-zero taps of every kernel row
+    int *tapOffsets;
+    double *tapWeights;
+    int *tapCounts;
+    // FFT method
+    int n;
+    const COMPLEX *spectrum;     // Of the flipped kernel, scaled for the forward transform
+    COMPLEX **tiles;             // One per thread
+    struct FFTPlan **forward;
+    struct FFTPlan **inverse;
+    int parity;                  // Tile rows done by this pass
+};
+
+// Source row y with the border extension, ax pixels to the left and width - ax - 1 to the right
+void convolveExtendRow(const struct ConvolveContext *context, int y, double *row) {
+    int ax = context->kernel->width / 2, length = context->width + context->kernel->width - 1;
+    if (context->border == CONVOLVE_ZERO && (y < 0 || y >= context->height)) {
+        memset(row, 0, length * sizeof(double));
+        return;
+    }
+    int sy = y < 0 ? 0 : (y >= context->height ? context->height - 1 : y);
+    memcpy(row + ax, context->src + (size_t) sy * context->width, context->width * sizeof(double));
+    for (int x = 0; x < ax; x++) {
+        row[x] = convolveSample(context->src, context->width, context->height, x - ax, sy, context->border);
+    }
+    for (int x = ax + context->width; x < length; x++) {
+        row[x] = convolveSample(context->src, context->width, context->height, x - ax, sy, context->border);
+    }
+}
+
+// out[x] += sum of weights[t] * in[x + offsets[t]] for x < count
+void convolveRow(double *out, const double *in, const int *offsets, const double *weights, int taps, int count) {
+    int x = 0;
+#ifdef __AVX2__
+    for (; x + 4 <= count; x += 4) {
+        __m256d sum = _mm256_loadu_pd(out + x);
+        for (int t = 0; t < taps; t++) {
+            __m256d product = _mm256_mul_pd(_mm256_set1_pd(weights[t]), _mm256_loadu_pd(in + x + offsets[t]));
+            sum = _mm256_add_pd(sum, product);
+        }
+        _mm256_storeu_pd(out + x, sum);
+    }
+#endif
+    for (; x < count; x++) {
+        double sum = out[x];
+        for (int t = 0; t < taps; t++) {
+            sum += weights[t] * in[x + offsets[t]];
+        }
+        out[x] = sum;
+    }
+}
+
+// Output rows [begin, end), every extended source row is built once per range
+void convolveDirectTask(void *context, int begin, int end, int worker) {
+    struct ConvolveContext *convolution = context;
+    int kw = convolution->kernel->width, kh = convolution->kernel->height;
+    int ay = kh / 2, length = convolution->width + kw - 1;
+    double *ring = malloc((size_t) kh * length * sizeof(double));
+    if (ring == NULL) {
+        fprintf(stderr, "Cannot allocate the convolution buffer!\n");
+        exit(1);
+    }
+
+    // Row y + j of the extended image is in slot (y + j) % kh
+    for (int j = 0; j < kh - 1; j++) {
+        convolveExtendRow(convolution, begin + j - ay, ring + (size_t) ((begin + j) % kh) * length);
+    }
+    for (int y = begin; y < end; y++) {
+        convolveExtendRow(convolution, y + kh - 1 - ay, ring + (size_t) ((y + kh - 1) % kh) * length);
+        double *out = convolution->dst + (size_t) y * convolution->width;
+        memset(out, 0, convolution->width * sizeof(double));
+        for (int j = 0; j < kh; j++) {
+            if (convolution->tapCounts[j] == 0) continue;
+            convolveRow(out, ring + (size_t) ((y + j) % kh) * length, convolution->tapOffsets + j * kw,
+                        convolution->tapWeights + j * kw, convolution->tapCounts[j], convolution->width);
+        }
+    }
+    free(ring);
+    (void) worker;
+}
+
+void convolveDirect(struct ConvolveContext *context, int threads) {
+    const struct ConvolveKernel *kernel = context->kernel;
+    int size = kernel->width * kernel->height;
+    context->tapOffsets = malloc(size * sizeof(int));
+    context->tapWeights = malloc(size * sizeof(double));
+    context->tapCounts = calloc(kernel->height, sizeof(int));
+    if (context->tapOffsets == NULL || context->tapWeights == NULL || context->tapCounts == NULL) {
+        fprintf(stderr, "Cannot allocate the convolution taps!\n");
+        exit(1);
+    }
+    for (int j = 0; j < kernel->height; j++) {
+        for (int i = 0; i < kernel->width; i++) {
+            double weight = kernel->weights[j * kernel->width + i];
+            if (weight != 0.0) {
+                int t = j * kernel->width + context->tapCounts[j]++;
+                context->tapOffsets[t] = i;
+                context->tapWeights[t] = weight;
+            }
+        }
+    }
+    parallelFor(context->height, threads, convolveDirectTask, context);
+    free(context->tapOffsets);
+    free(context->tapWeights);
+    free(context->tapCounts);
+}
+
+// Tile rows of one parity, a tile row adds into its own output rows and the next tile row's
+void convolveFFTTask(void *context, int begin, int end, int worker) {
+    struct ConvolveContext *convolution = context;
+    const struct ConvolveKernel *kernel = convolution->kernel;
+    int n = convolution->n, hw = halfSpectrumWidth(n);
+    int kw = kernel->width, kh = kernel->height, ax = kw / 2, ay = kh / 2;
+    int bx = n - kw + 1, by = n - kh + 1;
+    int extWidth = convolution->width + kw - 1, extHeight = convolution->height + kh - 1;
+    COMPLEX *tile = convolution->tiles[worker];
+
+    for (int r = begin; r < end; r++) {
+        int ty = (2 * r + convolution->parity) * by;
+        for (int tx = 0; tx < extWidth; tx += bx) {
+            // The tile of the extended image, padded with zeros to n x n
+            for (int y = 0; y < n; y++) {
+                double *row = realRow(tile, y, n);
+                int ey = ty + y, columns = 0;
+                if (y < by && ey < extHeight) {
+                    columns = extWidth - tx < bx ? extWidth - tx : bx;
+                }
+                for (int x = 0; x < columns; x++) {
+                    row[x] = convolveSample(convolution->src, convolution->width, convolution->height,
+                                            tx + x - ax, ey - ay, convolution->border);
+                }
+                memset(row + columns, 0, (2 * hw - columns) * sizeof(double));
+            }
+
+            executeFFTPlan(convolution->forward[worker], tile);
+            for (size_t i = 0; i < (size_t) n * hw; i++) {
+                COMPLEX a = tile[i], b = convolution->spectrum[i];
+                tile[i].real = a.real * b.real - a.imag * b.imag;
+                tile[i].imag = a.real * b.imag + a.imag * b.real;
+            }
+            executeFFTPlan(convolution->inverse[worker], tile);
+
+            // Full convolution sample (tx + x, ty + y) is output pixel (tx + x - kw + 1, ty + y - kh + 1)
+            for (int y = 0; y < n; y++) {
+                int oy = ty + y - kh + 1;
+                if (oy < 0 || oy >= convolution->height) continue;
+                const double *row = realRow(tile, y, n);
+                double *out = convolution->dst + (size_t) oy * convolution->width;
+                int x0 = kw - 1 - tx > 0 ? kw - 1 - tx : 0;
+                int x1 = convolution->width + kw - 1 - tx < n ? convolution->width + kw - 1 - tx : n;
+                for (int x = x0; x < x1; x++) {
+                    out[tx + x - kw + 1] += row[x];
+                }
+            }
+        }
+    }
+}
+
+void convolveFFT(struct ConvolveContext *context, int threads) {
+    const struct ConvolveKernel *kernel = context->kernel;
+    int n = convolveBestTile(context->width, context->height, kernel);
+    int hw = halfSpectrumWidth(n), by = n - kernel->height + 1;
+    int tileRows = (context->height + kernel->height - 1 + by - 1) / by;
+    if (threads > (tileRows + 1) / 2) threads = (tileRows + 1) / 2;
+    if (threads < 1) threads = 1;
+    size_t size = (size_t) n * hw * sizeof(COMPLEX);
+
+    // Spectrum of the kernel flipped about its origin, times n^2 to undo the scaling of one of
+    // the two forward transforms
+    COMPLEX *spectrum = malloc(size);
+    if (spectrum == NULL) {
+        fprintf(stderr, "Cannot allocate the kernel spectrum!\n");
+        exit(1);
+    }
+    for (int y = 0; y < n; y++) {
+        double *row = realRow(spectrum, y, n);
+        memset(row, 0, 2 * hw * sizeof(double));
+        for (int x = 0; y < kernel->height && x < kernel->width; x++) {
+            row[x] = kernel->weights[(kernel->height - 1 - y) * kernel->width + (kernel->width - 1 - x)] * n * n;
+        }
+    }
+    struct FFTPlan *forward = createFFTPlan(FFT_PLAN_REAL, n, n, 1);
+    executeFFTPlan(forward, spectrum);
+    destroyFFTPlan(forward);
+
+    context->n = n;
+    context->spectrum = spectrum;
+    context->tiles = malloc(threads * sizeof(COMPLEX *));
+    context->forward = malloc(threads * sizeof(struct FFTPlan *));
+    context->inverse = malloc(threads * sizeof(struct FFTPlan *));
+    if (context->tiles == NULL || context->forward == NULL || context->inverse == NULL) {
+        fprintf(stderr, "Cannot allocate the convolution tiles!\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++) {
+        context->tiles[i] = malloc(size);
+        if (context->tiles[i] == NULL) {
+            fprintf(stderr, "Cannot allocate the convolution tiles!\n");
+            exit(1);
+        }
+        context->forward[i] = createFFTPlan(FFT_PLAN_REAL, n, n, 1);
+        context->inverse[i] = createFFTPlan(FFT_PLAN_REAL, n, n, -1);
+    }
+
+    memset(context->dst, 0, (size_t) context->width * context->height * sizeof(double));
+    for (context->parity = 0; context->parity < 2; context->parity++) {
+        parallelFor((tileRows + 1 - context->parity) / 2, threads, convolveFFTTask, context);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        free(context->tiles[i]);
+        destroyFFTPlan(context->forward[i]);
+        destroyFFTPlan(context->inverse[i]);
+    }
+    free(context->tiles);
+    free(context->forward);
+    free(context->inverse);
+    free(spectrum);
+}
+
+/*
+ * dst = src convolved with kernel, see the note for the anchor and the border
+ * dst must not overlap src. Returns 0 when a size is not positive.
+ */
+int convolve(const double *src, double *dst, int width, int height, const struct ConvolveKernel *kernel,
+             enum ConvolveBorder border, enum ConvolveMethod method) {
+    if (width < 1 || height < 1 || kernel->width < 1 || kernel->height < 1) {
+        return 0;
+    }
+    if (method == CONVOLVE_AUTO) {
+        method = chooseConvolveMethod(width, height, kernel);
+    }
+    struct ConvolveContext context = {.src = src, .dst = dst, .width = width, .height = height, .kernel = kernel,
+                                      .border = border};
+    struct TraceSpan span = traceBegin(method == CONVOLVE_DIRECT ? "convolve direct" : "convolve FFT");
+    if (method == CONVOLVE_DIRECT) {
+        convolveDirect(&context, convolveThreads);
+    } else {
+        convolveFFT(&context, convolveThreads);
+    }
+    traceEnd(&span);
+    return 1;
+}
+
+#endif
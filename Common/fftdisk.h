@@ -0,0 +1,409 @@
+/*
+ * Digital Image Processing
+ * Out-of-core 2D FFT and filtering of images which do not fit in memory
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type. Link with -pthread.
+ * The half spectrum of rfft.h is kept in a scratch file mapped into memory, and only a chunk of
+ * rows or a block of columns is held in RAM at a time. The file is ordered by blocks of
+ * blockColumns columns: block k holds the columns from k * blockColumns of every row, row after
+ * row, so every pass reads and writes the file in long sequential runs:
+ * 1. Row pass: chunkRows image rows come from a callback, the real FFT of every row is taken and
+ *    each block gets its columns of the chunk.
+ * 2. Column pass: a block is loaded transposed, its columns are transformed, and filtered and
+ *    transformed back when filtering, and the block is written back.
+ * 3. Inverse row pass: a chunk of rows is gathered from the blocks, inverse transformed and
+ *    handed to a callback.
+ * Every pass has two buffers. While the rows or columns of one are transformed, another thread
+ * of the pool (parallel.h) stores the previous chunk or block to the file and loads the next one
+ * into the other, so the page faults and the writeback overlap with the transforms. The
+ * callbacks are called in row order, one at a time, from any thread.
+ *
+ * The scratch file takes height * (width / 2 + 1) * 16 bytes and is deleted when it is closed
+ * (on POSIX systems as soon as it is mapped). The memory budget covers the two buffers and the
+ * transfer function of one block. The scaling follows FFT2D and the width must be even.
+ */
+#ifndef DIP_FFTDISK_H
+#define DIP_FFTDISK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfft.h"
+#include "filters.h"
+#include "parallel.h"
+#include "trace.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// Fills row y (width values) of the input image
+typedef void (*DiskRowRead)(int y, double *row, void *context);
+// Takes row y (width values) of the output image
+typedef void (*DiskRowWrite)(int y, const double *row, void *context);
+
+struct DiskFFT {
+    int width;
+    int height;
+    int blockColumns;
+    int blockCount;
+    int chunkRows;
+    COMPLEX *spectrum;        // The mapped scratch file
+    size_t size;              // Bytes of the scratch file
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+    struct FFTPlan *forward;  // Real plans of the whole image, their rows and columns are used apart
+    struct FFTPlan *inverse;
+    COMPLEX *buffers[2];
+    int threads;
+};
+
+struct DiskPass {
+    struct DiskFFT *disk;
+    int count;                // Chunks or blocks
+    void (*load)(struct DiskPass *pass, int unit, COMPLEX *buffer);
+    void (*compute)(struct DiskPass *pass, int unit, COMPLEX *buffer);
+    void (*store)(struct DiskPass *pass, int unit, COMPLEX *buffer);
+    DiskRowRead read;
+    DiskRowWrite write;
+    void *context;
+    // Column pass
+    int forward;
+    const struct FilterSpec *spec;
+    int inverse;
+    const double *table;      // Transfer function of the block being transformed
+    COMPLEX *columns;
+    int blockWidth;
+};
+
+// Unit compute is transformed in one buffer while store and load go through the other
+struct DiskStep {
+    struct DiskPass *pass;
+    int compute;
+    int store;
+    int load;
+    COMPLEX *buffers[2];
+};
+
+// Columns of block k
+int diskBlockWidth(const struct DiskFFT *disk, int k) {
+    int hw = halfSpectrumWidth(disk->width), first = k * disk->blockColumns;
+    return hw - first < disk->blockColumns ? hw - first : disk->blockColumns;
+}
+
+COMPLEX *diskBlock(const struct DiskFFT *disk, int k) {
+    return disk->spectrum + (size_t) k * disk->blockColumns * disk->height;
+}
+
+// Value of the half spectrum at column u, row v, once diskFFTForward() is done
+COMPLEX diskSpectrumAt(const struct DiskFFT *disk, int u, int v) {
+    int k = u / disk->blockColumns;
+    return diskBlock(disk, k)[(size_t) v * diskBlockWidth(disk, k) + u % disk->blockColumns];
+}
+
+int mapDiskScratch(struct DiskFFT *disk, const char *path) {
+#ifdef _WIN32
+    disk->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (disk->file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    disk->mapping = CreateFileMappingA(disk->file, NULL, PAGE_READWRITE, (DWORD) ((unsigned long long) disk->size >> 32),
+                                       (DWORD) disk->size, NULL);
+    disk->spectrum = disk->mapping == NULL ? NULL : MapViewOfFile(disk->mapping, FILE_MAP_ALL_ACCESS, 0, 0, disk->size);
+    if (disk->spectrum == NULL) {
+        if (disk->mapping != NULL) CloseHandle(disk->mapping);
+        CloseHandle(disk->file);
+        return 0;
+    }
+    return 1;
+#else
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return 0;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, (off_t) disk->size) == 0) {
+        map = mmap(NULL, disk->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    // The mapping keeps the file alive, so it goes away with the mapping or the process
+    close(fd);
+    unlink(path);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    madvise(map, disk->size, MADV_SEQUENTIAL);
+    disk->spectrum = map;
+    return 1;
+#endif
+}
+
+void unmapDiskScratch(struct DiskFFT *disk) {
+#ifdef _WIN32
+    UnmapViewOfFile(disk->spectrum);
+    CloseHandle(disk->mapping);
+    CloseHandle(disk->file);
+#else
+    munmap(disk->spectrum, disk->size);
+#endif
+}
+
+/*
+ * Out-of-core transform of a width x height image, the scratch file is created at path
+ * memory is the budget in bytes for the buffers, see the note
+ * Returns NULL when the width is odd, the size is not positive or the file cannot be mapped
+ */
+struct DiskFFT *createDiskFFT(int width, int height, const char *path, size_t memory) {
+    if (width < 2 || height < 1 || width % 2 != 0) {
+        return NULL;
+    }
+    int hw = halfSpectrumWidth(width);
+    struct DiskFFT *disk = calloc(1, sizeof(struct DiskFFT));
+    disk->width = width;
+    disk->height = height;
+    disk->size = (size_t) height * hw * sizeof(COMPLEX);
+
+    // Two buffers of 2 / 5 of the budget, the transfer function of a block takes the last fifth
+    size_t buffer = memory / 5 * 2;
+    size_t rows = buffer / (hw * sizeof(COMPLEX)), columns = buffer / (height * sizeof(COMPLEX));
+    disk->chunkRows = rows < 1 ? 1 : (rows > (size_t) height ? height : (int) rows);
+    disk->blockColumns = columns < 1 ? 1 : (columns > (size_t) hw ? hw : (int) columns);
+    disk->blockCount = (hw + disk->blockColumns - 1) / disk->blockColumns;
+    size_t chunkSize = (size_t) disk->chunkRows * hw, blockSize = (size_t) disk->blockColumns * height;
+    size_t bufferSize = (chunkSize > blockSize ? chunkSize : blockSize) * sizeof(COMPLEX);
+
+    if (!mapDiskScratch(disk, path)) {
+        fprintf(stderr, "Cannot map the scratch file!\n");
+        free(disk);
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        disk->buffers[i] = malloc(bufferSize);
+        if (disk->buffers[i] == NULL) {
+            fprintf(stderr, "Cannot allocate the out-of-core buffers!\n");
+            exit(1);
+        }
+    }
+    disk->forward = createFFTPlan(FFT_PLAN_REAL, width, height, 1);
+    disk->inverse = createFFTPlan(FFT_PLAN_REAL, width, height, -1);
+
+    // Work buffers for the threads, but not the transpose buffer of setFFTPlanThreads(), which
+    // would hold the whole spectrum
+    disk->threads = fftThreads < 1 ? 1 : (fftThreads > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : fftThreads);
+    disk->forward->threads = disk->inverse->threads = disk->threads;
+    allocateFFTPlanWork(disk->forward);
+    allocateFFTPlanWork(disk->inverse);
+    return disk;
+}
+
+void destroyDiskFFT(struct DiskFFT *disk) {
+    if (disk == NULL) return;
+    unmapDiskScratch(disk);
+    free(disk->buffers[0]);
+    free(disk->buffers[1]);
+    destroyFFTPlan(disk->forward);
+    destroyFFTPlan(disk->inverse);
+    free(disk);
+}
+
+// Item 0 is the transform, item 1 the I/O, so two threads of the pool can take one each
+void diskStepTask(void *context, int begin, int end, int worker) {
+    struct DiskStep *step = context;
+    for (int i = begin; i < end; i++) {
+        struct TraceSpan span = traceBegin(i == 0 ? "disk compute" : "disk I/O");
+        if (i == 0) {
+            step->pass->compute(step->pass, step->compute, step->buffers[0]);
+        } else {
+            if (step->store >= 0) {
+                step->pass->store(step->pass, step->store, step->buffers[1]);
+            }
+            if (step->load < step->pass->count) {
+                step->pass->load(step->pass, step->load, step->buffers[1]);
+            }
+        }
+        traceEnd(&span);
+    }
+    (void) worker;
+}
+
+// Unit i is computed in buffer i % 2 while unit i - 1 is stored and unit i + 1 loaded in the other
+void runDiskPass(struct DiskPass *pass) {
+    COMPLEX **buffers = pass->disk->buffers;
+    pass->load(pass, 0, buffers[0]);
+    for (int i = 0; i < pass->count; i++) {
+        struct DiskStep step = {pass, i, i - 1, i + 1, {buffers[i % 2], buffers[(i + 1) % 2]}};
+        // With a single thread the I/O is still done, just not at the same time
+        parallelForGrain(2, 2, 1, diskStepTask, &step);
+    }
+    pass->store(pass, pass->count - 1, buffers[(pass->count - 1) % 2]);
+}
+
+int diskChunkEnd(const struct DiskFFT *disk, int chunk) {
+    int end = (chunk + 1) * disk->chunkRows;
+    return end < disk->height ? end : disk->height;
+}
+
+void diskReadRows(struct DiskPass *pass, int chunk, COMPLEX *buffer) {
+    int first = chunk * pass->disk->chunkRows;
+    for (int y = first; y < diskChunkEnd(pass->disk, chunk); y++) {
+        pass->read(y, realRow(buffer, y - first, pass->disk->width), pass->context);
+    }
+}
+
+void diskWriteRows(struct DiskPass *pass, int chunk, COMPLEX *buffer) {
+    int first = chunk * pass->disk->chunkRows;
+    for (int y = first; y < diskChunkEnd(pass->disk, chunk); y++) {
+        pass->write(y, realRow(buffer, y - first, pass->disk->width), pass->context);
+    }
+}
+
+// Every block gets its columns of the chunk
+void diskScatterRows(struct DiskPass *pass, int chunk, COMPLEX *buffer) {
+    struct DiskFFT *disk = pass->disk;
+    int hw = halfSpectrumWidth(disk->width), first = chunk * disk->chunkRows;
+    for (int k = 0; k < disk->blockCount; k++) {
+        int columns = diskBlockWidth(disk, k);
+        COMPLEX *block = diskBlock(disk, k);
+        for (int y = first; y < diskChunkEnd(disk, chunk); y++) {
+            memcpy(block + (size_t) y * columns, buffer + (size_t) (y - first) * hw + k * disk->blockColumns,
+                   columns * sizeof(COMPLEX));
+        }
+    }
+}
+
+void diskGatherRows(struct DiskPass *pass, int chunk, COMPLEX *buffer) {
+    struct DiskFFT *disk = pass->disk;
+    int hw = halfSpectrumWidth(disk->width), first = chunk * disk->chunkRows;
+    for (int k = 0; k < disk->blockCount; k++) {
+        int columns = diskBlockWidth(disk, k);
+        const COMPLEX *block = diskBlock(disk, k);
+        for (int y = first; y < diskChunkEnd(disk, chunk); y++) {
+            memcpy(buffer + (size_t) (y - first) * hw + k * disk->blockColumns, block + (size_t) y * columns,
+                   columns * sizeof(COMPLEX));
+        }
+    }
+}
+
+void diskRowsForward(struct DiskPass *pass, int chunk, COMPLEX *buffer) {
+    struct FFTPassContext rows = {.plan = pass->disk->forward, .src = buffer};
+    int count = diskChunkEnd(pass->disk, chunk) - chunk * pass->disk->chunkRows;
+    parallelFor(count, pass->disk->threads, planRowsTask, &rows);
+}
+
+void diskRowsInverse(struct DiskPass *pass, int chunk, COMPLEX *buffer) {
+    struct FFTPassContext rows = {.plan = pass->disk->inverse, .src = buffer};
+    int count = diskChunkEnd(pass->disk, chunk) - chunk * pass->disk->chunkRows;
+    parallelFor(count, pass->disk->threads, planRowsTask, &rows);
+}
+
+// Block k into buffer, one column after the other
+void diskLoadBlock(struct DiskPass *pass, int k, COMPLEX *buffer) {
+    struct DiskFFT *disk = pass->disk;
+    int columns = diskBlockWidth(disk, k), height = disk->height;
+    const COMPLEX *block = diskBlock(disk, k);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < columns; x++) {
+            buffer[(size_t) x * height + y] = block[(size_t) y * columns + x];
+        }
+    }
+}
+
+void diskStoreBlock(struct DiskPass *pass, int k, COMPLEX *buffer) {
+    struct DiskFFT *disk = pass->disk;
+    int columns = diskBlockWidth(disk, k), height = disk->height;
+    COMPLEX *block = diskBlock(disk, k);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < columns; x++) {
+            block[(size_t) y * columns + x] = buffer[(size_t) x * height + y];
+        }
+    }
+}
+
+void diskColumnsTask(void *context, int begin, int end, int worker) {
+    struct DiskPass *pass = context;
+    struct DiskFFT *disk = pass->disk;
+    int height = disk->height;
+    for (int x = begin; x < end; x++) {
+        COMPLEX *column = pass->columns + (size_t) x * height;
+        if (pass->forward) {
+            executeFFT1D(&disk->forward->columns, column, fftPlanWork(disk->forward, worker), 1);
+        }
+        if (pass->table != NULL) {
+            for (int y = 0; y < height; y++) {
+                double h = pass->table[(size_t) y * pass->blockWidth + x];
+                column[y].real *= h;
+                column[y].imag *= h;
+            }
+        }
+        if (pass->inverse) {
+            executeFFT1D(&disk->inverse->columns, column, fftPlanWork(disk->inverse, worker), -1);
+        }
+    }
+}
+
+void diskColumns(struct DiskPass *pass, int k, COMPLEX *buffer) {
+    struct DiskFFT *disk = pass->disk;
+    pass->blockWidth = diskBlockWidth(disk, k);
+    pass->columns = buffer;
+    double *table = NULL;
+    if (pass->spec != NULL) {
+        table = makeTransferColumns(pass->spec, disk->width, disk->height, 1, k * disk->blockColumns, pass->blockWidth);
+    }
+    pass->table = table;
+    parallelFor(pass->blockWidth, disk->threads, diskColumnsTask, pass);
+    free(table);
+}
+
+void runDiskColumns(struct DiskFFT *disk, int forward, const struct FilterSpec *spec, int inverse) {
+    struct DiskPass pass = {.disk = disk, .count = disk->blockCount, .load = diskLoadBlock, .compute = diskColumns,
+                            .store = diskStoreBlock, .forward = forward, .spec = spec, .inverse = inverse};
+    runDiskPass(&pass);
+}
+
+void runDiskRowsForward(struct DiskFFT *disk, DiskRowRead read, void *context) {
+    struct DiskPass pass = {.disk = disk, .count = (disk->height + disk->chunkRows - 1) / disk->chunkRows,
+                            .load = diskReadRows, .compute = diskRowsForward, .store = diskScatterRows, .read = read,
+                            .context = context};
+    runDiskPass(&pass);
+}
+
+void runDiskRowsInverse(struct DiskFFT *disk, DiskRowWrite write, void *context) {
+    struct DiskPass pass = {.disk = disk, .count = (disk->height + disk->chunkRows - 1) / disk->chunkRows,
+                            .load = diskGatherRows, .compute = diskRowsInverse, .store = diskWriteRows, .write = write,
+                            .context = context};
+    runDiskPass(&pass);
+}
+
+// Image rows from read -> half spectrum in the scratch file
+void diskFFTForward(struct DiskFFT *disk, DiskRowRead read, void *context) {
+    runDiskRowsForward(disk, read, context);
+    runDiskColumns(disk, 1, NULL, 0);
+}
+
+// Half spectrum in the scratch file -> image rows to write
+void diskFFTInverse(struct DiskFFT *disk, DiskRowWrite write, void *context) {
+    runDiskColumns(disk, 0, NULL, 1);
+    runDiskRowsInverse(disk, write, context);
+}
+
+/*
+ * Filter the image rows from read by a transfer function of filters.h and give the result to
+ * write, like applyTransfer() on the half spectrum. The forward column transform, the filter
+ * and the inverse column transform are done on a block while it is loaded, so the scratch file
+ * is only passed over three times.
+ */
+void diskFFTFilter(struct DiskFFT *disk, const struct FilterSpec *spec, DiskRowRead read, DiskRowWrite write,
+                   void *context) {
+    runDiskRowsForward(disk, read, context);
+    runDiskColumns(disk, 1, spec, 1);
+    runDiskRowsInverse(disk, write, context);
+}
+
+#endif
@@ -0,0 +1,821 @@
+/*
+ * Digital Image Processing
+ * Planned 2D FFT with precomputed twiddle factors, permutation tables and scratch buffers
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type.
+ * A plan is built once per (kind, width, height, direction). Executing it does no allocation
+ * and no trigonometry, but it uses the scratch buffers of the plan, so one plan must not be
+ * executed by two threads at the same time.
+ *
+ * Any size is accepted. Powers of 2 use the radix-2 kernel. Other lengths are split into
+ * radix 4, 2, 3 and 5 stages (7, 11 and 13 with a generic butterfly), and lengths with a larger
+ * prime factor use Bluestein's algorithm on top of a power-of-2 transform.
+ * The scaling follows FFT2D: the forward transform is divided by width * height.
+ *
+ * Plans can be kept on disk: when the environment variable DIP_FFT_PLAN_DIR names a directory,
+ * getFFTPlan() loads the tables from there and saves the ones it had to build.
+ * The file name carries the size, the direction and the CPU features, e.g.
+ * fft-complex-1024x1024-f-avx2.plan
+ *
+ * With more than one thread (setFFTThreads() or setFFTPlanThreads()) the rows are transformed
+ * in parallel, the array is transposed in cache-sized blocks into a buffer owned by the plan,
+ * the former columns are transformed as rows, and the result is transposed back.
+ * Link with -pthread.
+ */
+#ifndef DIP_FFTPLAN_H
+#define DIP_FFTPLAN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "parallel.h"
+#include "trace.h"
+
+#define FFT_PLAN_CACHE_SIZE 8
+#define FFT_PLAN_MAGIC "DIPFFTPLAN2"
+#define FFT_TRANSPOSE_BLOCK 16
+#define FFT_MAX_RADIX 13
+#define FFT_MAX_FACTORS 32
+
+enum FFTPlanKind {
+    FFT_PLAN_COMPLEX,  // Full COMPLEX array, same layout as FFT2D
+    FFT_PLAN_REAL      // Real image <-> half spectrum, see rfft.h
+};
+
+struct FFTPlan1D {
+    int n;
+    int factorCount;               // 0 for powers of 2 and for Bluestein
+    int factors[FFT_MAX_FACTORS];  // Radix of every stage, first stage first
+    int *permutation;              // Source index of every position, bit or digit reversed
+    int *cycles;                   // Leaders of the permutation cycles, mixed radix only
+    int cycleCount;
+    COMPLEX *twiddle;              // exp(-2 * PI * i * k / n) for k < n
+    struct FFTPlan1D *bluestein;   // Power-of-2 plan of length workSize
+    COMPLEX *chirp;                // exp(-PI * i * k * k / n) for k < n
+    COMPLEX *kernel;               // Transform of the conjugate chirp, divided by workSize
+    int workSize;                  // COMPLEX values of scratch needed by executeFFT1D()
+};
+
+struct FFTPlan {
+    enum FFTPlanKind kind;
+    int width;
+    int height;
+    int dir;
+    struct FFTPlan1D rows;     // Length width, or width / 2 for real plans
+    struct FFTPlan1D columns;  // Length height
+    COMPLEX *split;            // exp(-2 * PI * i * k / width) for k <= width / 4, real plans only
+    COMPLEX *scratch;          // FFT_TRANSPOSE_BLOCK columns
+    int threads;
+    COMPLEX *transposed;       // Transposed copy of the array, only with more than one thread
+    COMPLEX *work;             // workSize COMPLEX values per thread
+    int workSize;
+};
+
+struct FFTPlan *fftPlanCache[FFT_PLAN_CACHE_SIZE];
+int fftThreads = 1;
+
+int isPowerOf2(int n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+COMPLEX *fftTwiddles(int n, int count) {
+    COMPLEX *twiddle = malloc((count + 1) * sizeof(COMPLEX));
+    for (int k = 0; k <= count; k++) {
+        twiddle[k].real = cos(2 * acos(-1) * k / n);
+        twiddle[k].imag = -sin(2 * acos(-1) * k / n);
+    }
+    return twiddle;
+}
+
+// Radix of every stage, or 0 when a prime factor is too large for a butterfly
+int fftFactorize(int n, int *factors) {
+    int count = 0;
+    while (n % 4 == 0) {
+        factors[count++] = 4;
+        n /= 4;
+    }
+    for (int radix = 2; n > 1 && radix <= FFT_MAX_RADIX; radix++) {
+        while (n % radix == 0) {
+            factors[count++] = radix;
+            n /= radix;
+        }
+    }
+    return n == 1 ? count : 0;
+}
+
+// Permutation for the in-place mixed-radix stages, the last stage is the outermost digit
+void fftDigitReversal(struct FFTPlan1D *plan) {
+    int n = plan->n;
+    for (int p = 0; p < n; p++) {
+        int source = 0, scale = 1, rest = p, length = n;
+        for (int s = plan->factorCount - 1; s >= 0; s--) {
+            length /= plan->factors[s];
+            source += scale * (rest / length);
+            scale *= plan->factors[s];
+            rest %= length;
+        }
+        plan->permutation[p] = source;
+    }
+}
+
+// Remember one position of every cycle, so the permutation can be applied without a second buffer
+void fftPermutationCycles(struct FFTPlan1D *plan) {
+    int n = plan->n;
+    char *visited = calloc(n, 1);
+    plan->cycles = malloc(n * sizeof(int));
+    plan->cycleCount = 0;
+    for (int p = 0; p < n; p++) {
+        if (visited[p]) continue;
+        for (int q = p; !visited[q]; q = plan->permutation[q]) {
+            visited[q] = 1;
+        }
+        if (plan->permutation[p] != p) {
+            plan->cycles[plan->cycleCount++] = p;
+        }
+    }
+    free(visited);
+}
+
+void executeFFT1D(const struct FFTPlan1D *plan, COMPLEX *x, COMPLEX *work, int dir);
+
+void initFFTPlan1D(struct FFTPlan1D *plan, int n) {
+    memset(plan, 0, sizeof(struct FFTPlan1D));
+    plan->n = n;
+
+    if (isPowerOf2(n)) {
+        plan->permutation = malloc(n * sizeof(int));
+        plan->twiddle = fftTwiddles(n, n / 2);
+        for (int i = 0, j = 0; i < n; i++) {
+            plan->permutation[i] = j;
+            int bit = n >> 1;
+            for (; bit && (j & bit); bit >>= 1) {
+                j ^= bit;
+            }
+            j ^= bit;
+        }
+        return;
+    }
+
+    plan->factorCount = fftFactorize(n, plan->factors);
+    if (plan->factorCount > 0) {
+        plan->permutation = malloc(n * sizeof(int));
+        plan->twiddle = fftTwiddles(n, n - 1);
+        fftDigitReversal(plan);
+        fftPermutationCycles(plan);
+        return;
+    }
+
+    // Bluestein: X[k] = chirp[k] * sum(x[j] * chirp[j] * conj(chirp[k - j])), a convolution of length >= 2n - 1
+    int m = 1;
+    while (m < 2 * n - 1) m <<= 1;
+    plan->workSize = m;
+    plan->bluestein = malloc(sizeof(struct FFTPlan1D));
+    initFFTPlan1D(plan->bluestein, m);
+    plan->chirp = malloc(n * sizeof(COMPLEX));
+    for (int k = 0; k < n; k++) {
+        // k * k modulo 2n keeps the angle small and exact
+        double angle = acos(-1) * (double) ((long long) k * k % (2LL * n)) / n;
+        plan->chirp[k].real = cos(angle);
+        plan->chirp[k].imag = -sin(angle);
+    }
+    plan->kernel = calloc(m, sizeof(COMPLEX));
+    for (int k = 0; k < n; k++) {
+        plan->kernel[k].real = plan->chirp[k].real / m;
+        plan->kernel[k].imag = -plan->chirp[k].imag / m;
+        if (k > 0) {
+            plan->kernel[m - k] = plan->kernel[k];
+        }
+    }
+    executeFFT1D(plan->bluestein, plan->kernel, NULL, 1);
+}
+
+void freeFFTPlan1D(struct FFTPlan1D *plan) {
+    if (plan->bluestein != NULL) {
+        freeFFTPlan1D(plan->bluestein);
+        free(plan->bluestein);
+    }
+    free(plan->permutation);
+    free(plan->cycles);
+    free(plan->twiddle);
+    free(plan->chirp);
+    free(plan->kernel);
+}
+
+void fftRadix2Stages(const struct FFTPlan1D *plan, COMPLEX *x, double sign) {
+    int n = plan->n;
+    for (int i = 0; i < n; i++) {
+        int j = plan->permutation[i];
+        if (i < j) {
+            COMPLEX temp = x[i];
+            x[i] = x[j];
+            x[j] = temp;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int k = 0; k < len / 2; k++) {
+                double wr = plan->twiddle[k * step].real, wi = sign * plan->twiddle[k * step].imag;
+                COMPLEX *a = &x[i + k], *b = &x[i + k + len / 2];
+                double tr = b->real * wr - b->imag * wi;
+                double ti = b->real * wi + b->imag * wr;
+                b->real = a->real - tr;
+                b->imag = a->imag - ti;
+                a->real += tr;
+                a->imag += ti;
+            }
+        }
+    }
+}
+
+// Radix-r DFT of a[0..r-1] in place, with exp(-2 * PI * i / r) = twiddle[n / r]
+void fftButterfly(COMPLEX *a, int r, const COMPLEX *twiddle, int n, double sign) {
+    if (r == 2) {
+        COMPLEX t = a[1];
+        a[1].real = a[0].real - t.real;
+        a[1].imag = a[0].imag - t.imag;
+        a[0].real += t.real;
+        a[0].imag += t.imag;
+    } else if (r == 3) {
+        double tr = a[1].real + a[2].real, ti = a[1].imag + a[2].imag;
+        double dr = a[1].real - a[2].real, di = a[1].imag - a[2].imag;
+        double s = -sign * sqrt(3) / 2;
+        double mr = a[0].real - tr / 2, mi = a[0].imag - ti / 2;
+        a[0].real += tr;
+        a[0].imag += ti;
+        a[1].real = mr - s * di;
+        a[1].imag = mi + s * dr;
+        a[2].real = mr + s * di;
+        a[2].imag = mi - s * dr;
+    } else if (r == 4) {
+        double t0r = a[0].real + a[2].real, t0i = a[0].imag + a[2].imag;
+        double t1r = a[0].real - a[2].real, t1i = a[0].imag - a[2].imag;
+        double t2r = a[1].real + a[3].real, t2i = a[1].imag + a[3].imag;
+        // (a1 - a3) * exp(-PI * i / 2), or its conjugate for the inverse
+        double t3r = sign * (a[1].imag - a[3].imag), t3i = -sign * (a[1].real - a[3].real);
+        a[0].real = t0r + t2r;
+        a[0].imag = t0i + t2i;
+        a[2].real = t0r - t2r;
+        a[2].imag = t0i - t2i;
+        a[1].real = t1r + t3r;
+        a[1].imag = t1i + t3i;
+        a[3].real = t1r - t3r;
+        a[3].imag = t1i - t3i;
+    } else {
+        COMPLEX in[FFT_MAX_RADIX];
+        memcpy(in, a, r * sizeof(COMPLEX));
+        for (int m = 0; m < r; m++) {
+            double sr = 0.0, si = 0.0;
+            for (int j = 0; j < r; j++) {
+                const COMPLEX *w = &twiddle[(j * m % r) * (n / r)];
+                sr += in[j].real * w->real - in[j].imag * sign * w->imag;
+                si += in[j].real * sign * w->imag + in[j].imag * w->real;
+            }
+            a[m].real = sr;
+            a[m].imag = si;
+        }
+    }
+}
+
+void fftMixedRadixStages(const struct FFTPlan1D *plan, COMPLEX *x, double sign) {
+    int n = plan->n;
+    for (int c = 0; c < plan->cycleCount; c++) {
+        int start = plan->cycles[c], p = start;
+        COMPLEX first = x[start];
+        for (int q = plan->permutation[p]; q != start; p = q, q = plan->permutation[q]) {
+            x[p] = x[q];
+        }
+        x[p] = first;
+    }
+
+    int length = 1;
+    for (int s = 0; s < plan->factorCount; s++) {
+        int r = plan->factors[s], span = length * r, step = n / span;
+        COMPLEX a[FFT_MAX_RADIX];
+        for (int base = 0; base < n; base += span) {
+            for (int k = 0; k < length; k++) {
+                for (int j = 0; j < r; j++) {
+                    COMPLEX v = x[base + k + j * length];
+                    const COMPLEX *w = &plan->twiddle[j * k * step];
+                    a[j].real = v.real * w->real - v.imag * sign * w->imag;
+                    a[j].imag = v.real * sign * w->imag + v.imag * w->real;
+                }
+                fftButterfly(a, r, plan->twiddle, n, sign);
+                for (int j = 0; j < r; j++) {
+                    x[base + k + j * length] = a[j];
+                }
+            }
+        }
+        length = span;
+    }
+}
+
+/*
+ * Unscaled in-place FFT, dir = 1 forward and -1 inverse
+ * work holds plan->workSize COMPLEX values and may be NULL when that is 0
+ */
+void executeFFT1D(const struct FFTPlan1D *plan, COMPLEX *x, COMPLEX *work, int dir) {
+    double sign = dir == 1 ? 1.0 : -1.0;
+    if (plan->bluestein == NULL) {
+        if (plan->factorCount == 0) {
+            fftRadix2Stages(plan, x, sign);
+        } else {
+            fftMixedRadixStages(plan, x, sign);
+        }
+        return;
+    }
+
+    // The inverse is the conjugate of the forward transform of the conjugate
+    int n = plan->n, m = plan->workSize;
+    for (int k = 0; k < n; k++) {
+        double xr = x[k].real, xi = sign * x[k].imag;
+        work[k].real = xr * plan->chirp[k].real - xi * plan->chirp[k].imag;
+        work[k].imag = xr * plan->chirp[k].imag + xi * plan->chirp[k].real;
+    }
+    memset(work + n, 0, (m - n) * sizeof(COMPLEX));
+    executeFFT1D(plan->bluestein, work, NULL, 1);
+    for (int k = 0; k < m; k++) {
+        double wr = work[k].real, wi = work[k].imag;
+        work[k].real = wr * plan->kernel[k].real - wi * plan->kernel[k].imag;
+        work[k].imag = wr * plan->kernel[k].imag + wi * plan->kernel[k].real;
+    }
+    executeFFT1D(plan->bluestein, work, NULL, -1);
+    for (int k = 0; k < n; k++) {
+        double wr = work[k].real, wi = work[k].imag;
+        x[k].real = wr * plan->chirp[k].real - wi * plan->chirp[k].imag;
+        x[k].imag = sign * (wr * plan->chirp[k].imag + wi * plan->chirp[k].real);
+    }
+}
+
+/*
+ * Split the half-length transform Z of z[k] = x[2k] + i * x[2k + 1] into X[0..n/2]
+ * X[k] = (Z[k] + conj(Z[n/2 - k])) / 2 - i * W^k * (Z[k] - conj(Z[n/2 - k])) / 2, W = exp(-2 * PI * i / n)
+ */
+void realForwardPost(COMPLEX *row, int n, const COMPLEX *split, double scale) {
+    int half = n / 2;
+    double r0 = row[0].real, i0 = row[0].imag;
+    row[0].real = (r0 + i0) * scale;
+    row[0].imag = 0.0;
+    row[half].real = (r0 - i0) * scale;
+    row[half].imag = 0.0;
+    for (int k = 1; k <= half / 2; k++) {
+        COMPLEX a = row[k], b = row[half - k];
+        double er = (a.real + b.real) / 2, ei = (a.imag - b.imag) / 2;
+        double orr = (a.imag + b.imag) / 2, oi = (b.real - a.real) / 2;
+        double wr = split[k].real, wi = split[k].imag;
+        double tr = orr * wr - oi * wi, ti = orr * wi + oi * wr;
+        row[k].real = (er + tr) * scale;
+        row[k].imag = (ei + ti) * scale;
+        row[half - k].real = (er - tr) * scale;
+        row[half - k].imag = (ti - ei) * scale;
+    }
+}
+
+// Inverse of realForwardPost without the scaling, packs X[0..n/2] back into Z
+void realInversePre(COMPLEX *row, int n, const COMPLEX *split) {
+    int half = n / 2;
+    double r0 = row[0].real, rn = row[half].real;
+    row[0].real = r0 + rn;
+    row[0].imag = r0 - rn;
+    for (int k = 1; k <= half / 2; k++) {
+        COMPLEX a = row[k], b = row[half - k];
+        double er = a.real + b.real, ei = a.imag - b.imag;
+        double dr = a.real - b.real, di = a.imag + b.imag;
+        // Odd part = (X[k] - conj(X[n/2 - k])) * conj(W^k)
+        double wr = split[k].real, wi = -split[k].imag;
+        double orr = dr * wr - di * wi, oi = dr * wi + di * wr;
+        row[k].real = er - oi;
+        row[k].imag = ei + orr;
+        row[half - k].real = er + oi;
+        row[half - k].imag = orr - ei;
+    }
+}
+
+struct FFTPlan *allocateFFTPlan(enum FFTPlanKind kind, int width, int height, int dir) {
+    if (width < 1 || height < 1 || (kind == FFT_PLAN_REAL && width % 2 != 0)) {
+        return NULL;
+    }
+    struct FFTPlan *plan = calloc(1, sizeof(struct FFTPlan));
+    plan->kind = kind;
+    plan->width = width;
+    plan->height = height;
+    plan->dir = dir;
+    plan->scratch = malloc((size_t) FFT_TRANSPOSE_BLOCK * height * sizeof(COMPLEX));
+    if (plan->scratch == NULL) {
+        fprintf(stderr, "Cannot allocate the FFT plan!\n");
+        exit(1);
+    }
+    return plan;
+}
+
+// Per-thread Bluestein buffers, sized once the row and column tables exist
+void allocateFFTPlanWork(struct FFTPlan *plan) {
+    int threads = plan->threads > 1 ? plan->threads : 1;
+    plan->workSize = plan->rows.workSize > plan->columns.workSize ? plan->rows.workSize : plan->columns.workSize;
+    free(plan->work);
+    plan->work = NULL;
+    if (plan->workSize > 0) {
+        plan->work = malloc((size_t) threads * plan->workSize * sizeof(COMPLEX));
+        if (plan->work == NULL) {
+            fprintf(stderr, "Cannot allocate the FFT work buffer!\n");
+            exit(1);
+        }
+    }
+}
+
+// Returns NULL when the size is not positive or a real plan has an odd width
+struct FFTPlan *createFFTPlan(enum FFTPlanKind kind, int width, int height, int dir) {
+    struct FFTPlan *plan = allocateFFTPlan(kind, width, height, dir);
+    if (plan == NULL) {
+        return NULL;
+    }
+    initFFTPlan1D(&plan->rows, kind == FFT_PLAN_REAL ? width / 2 : width);
+    initFFTPlan1D(&plan->columns, height);
+    if (kind == FFT_PLAN_REAL) {
+        plan->split = fftTwiddles(width, width / 4);
+    }
+    allocateFFTPlanWork(plan);
+    return plan;
+}
+
+void destroyFFTPlan(struct FFTPlan *plan) {
+    if (plan == NULL) return;
+    freeFFTPlan1D(&plan->rows);
+    freeFFTPlan1D(&plan->columns);
+    free(plan->split);
+    free(plan->scratch);
+    free(plan->transposed);
+    free(plan->work);
+    free(plan);
+}
+
+// Work buffer of one thread
+COMPLEX *fftPlanWork(const struct FFTPlan *plan, int worker) {
+    return plan->work == NULL ? NULL : plan->work + (size_t) worker * plan->workSize;
+}
+
+/*
+ * Transform every column of a row-major array with rowLength COMPLEX values per row
+ * The columns are gathered FFT_TRANSPOSE_BLOCK at a time, so every cache line of a row is read
+ * once instead of once per column
+ */
+void executeColumns(const struct FFTPlan *plan, COMPLEX *c, int columns, int rowLength, double scale) {
+    int height = plan->height;
+    for (int x0 = 0; x0 < columns; x0 += FFT_TRANSPOSE_BLOCK) {
+        int count = columns - x0 < FFT_TRANSPOSE_BLOCK ? columns - x0 : FFT_TRANSPOSE_BLOCK;
+        for (int y = 0; y < height; y++) {
+            const COMPLEX *row = c + (size_t) y * rowLength + x0;
+            for (int i = 0; i < count; i++) {
+                plan->scratch[(size_t) i * height + y] = row[i];
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            executeFFT1D(&plan->columns, plan->scratch + (size_t) i * height, fftPlanWork(plan, 0), plan->dir);
+        }
+        for (int y = 0; y < height; y++) {
+            COMPLEX *row = c + (size_t) y * rowLength + x0;
+            for (int i = 0; i < count; i++) {
+                row[i].real = plan->scratch[(size_t) i * height + y].real * scale;
+                row[i].imag = plan->scratch[(size_t) i * height + y].imag * scale;
+            }
+        }
+    }
+}
+
+// Row transforms of rows [begin, end), including the real-to-complex split
+void executePlanRows(const struct FFTPlan *plan, COMPLEX *c, int begin, int end, int worker) {
+    int width = plan->width, height = plan->height;
+    COMPLEX *work = fftPlanWork(plan, worker);
+    if (plan->kind == FFT_PLAN_COMPLEX) {
+        for (int y = begin; y < end; y++) {
+            executeFFT1D(&plan->rows, c + (size_t) y * width, work, plan->dir);
+        }
+        return;
+    }
+    int hw = width / 2 + 1;
+    double scale = 1.0 / ((double) width * height);
+    for (int y = begin; y < end; y++) {
+        COMPLEX *row = c + (size_t) y * hw;
+        if (plan->dir == 1) {
+            executeFFT1D(&plan->rows, row, work, 1);
+            realForwardPost(row, width, plan->split, scale);
+        } else {
+            realInversePre(row, width, plan->split);
+            executeFFT1D(&plan->rows, row, work, -1);
+        }
+    }
+}
+
+struct FFTPassContext {
+    const struct FFTPlan *plan;
+    COMPLEX *src;
+    COMPLEX *dst;
+    int rows;
+    int columns;
+    double scale;
+};
+
+void planRowsTask(void *context, int begin, int end, int worker) {
+    struct FFTPassContext *pass = context;
+    executePlanRows(pass->plan, pass->src, begin, end, worker);
+}
+
+// The columns of the array are the rows of the transposed copy
+void planColumnsTask(void *context, int begin, int end, int worker) {
+    struct FFTPassContext *pass = context;
+    int height = pass->plan->height;
+    for (int x = begin; x < end; x++) {
+        COMPLEX *column = pass->src + (size_t) x * height;
+        executeFFT1D(&pass->plan->columns, column, fftPlanWork(pass->plan, worker), pass->plan->dir);
+        if (pass->scale != 1.0) {
+            for (int y = 0; y < height; y++) {
+                column[y].real *= pass->scale;
+                column[y].imag *= pass->scale;
+            }
+        }
+    }
+}
+
+// dst (columns x rows) = transpose of src (rows x columns), for block rows [begin, end)
+void transposeComplexTask(void *context, int begin, int end, int worker) {
+    struct FFTPassContext *pass = context;
+    int rows = pass->rows, columns = pass->columns;
+    for (int by = begin * FFT_TRANSPOSE_BLOCK; by < end * FFT_TRANSPOSE_BLOCK && by < rows;
+         by += FFT_TRANSPOSE_BLOCK) {
+        int yEnd = by + FFT_TRANSPOSE_BLOCK < rows ? by + FFT_TRANSPOSE_BLOCK : rows;
+        for (int bx = 0; bx < columns; bx += FFT_TRANSPOSE_BLOCK) {
+            int xEnd = bx + FFT_TRANSPOSE_BLOCK < columns ? bx + FFT_TRANSPOSE_BLOCK : columns;
+            for (int y = by; y < yEnd; y++) {
+                for (int x = bx; x < xEnd; x++) {
+                    pass->dst[(size_t) x * rows + y] = pass->src[(size_t) y * columns + x];
+                }
+            }
+        }
+    }
+    (void) worker;
+}
+
+void transposeComplex(const COMPLEX *src, COMPLEX *dst, int rows, int columns, int threads) {
+    struct FFTPassContext pass = {NULL, (COMPLEX *) src, dst, rows, columns, 1.0};
+    parallelFor((rows + FFT_TRANSPOSE_BLOCK - 1) / FFT_TRANSPOSE_BLOCK, threads, transposeComplexTask, &pass);
+}
+
+// Column pass through blocked transposes, every stage split over the threads of the plan
+void executeColumnsParallel(const struct FFTPlan *plan, COMPLEX *c, int columns, double scale) {
+    struct FFTPassContext pass = {plan, plan->transposed, NULL, plan->height, columns, scale};
+    transposeComplex(c, plan->transposed, plan->height, columns, plan->threads);
+    parallelFor(columns, plan->threads, planColumnsTask, &pass);
+    transposeComplex(plan->transposed, c, columns, plan->height, plan->threads);
+}
+
+/*
+ * Complex plans take the same height x width array as FFT2D(c, height, width, dir)
+ * Real plans take the in-place layout of rfft.h
+ */
+int executeFFTPlan(const struct FFTPlan *plan, COMPLEX *c) {
+    int width = plan->width, height = plan->height;
+    int columns = plan->kind == FFT_PLAN_COMPLEX ? width : width / 2 + 1;
+    double scale = plan->kind == FFT_PLAN_COMPLEX && plan->dir == 1 ? 1.0 / ((double) width * height) : 1.0;
+    int rowsFirst = plan->kind == FFT_PLAN_COMPLEX || plan->dir == 1;
+    struct TraceSpan span = traceBegin(plan->kind == FFT_PLAN_COMPLEX ? "FFT2D" : "RFFT2D");
+
+    if (plan->threads <= 1 || plan->transposed == NULL) {
+        if (rowsFirst) executePlanRows(plan, c, 0, height, 0);
+        executeColumns(plan, c, columns, columns, scale);
+        if (!rowsFirst) executePlanRows(plan, c, 0, height, 0);
+    } else {
+        struct FFTPassContext pass = {plan, c, NULL, height, columns, 1.0};
+        if (rowsFirst) parallelFor(height, plan->threads, planRowsTask, &pass);
+        executeColumnsParallel(plan, c, columns, scale);
+        if (!rowsFirst) parallelFor(height, plan->threads, planRowsTask, &pass);
+    }
+    traceEnd(&span);
+    return 1;
+}
+
+// Threads used by one plan, the transpose and work buffers are allocated here and not while executing
+void setFFTPlanThreads(struct FFTPlan *plan, int threads) {
+    int grow = threads > plan->threads && threads > 1;
+    plan->threads = threads;
+    if (grow) {
+        allocateFFTPlanWork(plan);
+    }
+    if (threads > 1 && plan->transposed == NULL) {
+        int columns = plan->kind == FFT_PLAN_COMPLEX ? plan->width : plan->width / 2 + 1;
+        plan->transposed = malloc((size_t) columns * plan->height * sizeof(COMPLEX));
+        if (plan->transposed == NULL) {
+            fprintf(stderr, "Cannot allocate the FFT transpose buffer!\n");
+            exit(1);
+        }
+    }
+}
+
+// Name of the widest SIMD extension, part of the plan file name
+const char *fftCpuFeatures(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return "avx512f";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+    if (__builtin_cpu_supports("sse2")) return "sse2";
+#endif
+    return "generic";
+}
+
+void fftPlanPath(char *path, size_t size, const char *directory, enum FFTPlanKind kind,
+                 int width, int height, int dir) {
+    snprintf(path, size, "%s/fft-%s-%dx%d-%c-%s.plan", directory, kind == FFT_PLAN_REAL ? "real" : "complex",
+             width, height, dir == 1 ? 'f' : 'i', fftCpuFeatures());
+}
+
+// Twiddle factors stored by initFFTPlan1D()
+int fftTwiddleCount(const struct FFTPlan1D *plan) {
+    if (plan->bluestein != NULL) return 0;
+    return plan->factorCount == 0 ? plan->n / 2 + 1 : plan->n;
+}
+
+void writeFFTPlan1D(const struct FFTPlan1D *plan, FILE *fptr) {
+    int header[3] = {plan->n, plan->factorCount, plan->bluestein != NULL};
+    fwrite(header, sizeof(header), 1, fptr);
+    fwrite(plan->factors, sizeof(int), plan->factorCount, fptr);
+    if (plan->bluestein != NULL) {
+        fwrite(plan->chirp, sizeof(COMPLEX), plan->n, fptr);
+        fwrite(plan->kernel, sizeof(COMPLEX), plan->bluestein->n, fptr);
+        writeFFTPlan1D(plan->bluestein, fptr);
+        return;
+    }
+    fwrite(plan->permutation, sizeof(int), plan->n, fptr);
+    fwrite(plan->twiddle, sizeof(COMPLEX), fftTwiddleCount(plan), fptr);
+}
+
+// Returns 0 when the file does not hold a plan of length n, the plan must be freed either way
+int readFFTPlan1D(struct FFTPlan1D *plan, int n, FILE *fptr) {
+    int header[3];
+    memset(plan, 0, sizeof(struct FFTPlan1D));
+    if (fread(header, sizeof(header), 1, fptr) != 1 || header[0] != n || header[1] < 0 ||
+        header[1] > FFT_MAX_FACTORS) {
+        return 0;
+    }
+    plan->n = n;
+    plan->factorCount = header[1];
+    if (fread(plan->factors, sizeof(int), plan->factorCount, fptr) != (size_t) plan->factorCount) {
+        return 0;
+    }
+    // The stages must be the ones initFFTPlan1D picks for n: none for a power of 2, the factorization for a
+    // smooth length, and Bluestein for anything else
+    int factors[FFT_MAX_FACTORS];
+    int expected = isPowerOf2(n) ? 0 : fftFactorize(n, factors);
+    if (plan->factorCount != expected || header[2] != (!isPowerOf2(n) && expected == 0)) {
+        return 0;
+    }
+    for (int s = 0; s < expected; s++) {
+        if (plan->factors[s] != factors[s]) return 0;
+    }
+    if (header[2]) {
+        int m = 1;
+        while (m < 2 * n - 1) m <<= 1;
+        plan->workSize = m;
+        plan->chirp = malloc(n * sizeof(COMPLEX));
+        plan->kernel = malloc(m * sizeof(COMPLEX));
+        plan->bluestein = calloc(1, sizeof(struct FFTPlan1D));
+        return fread(plan->chirp, sizeof(COMPLEX), n, fptr) == (size_t) n &&
+               fread(plan->kernel, sizeof(COMPLEX), m, fptr) == (size_t) m &&
+               readFFTPlan1D(plan->bluestein, m, fptr);
+    }
+
+    int count = fftTwiddleCount(plan);
+    plan->permutation = malloc(n * sizeof(int));
+    plan->twiddle = malloc(count * sizeof(COMPLEX));
+    if (fread(plan->permutation, sizeof(int), n, fptr) != (size_t) n ||
+        fread(plan->twiddle, sizeof(COMPLEX), count, fptr) != (size_t) count) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (plan->permutation[i] < 0 || plan->permutation[i] >= n) return 0;
+    }
+    if (plan->factorCount > 0) {
+        fftPermutationCycles(plan);
+    }
+    return 1;
+}
+
+int saveFFTPlan(const struct FFTPlan *plan, const char *path) {
+    FILE *fptr = fopen(path, "wb");
+    if (fptr == NULL) {
+        return 0;
+    }
+    int header[4] = {plan->kind, plan->width, plan->height, plan->dir};
+    fwrite(FFT_PLAN_MAGIC, sizeof(FFT_PLAN_MAGIC), 1, fptr);
+    fwrite(header, sizeof(header), 1, fptr);
+    writeFFTPlan1D(&plan->rows, fptr);
+    writeFFTPlan1D(&plan->columns, fptr);
+    if (plan->kind == FFT_PLAN_REAL) {
+        fwrite(plan->split, sizeof(COMPLEX), plan->width / 4 + 1, fptr);
+    }
+    int ok = !ferror(fptr);
+    fclose(fptr);
+    return ok;
+}
+
+/*
+ * Returns NULL when the file is missing or does not hold a valid plan of this kind, size and
+ * direction, so that a stale or renamed file is rebuilt instead of run on a smaller buffer
+ */
+struct FFTPlan *loadFFTPlan(const char *path, enum FFTPlanKind kind, int width, int height, int dir) {
+    FILE *fptr = fopen(path, "rb");
+    if (fptr == NULL) {
+        return NULL;
+    }
+    char magic[sizeof(FFT_PLAN_MAGIC)];
+    int header[4];
+    struct FFTPlan *plan = NULL;
+    if (fread(magic, sizeof(magic), 1, fptr) == 1 && memcmp(magic, FFT_PLAN_MAGIC, sizeof(magic)) == 0 &&
+        fread(header, sizeof(header), 1, fptr) == 1 &&
+        (header[0] == FFT_PLAN_COMPLEX || header[0] == FFT_PLAN_REAL) && (header[3] == 1 || header[3] == -1) &&
+        header[0] == (int) kind && header[1] == width && header[2] == height && header[3] == dir) {
+        plan = allocateFFTPlan(kind, width, height, dir);
+    }
+    if (plan == NULL) {
+        fclose(fptr);
+        return NULL;
+    }
+
+    int ok = readFFTPlan1D(&plan->rows, plan->kind == FFT_PLAN_REAL ? plan->width / 2 : plan->width, fptr);
+    ok = ok && readFFTPlan1D(&plan->columns, plan->height, fptr);
+    if (ok && plan->kind == FFT_PLAN_REAL) {
+        plan->split = malloc((plan->width / 4 + 1) * sizeof(COMPLEX));
+        ok = fread(plan->split, sizeof(COMPLEX), plan->width / 4 + 1, fptr) == (size_t) (plan->width / 4 + 1);
+    }
+    fclose(fptr);
+    if (!ok) {
+        destroyFFTPlan(plan);
+        return NULL;
+    }
+    allocateFFTPlanWork(plan);
+    return plan;
+}
+
+/*
+ * Cached plan for this kind, size and direction, owned by the cache
+ * Looks in memory first, then in DIP_FFT_PLAN_DIR, and builds the plan on a miss
+ */
+struct FFTPlan *getFFTPlan(enum FFTPlanKind kind, int width, int height, int dir) {
+    int slot = 0;
+    for (; slot < FFT_PLAN_CACHE_SIZE && fftPlanCache[slot] != NULL; slot++) {
+        struct FFTPlan *plan = fftPlanCache[slot];
+        if (plan->kind == kind && plan->width == width && plan->height == height && plan->dir == dir) {
+            return plan;
+        }
+    }
+
+    char path[1024];
+    const char *directory = getenv("DIP_FFT_PLAN_DIR");
+    struct FFTPlan *plan = NULL;
+    if (directory != NULL) {
+        fftPlanPath(path, sizeof(path), directory, kind, width, height, dir);
+        plan = loadFFTPlan(path, kind, width, height, dir);
+    }
+    if (plan == NULL) {
+        plan = createFFTPlan(kind, width, height, dir);
+        if (plan == NULL) {
+            return NULL;
+        }
+        if (directory != NULL) {
+            saveFFTPlan(plan, path);
+        }
+    }
+
+    // When the cache is full the oldest plan is replaced
+    if (slot == FFT_PLAN_CACHE_SIZE) {
+        destroyFFTPlan(fftPlanCache[0]);
+        memmove(fftPlanCache, fftPlanCache + 1, (FFT_PLAN_CACHE_SIZE - 1) * sizeof(struct FFTPlan *));
+        slot--;
+    }
+    setFFTPlanThreads(plan, fftThreads);
+    fftPlanCache[slot] = plan;
+    return plan;
+}
+
+// Threads for the cached plans and every plan getFFTPlan() builds from now on
+void setFFTThreads(int threads) {
+    fftThreads = threads;
+    for (int i = 0; i < FFT_PLAN_CACHE_SIZE && fftPlanCache[i] != NULL; i++) {
+        setFFTPlanThreads(fftPlanCache[i], threads);
+    }
+}
+
+void freeFFTPlanCache(void) {
+    for (int i = 0; i < FFT_PLAN_CACHE_SIZE; i++) {
+        destroyFFTPlan(fftPlanCache[i]);
+        fftPlanCache[i] = NULL;
+    }
+}
+
+// Same call style as FFT2D, through the plan cache
+int PlannedFFT2D(COMPLEX *c, int height, int width, int dir) {
+    struct FFTPlan *plan = getFFTPlan(FFT_PLAN_COMPLEX, width, height, dir);
+    return plan != NULL && executeFFTPlan(plan, c);
+}
+
+#endif
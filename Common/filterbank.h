@@ -0,0 +1,155 @@
+/*
+ * Digital Image Processing
+ * Filter bank which transforms an image once and applies many transfer functions to its spectrum
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type. Link with -pthread.
+ * The spectrum is the half spectrum of rfft.h. A filter is either a half table of filters.h or
+ * a transfer function in full-spectrum array coordinates like for filterHalfSpectrum().
+ * The filters run in batches of poolSize: every filter of a batch gets a copy of the spectrum
+ * in one pool buffer, and the batch is filtered and inverse transformed in parallel, one thread
+ * and one inverse plan per buffer. The memory stays at poolSize + 1 spectra however many filters
+ * are swept, so the transfer functions must be safe to call from several threads.
+ */
+#ifndef DIP_FILTERBANK_H
+#define DIP_FILTERBANK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rfft.h"
+#include "filters.h"
+#include "parallel.h"
+#include "trace.h"
+
+struct FilterBankFilter {
+    double (*transfer)(int u, int v, void *context);
+    void *context;
+    const double *table;  // Half table of makeTransfer(), used instead of transfer when set
+};
+
+// index is the position of the filter, c a pool buffer which is reused after the call returns
+typedef void (*FilterBankCallback)(int index, COMPLEX *c, void *context);
+
+struct FilterBank {
+    int width;
+    int height;
+    int poolSize;
+    struct FFTPlan *forward;
+    struct FFTPlan **inverse;  // One per pool buffer
+    COMPLEX *spectrum;         // Input image, then its half spectrum
+    COMPLEX **pool;
+};
+
+struct FilterBankBatch {
+    struct FilterBank *bank;
+    const struct FilterBankFilter *filters;
+    int first;
+};
+
+// Returns NULL when the width is odd or the size is not positive
+struct FilterBank *createFilterBank(int width, int height, int poolSize) {
+    struct FFTPlan *forward = createFFTPlan(FFT_PLAN_REAL, width, height, 1);
+    if (forward == NULL) {
+        return NULL;
+    }
+    if (poolSize < 1) poolSize = 1;
+    size_t size = (size_t) height * halfSpectrumWidth(width) * sizeof(COMPLEX);
+
+    struct FilterBank *bank = malloc(sizeof(struct FilterBank));
+    bank->width = width;
+    bank->height = height;
+    bank->poolSize = poolSize;
+    bank->forward = forward;
+    bank->inverse = malloc(poolSize * sizeof(struct FFTPlan *));
+    bank->pool = malloc(poolSize * sizeof(COMPLEX *));
+    bank->spectrum = malloc(size);
+    if (bank->inverse == NULL || bank->pool == NULL || bank->spectrum == NULL) {
+        fprintf(stderr, "Cannot allocate the filter bank!\n");
+        exit(1);
+    }
+    for (int i = 0; i < poolSize; i++) {
+        bank->inverse[i] = createFFTPlan(FFT_PLAN_REAL, width, height, -1);
+        bank->pool[i] = malloc(size);
+        if (bank->pool[i] == NULL) {
+            fprintf(stderr, "Cannot allocate the filter bank!\n");
+            exit(1);
+        }
+    }
+    return bank;
+}
+
+void destroyFilterBank(struct FilterBank *bank) {
+    if (bank == NULL) return;
+    for (int i = 0; i < bank->poolSize; i++) {
+        destroyFFTPlan(bank->inverse[i]);
+        free(bank->pool[i]);
+    }
+    destroyFFTPlan(bank->forward);
+    free(bank->inverse);
+    free(bank->pool);
+    free(bank->spectrum);
+    free(bank);
+}
+
+// Row y of the input image, fill every row before filterBankForward()
+double *filterBankRow(struct FilterBank *bank, int y) {
+    return realRow(bank->spectrum, y, bank->width);
+}
+
+void filterBankForward(struct FilterBank *bank) {
+    executeFFTPlan(bank->forward, bank->spectrum);
+}
+
+// Copy and filter the spectrum into the pool buffers [begin, end) of the batch
+void filterBankFilterTask(void *context, int begin, int end, int worker) {
+    struct FilterBankBatch *batch = context;
+    struct FilterBank *bank = batch->bank;
+    size_t size = (size_t) bank->height * halfSpectrumWidth(bank->width) * sizeof(COMPLEX);
+    for (int i = begin; i < end; i++) {
+        const struct FilterBankFilter *filter = &batch->filters[batch->first + i];
+        memcpy(bank->pool[i], bank->spectrum, size);
+        if (filter->table != NULL) {
+            applyTransfer(bank->pool[i], filter->table, bank->width, bank->height, 1);
+        } else {
+            filterHalfSpectrum(bank->pool[i], bank->height, bank->width, filter->transfer, filter->context);
+        }
+    }
+    (void) worker;
+}
+
+void filterBankInverseTask(void *context, int begin, int end, int worker) {
+    struct FilterBankBatch *batch = context;
+    for (int i = begin; i < end; i++) {
+        executeFFTPlan(batch->bank->inverse[i], batch->bank->pool[i]);
+    }
+    (void) worker;
+}
+
+/*
+ * Apply count filters to the spectrum of filterBankForward()
+ * filtered (may be NULL) gets every filtered half spectrum, done gets every filtered image in the
+ * realRow() layout. Both are called on the calling thread in the order of the filters.
+ */
+void runFilterBank(struct FilterBank *bank, const struct FilterBankFilter *filters, int count,
+                   FilterBankCallback filtered, FilterBankCallback done, void *context) {
+    struct TraceSpan span = traceBegin("runFilterBank");
+    for (int first = 0; first < count; first += bank->poolSize) {
+        int size = count - first < bank->poolSize ? count - first : bank->poolSize;
+        struct FilterBankBatch batch = {bank, filters, first};
+
+        parallelFor(size, size, filterBankFilterTask, &batch);
+        if (filtered != NULL) {
+            for (int i = 0; i < size; i++) {
+                filtered(first + i, bank->pool[i], context);
+            }
+        }
+        parallelFor(size, size, filterBankInverseTask, &batch);
+        for (int i = 0; i < size; i++) {
+            done(first + i, bank->pool[i], context);
+        }
+    }
+    traceEnd(&span);
+}
+
+#endif
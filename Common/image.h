@@ -0,0 +1,155 @@
+/*
+ * Digital Image Processing
+ * 8-bit images with a halo of border pixels and 64-byte aligned rows
+ *
+ * Note:
+ * Link with -pthread (pool.h).
+ * An image keeps halo extra rows above and below it and halo extra columns on both sides, so a
+ * stencil of radius up to halo reads its neighbours with plain row pointers and offsets, and one
+ * loop without bounds checks covers every pixel including the border. fillHalo() sets the halo
+ * from the image by a policy, which decides what the stencil sees past the edge:
+ * HALO_REPLICATE: the edge pixel, ... a a | a b c
+ * HALO_REFLECT:   the image mirrored at the edge, ... b a | a b c
+ * HALO_CONSTANT:  a fixed value
+ * Row y is imageRow(image, y), from -halo to height + halo - 1, in the order of the source
+ * pixel array (bitmaps are stored bottom-up). Every row starts on a 64-byte cache line, so
+ * x = 0 is aligned for SIMD loads and rows never share a line.
+ * The pixels come from an ImagePool when one is given, from the system otherwise.
+ */
+#ifndef DIP_IMAGE_H
+#define DIP_IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "pool.h"
+
+enum HaloPolicy {
+    HALO_REPLICATE,
+    HALO_REFLECT,
+    HALO_CONSTANT
+};
+
+struct Image {
+    int width;
+    int height;
+    int halo;
+    ptrdiff_t stride;      // Bytes per row, a multiple of 64
+    uint8_t *pixels;       // Pixel (0, 0)
+    uint8_t *buffer;       // First halo row
+    struct ImagePool *pool;
+};
+
+/*
+ * Image of width x height with halo rows and columns on every side, the halo is at most 64
+ * The pixels are not initialized. Returns NULL when the size is not positive
+ */
+struct Image *createImage(int width, int height, int halo, struct ImagePool *pool) {
+    if (width < 1 || height < 1 || halo < 0 || halo > POOL_ALIGNMENT) {
+        return NULL;
+    }
+    struct Image *image = malloc(sizeof(struct Image));
+    if (image == NULL) {
+        fprintf(stderr, "Cannot allocate the image!\n");
+        exit(1);
+    }
+    // The left halo gets a whole cache line so that column 0 is aligned
+    int left = halo > 0 ? POOL_ALIGNMENT : 0;
+    size_t stride = (size_t) (left + width + halo + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT * POOL_ALIGNMENT;
+    size_t size = stride * (height + 2 * halo);
+    image->width = width;
+    image->height = height;
+    image->halo = halo;
+    image->stride = (ptrdiff_t) stride;
+    image->pool = pool;
+    if (pool != NULL) {
+        image->buffer = poolAlloc(pool, size);
+    } else {
+#ifdef _WIN32
+        image->buffer = _aligned_malloc(size, POOL_ALIGNMENT);
+#else
+        void *buffer;
+        image->buffer = posix_memalign(&buffer, POOL_ALIGNMENT, size) == 0 ? buffer : NULL;
+#endif
+        if (image->buffer == NULL) {
+            fprintf(stderr, "Cannot allocate the image!\n");
+            exit(1);
+        }
+    }
+    image->pixels = image->buffer + (size_t) halo * stride + left;
+    return image;
+}
+
+void destroyImage(struct Image *image) {
+    if (image == NULL) return;
+    if (image->pool != NULL) {
+        poolFree(image->pool, image->buffer);
+    } else {
+#ifdef _WIN32
+        _aligned_free(image->buffer);
+#else
+        free(image->buffer);
+#endif
+    }
+    free(image);
+}
+
+uint8_t *imageRow(const struct Image *image, int y) {
+    return image->pixels + y * image->stride;
+}
+
+// Copy height rows of width pixels, stride bytes apart, into the image
+void loadImage(struct Image *image, const uint8_t *src, int stride) {
+    for (int y = 0; y < image->height; y++) {
+        memcpy(imageRow(image, y), src + (size_t) y * stride, image->width);
+    }
+}
+
+void storeImage(const struct Image *image, uint8_t *dst, int stride) {
+    for (int y = 0; y < image->height; y++) {
+        memcpy(dst + (size_t) y * stride, imageRow(image, y), image->width);
+    }
+}
+
+// Index of the pixel seen at i < 0 or i >= n, reflecting as often as a halo wider than n needs
+int haloIndex(int i, int n, enum HaloPolicy policy) {
+    if (policy == HALO_REPLICATE) {
+        return i < 0 ? 0 : (i >= n ? n - 1 : i);
+    }
+    int period = 2 * n;
+    i = ((i % period) + period) % period;
+    return i < n ? i : period - 1 - i;
+}
+
+// Set the halo from the image, value is used by HALO_CONSTANT
+void fillHalo(struct Image *image, enum HaloPolicy policy, uint8_t value) {
+    int width = image->width, height = image->height, halo = image->halo;
+    if (halo == 0) return;
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = imageRow(image, y);
+        for (int x = 1; x <= halo; x++) {
+            row[-x] = policy == HALO_CONSTANT ? value : row[haloIndex(-x, width, policy)];
+            row[width - 1 + x] = policy == HALO_CONSTANT ? value : row[haloIndex(width - 1 + x, width, policy)];
+        }
+    }
+    // Whole rows including their side halo, so the corners follow the same policy
+    for (int y = 1; y <= halo; y++) {
+        uint8_t *above = imageRow(image, -y) - halo, *below = imageRow(image, height - 1 + y) - halo;
+        if (policy == HALO_CONSTANT) {
+            memset(above, value, width + 2 * halo);
+            memset(below, value, width + 2 * halo);
+        } else {
+            memcpy(above, imageRow(image, haloIndex(-y, height, policy)) - halo, width + 2 * halo);
+            memcpy(below, imageRow(image, haloIndex(height - 1 + y, height, policy)) - halo, width + 2 * halo);
+        }
+    }
+}
+
+// Stencil results are clamped to a pixel without a branch
+uint8_t saturatePixel(int value) {
+    return (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+#endif
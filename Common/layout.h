@@ -0,0 +1,352 @@
+/*
+ * Digital Image Processing
+ * Tiled and Morton (Z-order) layouts of 8-bit images
+ *
+ * Note:
+ * Link with -pthread (parallel.h).
+ * A bitmap stores its rows one after the other, so walking down a column or along a diagonal
+ * touches a new cache line, and soon a new page, at every pixel. The other layouts cut the
+ * image into 64 x 64 tiles of 4 KB, one page each, stored tile row after tile row:
+ * LAYOUT_TILED:  rows of the tile one after the other
+ * LAYOUT_MORTON: Z-order inside the tile, the bits of x and y interleaved, so every aligned
+ *                2^k x 2^k block of the tile is contiguous as well
+ * The edge tiles are padded with zeros. y counts the rows from the first one of the source; to
+ * use the y of m() on a bitmap, import it from its last row with a negative stride.
+ * Converting from and to the scanline order copies whole rows of a tile for LAYOUT_TILED and
+ * goes through a 64-entry bit-spreading table for LAYOUT_MORTON, one pass either way.
+ *
+ * A LayoutKernel names the layout it reads and writes best. runLayoutKernel() converts the
+ * scanline images into that layout, runs the kernel and converts the result back, so callers
+ * keep the bitmap layout and the kernel chooses its own. layoutOffset() addresses any layout,
+ * and the tables of layoutOffsetTables() do so without a branch. Kernels that visit the
+ * destination tile by tile keep their reads within a few tiles. The column pass of the FFT plans
+ * gets the same locality by gathering blocks of columns, see executeColumns() of fftplan.h.
+ */
+#ifndef DIP_LAYOUT_H
+#define DIP_LAYOUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "parallel.h"
+#include "trace.h"
+
+#define LAYOUT_TILE_SHIFT 6
+#define LAYOUT_TILE (1 << LAYOUT_TILE_SHIFT)
+#define LAYOUT_TILE_MASK (LAYOUT_TILE - 1)
+
+enum ImageLayout {
+    LAYOUT_SCANLINE,
+    LAYOUT_TILED,
+    LAYOUT_MORTON
+};
+
+struct LayoutImage {
+    int width;
+    int height;
+    enum ImageLayout layout;
+    int tilesAcross;
+    int tilesDown;
+    ptrdiff_t stride;  // Bytes per row of LAYOUT_SCANLINE
+    uint8_t *data;
+    int owned;         // data is freed by destroyLayoutImage()
+};
+
+struct LayoutKernel {
+    enum ImageLayout layout;
+    // src and dst have the same size and the layout above
+    void (*run)(const struct LayoutImage *src, struct LayoutImage *dst, void *context);
+};
+
+// Spread the 6 bits of v to the even bits
+unsigned int mortonSpread(unsigned int v) {
+    v = (v | (v << 4)) & 0x0F0F;
+    v = (v | (v << 2)) & 0x3333;
+    return (v | (v << 1)) & 0x5555;
+}
+
+// Offset of the tile holding (x, y), in pixels
+size_t layoutTile(const struct LayoutImage *image, int x, int y) {
+    return ((size_t) (y >> LAYOUT_TILE_SHIFT) * image->tilesAcross + (x >> LAYOUT_TILE_SHIFT))
+            << (2 * LAYOUT_TILE_SHIFT);
+}
+
+size_t layoutOffset(const struct LayoutImage *image, int x, int y) {
+    switch (image->layout) {
+        case LAYOUT_TILED:
+            return layoutTile(image, x, y) + ((y & LAYOUT_TILE_MASK) << LAYOUT_TILE_SHIFT) + (x & LAYOUT_TILE_MASK);
+        case LAYOUT_MORTON:
+            return layoutTile(image, x, y) + (mortonSpread(x & LAYOUT_TILE_MASK) |
+                                              mortonSpread(y & LAYOUT_TILE_MASK) << 1);
+        default:
+            return (size_t) ((ptrdiff_t) y * image->stride + x);
+    }
+}
+
+/*
+ * In every layout the offset of (x, y) is a part from x plus a part from y, so a kernel can
+ * fill xs (width entries) and ys (height entries) once and address a pixel by xs[x] + ys[y]
+ * without branching on the layout per pixel
+ */
+void layoutOffsetTables(const struct LayoutImage *image, ptrdiff_t *xs, ptrdiff_t *ys) {
+    ptrdiff_t tileSize = LAYOUT_TILE * LAYOUT_TILE, tileRow = (ptrdiff_t) image->tilesAcross * tileSize;
+    for (int x = 0; x < image->width; x++) {
+        ptrdiff_t inside = image->layout == LAYOUT_MORTON ? mortonSpread(x & LAYOUT_TILE_MASK) : x & LAYOUT_TILE_MASK;
+        xs[x] = image->layout == LAYOUT_SCANLINE ? x : (x >> LAYOUT_TILE_SHIFT) * tileSize + inside;
+    }
+    for (int y = 0; y < image->height; y++) {
+        ptrdiff_t inside = image->layout == LAYOUT_MORTON ? mortonSpread(y & LAYOUT_TILE_MASK) << 1
+                                                          : (y & LAYOUT_TILE_MASK) << LAYOUT_TILE_SHIFT;
+        ys[y] = image->layout == LAYOUT_SCANLINE ? y * image->stride : (y >> LAYOUT_TILE_SHIFT) * tileRow + inside;
+    }
+}
+
+ptrdiff_t *layoutTable(int n) {
+    ptrdiff_t *table = malloc(n * sizeof(ptrdiff_t));
+    if (table == NULL) {
+        fprintf(stderr, "Cannot allocate the layout tables!\n");
+        exit(1);
+    }
+    return table;
+}
+
+// A tiled or Morton image, zero-filled. Returns NULL when the size is not positive
+struct LayoutImage *createLayoutImage(int width, int height, enum ImageLayout layout) {
+    if (width < 1 || height < 1 || layout == LAYOUT_SCANLINE) {
+        return NULL;
+    }
+    struct LayoutImage *image = calloc(1, sizeof(struct LayoutImage));
+    image->width = width;
+    image->height = height;
+    image->layout = layout;
+    image->tilesAcross = (width + LAYOUT_TILE_MASK) >> LAYOUT_TILE_SHIFT;
+    image->tilesDown = (height + LAYOUT_TILE_MASK) >> LAYOUT_TILE_SHIFT;
+    image->data = calloc((size_t) image->tilesAcross * image->tilesDown, LAYOUT_TILE * LAYOUT_TILE);
+    image->owned = 1;
+    if (image->data == NULL) {
+        fprintf(stderr, "Cannot allocate the tiled image!\n");
+        exit(1);
+    }
+    return image;
+}
+
+// View of a scanline buffer, rows stride bytes apart (may be negative), no copy is made
+struct LayoutImage scanlineImage(uint8_t *data, int width, int height, ptrdiff_t stride) {
+    struct LayoutImage image = {width, height, LAYOUT_SCANLINE, 0, 0, stride, data, 0};
+    return image;
+}
+
+void destroyLayoutImage(struct LayoutImage *image) {
+    if (image == NULL) return;
+    if (image->owned) free(image->data);
+    free(image);
+}
+
+// Rows of the scanline image src into the tiled or Morton image dst of the same size
+void importScanlines(struct LayoutImage *dst, const struct LayoutImage *src) {
+    struct TraceSpan span = traceBegin("importScanlines");
+    unsigned int spread[LAYOUT_TILE];
+    for (int i = 0; i < LAYOUT_TILE; i++) {
+        spread[i] = mortonSpread(i);
+    }
+    for (int y = 0; y < dst->height; y++) {
+        const uint8_t *row = src->data + (ptrdiff_t) y * src->stride;
+        for (int x0 = 0; x0 < dst->width; x0 += LAYOUT_TILE) {
+            int count = dst->width - x0 < LAYOUT_TILE ? dst->width - x0 : LAYOUT_TILE;
+            uint8_t *tile = dst->data + layoutTile(dst, x0, y);
+            if (dst->layout == LAYOUT_TILED) {
+                memcpy(tile + ((y & LAYOUT_TILE_MASK) << LAYOUT_TILE_SHIFT), row + x0, count);
+                continue;
+            }
+            uint8_t *rows = tile + (spread[y & LAYOUT_TILE_MASK] << 1);
+            for (int x = 0; x < count; x++) {
+                rows[spread[x]] = row[x0 + x];
+            }
+        }
+    }
+    traceEnd(&span);
+}
+
+void exportScanlines(const struct LayoutImage *src, struct LayoutImage *dst) {
+    struct TraceSpan span = traceBegin("exportScanlines");
+    unsigned int spread[LAYOUT_TILE];
+    for (int i = 0; i < LAYOUT_TILE; i++) {
+        spread[i] = mortonSpread(i);
+    }
+    for (int y = 0; y < src->height; y++) {
+        uint8_t *row = dst->data + (ptrdiff_t) y * dst->stride;
+        for (int x0 = 0; x0 < src->width; x0 += LAYOUT_TILE) {
+            int count = src->width - x0 < LAYOUT_TILE ? src->width - x0 : LAYOUT_TILE;
+            const uint8_t *tile = src->data + layoutTile(src, x0, y);
+            if (src->layout == LAYOUT_TILED) {
+                memcpy(row + x0, tile + ((y & LAYOUT_TILE_MASK) << LAYOUT_TILE_SHIFT), count);
+                continue;
+            }
+            const uint8_t *rows = tile + (spread[y & LAYOUT_TILE_MASK] << 1);
+            for (int x = 0; x < count; x++) {
+                row[x0 + x] = rows[spread[x]];
+            }
+        }
+    }
+    traceEnd(&span);
+}
+
+/*
+ * Run kernel on the scanline images src and dst of width x height, rows stride bytes apart
+ * (may be negative), in the layout the kernel asks for
+ */
+void runLayoutKernel(const struct LayoutKernel *kernel, uint8_t *src, uint8_t *dst, int width, int height,
+                     ptrdiff_t stride, void *context) {
+    struct LayoutImage srcLines = scanlineImage(src, width, height, stride);
+    struct LayoutImage dstLines = scanlineImage(dst, width, height, stride);
+    if (kernel->layout == LAYOUT_SCANLINE) {
+        kernel->run(&srcLines, &dstLines, context);
+        return;
+    }
+    struct LayoutImage *srcTiles = createLayoutImage(width, height, kernel->layout);
+    struct LayoutImage *dstTiles = createLayoutImage(width, height, kernel->layout);
+    importScanlines(srcTiles, &srcLines);
+    kernel->run(srcTiles, dstTiles, context);
+    exportScanlines(dstTiles, &dstLines);
+    destroyLayoutImage(srcTiles);
+    destroyLayoutImage(dstTiles);
+}
+
+struct LayoutRotation {
+    double degree;
+    int originX;
+    int originY;
+    uint8_t background;
+};
+
+struct LayoutRotationContext {
+    const struct LayoutRotation *rotation;
+    const struct LayoutImage *src;
+    struct LayoutImage *dst;
+    double c, s;
+    ptrdiff_t *srcXs, *srcYs, *dstXs, *dstYs;
+};
+
+// Bands of LAYOUT_TILE rows, tile by tile
+void rotateLayoutTask(void *context, int begin, int end, int worker) {
+    const struct LayoutRotationContext *r = context;
+    const struct LayoutRotation *rotation = r->rotation;
+    const struct LayoutImage *src = r->src;
+    struct LayoutImage *dst = r->dst;
+    for (int band = begin; band < end; band++) {
+        int y0 = band * LAYOUT_TILE, y1 = y0 + LAYOUT_TILE < dst->height ? y0 + LAYOUT_TILE : dst->height;
+        for (int x0 = 0; x0 < dst->width; x0 += LAYOUT_TILE) {
+            int x1 = x0 + LAYOUT_TILE < dst->width ? x0 + LAYOUT_TILE : dst->width;
+            for (int y = y0; y < y1; y++) {
+                int originY = y - rotation->originY;
+                uint8_t *out = dst->data + r->dstYs[y];
+                for (int x = x0; x < x1; x++) {
+                    int originX = x - rotation->originX;
+                    int srcX = (int) (originX * r->c - originY * r->s) + rotation->originX;
+                    int srcY = (int) (originX * r->s + originY * r->c) + rotation->originY;
+                    int inside = srcX >= 0 && srcX < src->width && srcY >= 0 && srcY < src->height;
+                    out[r->dstXs[x]] = inside ? src->data[r->srcXs[srcX] + r->srcYs[srcY]] : rotation->background;
+                }
+            }
+        }
+    }
+    (void) worker;
+}
+
+/*
+ * Nearest-neighbour rotation about (originX, originY) like the programs of Assignment-4, for any
+ * layout. The destination is visited tile by tile, so the source pixels of a destination tile
+ * lie in a band of a few tiles instead of 64 rows of the whole image. The bands of tiles are
+ * shared out on setParallelThreads() threads.
+ */
+void rotateLayout(const struct LayoutImage *src, struct LayoutImage *dst, void *context) {
+    const struct LayoutRotation *rotation = context;
+    double radian = rotation->degree * acos(-1) / 180; // PI = acos(-1)
+    struct LayoutRotationContext r = {.rotation = rotation, .src = src, .dst = dst, .c = cos(radian), .s = sin(radian)};
+    struct TraceSpan span = traceBegin("rotateLayout");
+    r.srcXs = layoutTable(src->width);
+    r.srcYs = layoutTable(src->height);
+    r.dstXs = layoutTable(dst->width);
+    r.dstYs = layoutTable(dst->height);
+    layoutOffsetTables(src, r.srcXs, r.srcYs);
+    layoutOffsetTables(dst, r.dstXs, r.dstYs);
+    parallelFor((dst->height + LAYOUT_TILE_MASK) >> LAYOUT_TILE_SHIFT, parallelThreads, rotateLayoutTask, &r);
+    free(r.srcXs);
+    free(r.srcYs);
+    free(r.dstXs);
+    free(r.dstYs);
+    traceEnd(&span);
+}
+
+struct LayoutStencilContext {
+    const struct LayoutImage *src;
+    struct LayoutImage *dst;
+    ptrdiff_t *srcXs, *srcYs, *dstXs, *dstYs;  // The source tables repeat the edge entry before and after
+};
+
+// |Gx| + |Gy| of the Sobel operators like sobelRow() of pipeline.h, bands of LAYOUT_TILE rows, tile by tile
+void sobelLayoutTask(void *context, int begin, int end, int worker) {
+    const struct LayoutStencilContext *k = context;
+    const uint8_t *data = k->src->data;
+    struct LayoutImage *dst = k->dst;
+    for (int band = begin; band < end; band++) {
+        int y0 = band * LAYOUT_TILE, y1 = y0 + LAYOUT_TILE < dst->height ? y0 + LAYOUT_TILE : dst->height;
+        for (int x0 = 0; x0 < dst->width; x0 += LAYOUT_TILE) {
+            int x1 = x0 + LAYOUT_TILE < dst->width ? x0 + LAYOUT_TILE : dst->width;
+            for (int y = y0; y < y1; y++) {
+                ptrdiff_t up = k->srcYs[y - 1], middle = k->srcYs[y], down = k->srcYs[y + 1];
+                uint8_t *out = dst->data + k->dstYs[y];
+                for (int x = x0; x < x1; x++) {
+                    ptrdiff_t left = k->srcXs[x - 1], centre = k->srcXs[x], right = k->srcXs[x + 1];
+                    int gx = data[up + right] + 2 * data[middle + right] + data[down + right] -
+                             data[up + left] - 2 * data[middle + left] - data[down + left];
+                    int gy = data[up + left] + 2 * data[up + centre] + data[up + right] -
+                             data[down + left] - 2 * data[down + centre] - data[down + right];
+                    int value = abs(gx) + abs(gy);
+                    out[k->dstXs[x]] = (uint8_t) (value > 255 ? 255 : value);
+                }
+            }
+        }
+    }
+    (void) worker;
+}
+
+/*
+ * Sobel edges of Assignment-3 for any layout, the edge pixels replicated like the halo of the
+ * pipeline. The bands of tiles are shared out on setParallelThreads() threads.
+ */
+void sobelLayout(const struct LayoutImage *src, struct LayoutImage *dst, void *context) {
+    struct LayoutStencilContext k = {.src = src, .dst = dst};
+    struct TraceSpan span = traceBegin("sobelLayout");
+    ptrdiff_t *srcXs = layoutTable(src->width + 2), *srcYs = layoutTable(src->height + 2);
+    k.srcXs = srcXs + 1;
+    k.srcYs = srcYs + 1;
+    k.dstXs = layoutTable(dst->width);
+    k.dstYs = layoutTable(dst->height);
+    layoutOffsetTables(src, k.srcXs, k.srcYs);
+    layoutOffsetTables(dst, k.dstXs, k.dstYs);
+    k.srcXs[-1] = k.srcXs[0];
+    k.srcXs[src->width] = k.srcXs[src->width - 1];
+    k.srcYs[-1] = k.srcYs[0];
+    k.srcYs[src->height] = k.srcYs[src->height - 1];
+    parallelFor((dst->height + LAYOUT_TILE_MASK) >> LAYOUT_TILE_SHIFT, parallelThreads, sobelLayoutTask, &k);
+    free(srcXs);
+    free(srcYs);
+    free(k.dstXs);
+    free(k.dstYs);
+    traceEnd(&span);
+    (void) context;
+}
+
+/*
+ * Both kernels already visit the destination tile by tile. Measured end to end on one core, up
+ * to 16384 x 16384, converting to the tiled or Morton layout and back costs more than the reads
+ * it saves, so they run on the scanlines
+ */
+const struct LayoutKernel rotateKernel = {LAYOUT_SCANLINE, rotateLayout};
+const struct LayoutKernel sobelKernel = {LAYOUT_SCANLINE, sobelLayout};
+
+#endif
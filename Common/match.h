@@ -0,0 +1,357 @@
+/*
+ * Digital Image Processing
+ * Template matching by normalized cross-correlation through the FFT
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type. Link with -pthread.
+ * Images are rows of doubles. The score of a template T of tw x th pixels with its top-left
+ * corner at (x, y) of the scene S is
+ * NCC = sum (T - mean T) * S / (|T - mean T| * sqrt(sum S^2 - (sum S)^2 / (tw * th)))
+ * with the sums over the window, from -1 to 1. Windows without variance score 0.
+ * The numerator is the cross-correlation of the scene with the zero-mean template, a product of
+ * spectra and one inverse transform, and the window sums of the denominator come from the
+ * integral images of S and S^2. Only positions where the template lies inside the scene are
+ * scored, and these never wrap around, so the scene is only padded up to a transform size with
+ * factors 2, 3 and 5.
+ *
+ * The scene is transformed once by setMatchScene() and every template is matched against that
+ * spectrum. A template is transformed once by createMatchTemplate() and can be matched against
+ * any number of scenes, so a fixed set of templates costs one forward transform per frame and
+ * one inverse transform per template. The templates are matched in parallel batches of
+ * poolSize like filterbank.h, and the memory stays at poolSize + 1 scene spectra.
+ */
+#ifndef DIP_MATCH_H
+#define DIP_MATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rfft.h"
+#include "parallel.h"
+#include "trace.h"
+
+// Top-left corner of the template, refined to a fraction of a pixel
+struct MatchPeak {
+    double x;
+    double y;
+    double score;
+};
+
+struct MatchTemplate {
+    int width;
+    int height;
+    double norm;        // |T - mean T|
+    COMPLEX *spectrum;  // Conjugate half spectrum of the zero-mean template, see createMatchTemplate()
+};
+
+struct TemplateMatcher {
+    int width;             // Scene
+    int height;
+    int transformWidth;
+    int transformHeight;
+    int poolSize;
+    struct FFTPlan *forward;
+    struct FFTPlan **inverse;  // One per pool buffer
+    COMPLEX *spectrum;         // Scene rows, then its half spectrum
+    double *sum;               // Integral images of S and S^2, (width + 1) x (height + 1)
+    double *sum2;
+    COMPLEX **pool;
+};
+
+struct MatchBatch {
+    struct TemplateMatcher *matcher;
+    struct MatchTemplate *const *templates;
+    int first;
+    int count;             // Peaks per template
+    struct MatchPeak *peaks;
+    int *found;
+};
+
+// Smallest length >= n with no prime factor above 5, even when even is set
+int matchTransformSize(int n, int even) {
+    for (;; n++) {
+        int m = n;
+        while (m % 2 == 0) m /= 2;
+        while (m % 3 == 0) m /= 3;
+        while (m % 5 == 0) m /= 5;
+        if (m == 1 && (!even || n % 2 == 0)) {
+            return n;
+        }
+    }
+}
+
+// Returns NULL when the size is not positive
+struct TemplateMatcher *createTemplateMatcher(int width, int height, int poolSize) {
+    if (width < 1 || height < 1) {
+        return NULL;
+    }
+    if (poolSize < 1) poolSize = 1;
+    int transformWidth = matchTransformSize(width, 1), transformHeight = matchTransformSize(height, 0);
+    size_t size = (size_t) transformHeight * halfSpectrumWidth(transformWidth) * sizeof(COMPLEX);
+    size_t integral = (size_t) (width + 1) * (height + 1) * sizeof(double);
+
+    struct TemplateMatcher *matcher = malloc(sizeof(struct TemplateMatcher));
+    matcher->width = width;
+    matcher->height = height;
+    matcher->transformWidth = transformWidth;
+    matcher->transformHeight = transformHeight;
+    matcher->poolSize = poolSize;
+    matcher->forward = createFFTPlan(FFT_PLAN_REAL, transformWidth, transformHeight, 1);
+    matcher->inverse = malloc(poolSize * sizeof(struct FFTPlan *));
+    matcher->pool = malloc(poolSize * sizeof(COMPLEX *));
+    matcher->spectrum = calloc(1, size);
+    matcher->sum = malloc(integral);
+    matcher->sum2 = malloc(integral);
+    if (matcher->inverse == NULL || matcher->pool == NULL || matcher->spectrum == NULL || matcher->sum == NULL ||
+        matcher->sum2 == NULL) {
+        fprintf(stderr, "Cannot allocate the template matcher!\n");
+        exit(1);
+    }
+    for (int i = 0; i < poolSize; i++) {
+        matcher->inverse[i] = createFFTPlan(FFT_PLAN_REAL, transformWidth, transformHeight, -1);
+        matcher->pool[i] = malloc(size);
+        if (matcher->pool[i] == NULL) {
+            fprintf(stderr, "Cannot allocate the template matcher!\n");
+            exit(1);
+        }
+    }
+    return matcher;
+}
+
+void destroyTemplateMatcher(struct TemplateMatcher *matcher) {
+    if (matcher == NULL) return;
+    for (int i = 0; i < matcher->poolSize; i++) {
+        destroyFFTPlan(matcher->inverse[i]);
+        free(matcher->pool[i]);
+    }
+    destroyFFTPlan(matcher->forward);
+    free(matcher->inverse);
+    free(matcher->pool);
+    free(matcher->spectrum);
+    free(matcher->sum);
+    free(matcher->sum2);
+    free(matcher);
+}
+
+// Row y of the scene, fill the first width values of every row before setMatchScene()
+double *matchSceneRow(struct TemplateMatcher *matcher, int y) {
+    return realRow(matcher->spectrum, y, matcher->transformWidth);
+}
+
+// Integral images and spectrum of the scene rows
+void setMatchScene(struct TemplateMatcher *matcher) {
+    int width = matcher->width, height = matcher->height, tw = matcher->transformWidth;
+    double *sum = matcher->sum, *sum2 = matcher->sum2;
+    memset(sum, 0, (width + 1) * sizeof(double));
+    memset(sum2, 0, (width + 1) * sizeof(double));
+    for (int y = 0; y < height; y++) {
+        double *row = matchSceneRow(matcher, y);
+        double *above = sum + (size_t) y * (width + 1), *above2 = sum2 + (size_t) y * (width + 1);
+        double *line = above + width + 1, *line2 = above2 + width + 1;
+        double run = 0.0, run2 = 0.0;
+        line[0] = line2[0] = 0.0;
+        for (int x = 0; x < width; x++) {
+            run += row[x];
+            run2 += row[x] * row[x];
+            line[x + 1] = above[x + 1] + run;
+            line2[x + 1] = above2[x + 1] + run2;
+        }
+        // The padding may hold the spectrum of the last scene
+        memset(row + width, 0, (2 * halfSpectrumWidth(tw) - width) * sizeof(double));
+    }
+    for (int y = height; y < matcher->transformHeight; y++) {
+        memset(matchSceneRow(matcher, y), 0, halfSpectrumWidth(tw) * sizeof(COMPLEX));
+    }
+    executeFFTPlan(matcher->forward, matcher->spectrum);
+}
+
+/*
+ * Transform a template of width x height pixels, rows of width doubles, for the scenes of matcher
+ * The spectrum is conjugated, so the product with the scene spectrum is the cross-correlation,
+ * and multiplied by the transform area, which the scaling of both forward transforms divides
+ * out twice. It uses the forward plan of the matcher, so not while setMatchScene() runs.
+ * Returns NULL when the template is larger than the scene or its size is not positive
+ */
+struct MatchTemplate *createMatchTemplate(struct TemplateMatcher *matcher, const double *pixels, int width,
+                                          int height) {
+    if (width < 1 || height < 1 || width > matcher->width || height > matcher->height) {
+        return NULL;
+    }
+    int tw = matcher->transformWidth, th = matcher->transformHeight, hw = halfSpectrumWidth(tw);
+    struct MatchTemplate *template = malloc(sizeof(struct MatchTemplate));
+    template->width = width;
+    template->height = height;
+    template->spectrum = calloc((size_t) th * hw, sizeof(COMPLEX));
+    if (template->spectrum == NULL) {
+        fprintf(stderr, "Cannot allocate the template!\n");
+        exit(1);
+    }
+
+    double mean = 0.0, norm2 = 0.0;
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        mean += pixels[i];
+    }
+    mean /= (double) width * height;
+    for (int y = 0; y < height; y++) {
+        double *row = realRow(template->spectrum, y, tw);
+        for (int x = 0; x < width; x++) {
+            row[x] = pixels[(size_t) y * width + x] - mean;
+            norm2 += row[x] * row[x];
+        }
+    }
+    template->norm = sqrt(norm2);
+
+    executeFFTPlan(matcher->forward, template->spectrum);
+    double area = (double) tw * th;
+    for (size_t i = 0; i < (size_t) th * hw; i++) {
+        template->spectrum[i].real *= area;
+        template->spectrum[i].imag *= -area;
+    }
+    return template;
+}
+
+void destroyMatchTemplate(struct MatchTemplate *template) {
+    if (template == NULL) return;
+    free(template->spectrum);
+    free(template);
+}
+
+/*
+ * NCC of template against the scene into pool buffer slot, row y of the scores at
+ * realRow(pool[slot], y, transformWidth) for the positions x <= width - template width and
+ * y <= height - template height
+ */
+void matchScores(struct TemplateMatcher *matcher, const struct MatchTemplate *template, int slot) {
+    COMPLEX *c = matcher->pool[slot];
+    const COMPLEX *t = template->spectrum;
+    size_t size = (size_t) matcher->transformHeight * halfSpectrumWidth(matcher->transformWidth);
+    for (size_t i = 0; i < size; i++) {
+        COMPLEX s = matcher->spectrum[i];
+        c[i].real = s.real * t[i].real - s.imag * t[i].imag;
+        c[i].imag = s.real * t[i].imag + s.imag * t[i].real;
+    }
+    executeFFTPlan(matcher->inverse[slot], c);
+
+    int stride = matcher->width + 1, w = template->width, h = template->height;
+    double n = (double) w * h;
+    for (int y = 0; y <= matcher->height - h; y++) {
+        double *row = realRow(c, y, matcher->transformWidth);
+        const double *top = matcher->sum + (size_t) y * stride, *bottom = top + (size_t) h * stride;
+        const double *top2 = matcher->sum2 + (size_t) y * stride, *bottom2 = top2 + (size_t) h * stride;
+        for (int x = 0; x <= matcher->width - w; x++) {
+            double s = bottom[x + w] - bottom[x] - top[x + w] + top[x];
+            double s2 = bottom2[x + w] - bottom2[x] - top2[x + w] + top2[x];
+            double variance = s2 - s * s / n;
+            // Rounding of the sums leaves a little variance in flat windows
+            if (template->norm == 0.0 || variance <= 1e-9 * s2) {
+                row[x] = 0.0;
+                continue;
+            }
+            double score = row[x] / (template->norm * sqrt(variance));
+            row[x] = score > 1.0 ? 1.0 : (score < -1.0 ? -1.0 : score);
+        }
+    }
+}
+
+// Vertex offset of the parabola through (-1, left), (0, centre), (1, right)
+double matchPeakOffset(double left, double centre, double right) {
+    double curvature = left - 2 * centre + right;
+    if (curvature >= 0.0) {
+        return 0.0;
+    }
+    double offset = (left - right) / (2 * curvature);
+    return offset > 0.5 ? 0.5 : (offset < -0.5 ? -0.5 : offset);
+}
+
+/*
+ * The count highest local maxima of the scores of matchScores(), best first
+ * A maximum is higher than its 8 neighbours, or equal to those after it in row order.
+ * Returns the number of peaks found
+ */
+int matchPeaks(struct TemplateMatcher *matcher, const struct MatchTemplate *template, int slot,
+               struct MatchPeak *peaks, int count) {
+    if (count <= 0) {
+        return 0;
+    }
+    COMPLEX *c = matcher->pool[slot];
+    int tw = matcher->transformWidth;
+    int lastX = matcher->width - template->width, lastY = matcher->height - template->height;
+    int found = 0;
+    for (int y = 0; y <= lastY; y++) {
+        const double *row = realRow(c, y, tw);
+        for (int x = 0; x <= lastX; x++) {
+            double score = row[x];
+            if (found == count && score <= peaks[count - 1].score) {
+                continue;
+            }
+            int peak = 1;
+            for (int dy = -1; dy <= 1 && peak; dy++) {
+                if (y + dy < 0 || y + dy > lastY) continue;
+                const double *neighbours = realRow(c, y + dy, tw);
+                for (int dx = -1; dx <= 1; dx++) {
+                    if ((dx == 0 && dy == 0) || x + dx < 0 || x + dx > lastX) continue;
+                    int after = dy > 0 || (dy == 0 && dx > 0);
+                    if (neighbours[x + dx] > score || (!after && neighbours[x + dx] == score)) {
+                        peak = 0;
+                        break;
+                    }
+                }
+            }
+            if (!peak) {
+                continue;
+            }
+
+            double fx = x, fy = y;
+            if (x > 0 && x < lastX) {
+                fx += matchPeakOffset(row[x - 1], score, row[x + 1]);
+            }
+            if (y > 0 && y < lastY) {
+                double up = realRow(c, y - 1, tw)[x], down = realRow(c, y + 1, tw)[x];
+                fy += matchPeakOffset(up, score, down);
+            }
+            // Insert into the sorted list, dropping the lowest when it is full
+            int i = found < count ? found++ : count - 1;
+            while (i > 0 && peaks[i - 1].score < score) {
+                peaks[i] = peaks[i - 1];
+                i--;
+            }
+            peaks[i].x = fx;
+            peaks[i].y = fy;
+            peaks[i].score = score;
+        }
+    }
+    return found;
+}
+
+void matchTask(void *context, int begin, int end, int worker) {
+    struct MatchBatch *batch = context;
+    for (int i = begin; i < end; i++) {
+        int index = batch->first + i;
+        matchScores(batch->matcher, batch->templates[index], i);
+        int found = matchPeaks(batch->matcher, batch->templates[index], i, batch->peaks + (size_t) index * batch->count,
+                               batch->count);
+        if (batch->found != NULL) {
+            batch->found[index] = found;
+        }
+    }
+    (void) worker;
+}
+
+/*
+ * Match templates against the scene of setMatchScene()
+ * peaks gets count peaks per template, template i from peaks[i * count], and found (may be NULL)
+ * the number of peaks of every template, which is less than count for small score maps
+ */
+void matchTemplates(struct TemplateMatcher *matcher, struct MatchTemplate *const *templates, int templateCount,
+                    struct MatchPeak *peaks, int count, int *found) {
+    struct TraceSpan span = traceBegin("matchTemplates");
+    for (int first = 0; first < templateCount; first += matcher->poolSize) {
+        int size = templateCount - first < matcher->poolSize ? templateCount - first : matcher->poolSize;
+        struct MatchBatch batch = {matcher, templates, first, count, peaks, found};
+        parallelFor(size, size, matchTask, &batch);
+    }
+    traceEnd(&span);
+}
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Digital Image Processing
+ * Work-stealing thread pool shared by every parallel kernel
+ *
+ * Note:
+ * Link with -pthread.
+ * parallelFor() cuts [0, count) into chunks and pushes them onto the deque of the calling thread.
+ * The threads of the pool, started on first use and kept until the program ends, take chunks
+ * from the bottom of their own deque and steal from the top of the others. Kernels called from
+ * several threads or pipeline stages at once thus share the same workers instead of starting
+ * threads of their own and oversubscribing the cores. A thread waiting for its chunks runs any
+ * chunk it can find in the meantime, so parallelFor() may be called from inside a task.
+ * threads limits the chunks of one call running at the same time. Every chunk gets a worker
+ * index, 0 to threads - 1, which no other running chunk of the call has, for per-thread buffers.
+ * A task may be called several times with the same index.
+ * A call is cut into PARALLEL_SPLIT chunks per thread so that the threads finish together, but
+ * no chunk is smaller than the grain (setParallelGrain(), or per call parallelForGrain()).
+ * parallelTiles() does the same for tiles of an image, 256 x 64 pixels by default.
+ * With setParallelPinning(1) every pool thread started afterwards is pinned to one core (Linux).
+ * Tasks must not wait for each other except through parallelFor().
+ */
+#ifndef DIP_PARALLEL_H
+#define DIP_PARALLEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_SPLIT 4
+
+typedef void (*ParallelTask)(void *context, int begin, int end, int worker);
+// The tile is [x0, x1) x [y0, y1)
+typedef void (*ParallelTileTask)(void *context, int x0, int y0, int x1, int y1, int worker);
+
+struct ParallelJob {
+    ParallelTask task;
+    void *context;
+    int threads;
+    atomic_ullong slots;      // Worker indices of the running chunks
+    atomic_int remaining;     // Chunks not finished
+    int finished;             // Set under the pool lock by the last chunk, the job may go once it is seen
+    pthread_cond_t done;      // The owner sleeps here, woken by the last chunk or by new chunks
+    struct ParallelJob *nextWaiting;
+};
+
+struct ParallelChunk {
+    struct ParallelJob *job;
+    int begin;
+    int end;
+};
+
+struct ParallelDeque {
+    pthread_mutex_t lock;
+    struct ParallelChunk *chunks;   // [top, bottom) are waiting
+    int top;
+    int bottom;
+    int capacity;
+};
+
+struct ParallelPool {
+    atomic_int threads;             // Including deque 0, which the threads outside the pool share
+    struct ParallelDeque deques[PARALLEL_MAX_THREADS];
+    unsigned long generation;       // Changes whenever chunks are pushed
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // The idle pool threads sleep here
+    struct ParallelJob *waiting;    // Owners asleep in parallelForGrain()
+};
+
+struct ParallelPool parallelPool;
+pthread_once_t parallelOnce = PTHREAD_ONCE_INIT;
+_Thread_local int parallelSelf = 0;   // Deque of the calling thread
+
+int parallelThreads = 1;
+int parallelGrain = 1;
+int parallelTileWidth = 256;
+int parallelTileHeight = 64;
+int parallelPinning = 0;
+
+// Threads of the kernels without a setting of their own, such as remap() and rotateLayout()
+void setParallelThreads(int threads) {
+    parallelThreads = threads;
+}
+
+// Fewest items of one chunk of parallelFor()
+void setParallelGrain(int grain) {
+    parallelGrain = grain < 1 ? 1 : grain;
+}
+
+void setParallelTileSize(int width, int height) {
+    parallelTileWidth = width < 1 ? 1 : width;
+    parallelTileHeight = height < 1 ? 1 : height;
+}
+
+void setParallelPinning(int pinning) {
+    parallelPinning = pinning;
+}
+
+void parallelInit(void) {
+    atomic_init(&parallelPool.threads, 1);
+    for (int i = 0; i < PARALLEL_MAX_THREADS; i++) {
+        pthread_mutex_init(&parallelPool.deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&parallelPool.lock, NULL);
+    pthread_cond_init(&parallelPool.changed, NULL);
+}
+
+// New chunks: wake the idle threads and the sleeping owners, which can run them as well
+void parallelSignal(void) {
+    pthread_mutex_lock(&parallelPool.lock);
+    parallelPool.generation++;
+    pthread_cond_broadcast(&parallelPool.changed);
+    for (struct ParallelJob *job = parallelPool.waiting; job != NULL; job = job->nextWaiting) {
+        pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&parallelPool.lock);
+}
+
+unsigned long parallelGeneration(void) {
+    pthread_mutex_lock(&parallelPool.lock);
+    unsigned long generation = parallelPool.generation;
+    pthread_mutex_unlock(&parallelPool.lock);
+    return generation;
+}
+
+void parallelPin(int cpu) {
+#if defined(__linux__) && defined(SYS_sched_setaffinity)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+    cpu = (int) (cpu % (cpus > 0 ? cpus : 1)) % 1024;
+    mask[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#else
+    (void) cpu;
+#endif
+}
+
+// A free worker index of the job, -1 when threads chunks are running
+int parallelClaim(struct ParallelJob *job) {
+    unsigned long long slots = atomic_load(&job->slots);
+    for (;;) {
+        int slot = 0;
+        while (slot < job->threads && (slots >> slot & 1)) slot++;
+        if (slot == job->threads) {
+            return -1;
+        }
+        if (atomic_compare_exchange_weak(&job->slots, &slots, slots | 1ULL << slot)) {
+            return slot;
+        }
+    }
+}
+
+// The first chunk from the bottom (the owner) or the top (thieves) whose job has a free index
+int parallelTakeFrom(struct ParallelDeque *deque, int bottom, struct ParallelChunk *chunk, int *slot) {
+    pthread_mutex_lock(&deque->lock);
+    int found = 0;
+    for (int k = 0; k < deque->bottom - deque->top && !found; k++) {
+        int i = bottom ? deque->bottom - 1 - k : deque->top + k;
+        *slot = parallelClaim(deque->chunks[i].job);
+        if (*slot >= 0) {
+            *chunk = deque->chunks[i];
+            memmove(deque->chunks + i, deque->chunks + i + 1, (deque->bottom - i - 1) * sizeof(struct ParallelChunk));
+            deque->bottom--;
+            found = 1;
+        }
+    }
+    if (deque->top == deque->bottom) {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+int parallelTake(struct ParallelChunk *chunk, int *slot) {
+    int threads = atomic_load(&parallelPool.threads);
+    if (parallelTakeFrom(&parallelPool.deques[parallelSelf], 1, chunk, slot)) {
+        return 1;
+    }
+    for (int k = 1; k < threads; k++) {
+        if (parallelTakeFrom(&parallelPool.deques[(parallelSelf + k) % threads], 0, chunk, slot)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Only the last chunk of a job wakes anyone, and only its owner. The index freed by any other
+ * chunk is taken by the thread that ran it, which looks for work right after.
+ */
+void parallelRun(const struct ParallelChunk *chunk, int slot) {
+    struct ParallelJob *job = chunk->job;
+    job->task(job->context, chunk->begin, chunk->end, slot);
+    atomic_fetch_and(&job->slots, ~(1ULL << slot));
+    if (atomic_fetch_sub(&job->remaining, 1) == 1) {
+        pthread_mutex_lock(&parallelPool.lock);
+        job->finished = 1;
+        pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&parallelPool.lock);
+    }
+}
+
+// Sleep until the job is finished or chunks are pushed after generation seen
+void parallelWait(struct ParallelJob *job, unsigned long seen) {
+    pthread_mutex_lock(&parallelPool.lock);
+    if (!job->finished && parallelPool.generation == seen) {
+        job->nextWaiting = parallelPool.waiting;
+        parallelPool.waiting = job;
+        while (!job->finished && parallelPool.generation == seen) {
+            pthread_cond_wait(&job->done, &parallelPool.lock);
+        }
+        struct ParallelJob **link = &parallelPool.waiting;
+        while (*link != job) link = &(*link)->nextWaiting;
+        *link = job->nextWaiting;
+    }
+    pthread_mutex_unlock(&parallelPool.lock);
+}
+
+void *parallelWorkerMain(void *argument) {
+    parallelSelf = (int) (size_t) argument;
+    if (parallelPinning) {
+        parallelPin(parallelSelf);
+    }
+    for (;;) {
+        unsigned long seen = parallelGeneration();
+        struct ParallelChunk chunk;
+        int slot;
+        if (parallelTake(&chunk, &slot)) {
+            parallelRun(&chunk, slot);
+            continue;
+        }
+        pthread_mutex_lock(&parallelPool.lock);
+        while (parallelPool.generation == seen) {
+            pthread_cond_wait(&parallelPool.changed, &parallelPool.lock);
+        }
+        pthread_mutex_unlock(&parallelPool.lock);
+    }
+    return NULL;
+}
+
+// Grow the pool to threads, the calling thread counted. Without more threads the callers do all the work
+void parallelStart(int threads) {
+    if (atomic_load(&parallelPool.threads) >= threads) return;
+    pthread_mutex_lock(&parallelPool.lock);
+    for (int i = atomic_load(&parallelPool.threads); i < threads; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, parallelWorkerMain, (void *) (size_t) i) != 0) break;
+        pthread_detach(worker);
+        atomic_store(&parallelPool.threads, i + 1);
+    }
+    pthread_mutex_unlock(&parallelPool.lock);
+}
+
+void parallelPush(struct ParallelDeque *deque, struct ParallelChunk chunk) {
+    if (deque->bottom == deque->capacity) {
+        deque->capacity = deque->capacity ? 2 * deque->capacity : 64;
+        deque->chunks = realloc(deque->chunks, deque->capacity * sizeof(struct ParallelChunk));
+        if (deque->chunks == NULL) {
+            fprintf(stderr, "Cannot allocate the work queue!\n");
+            exit(1);
+        }
+    }
+    deque->chunks[deque->bottom++] = chunk;
+}
+
+void parallelForGrain(int count, int threads, int grain, ParallelTask task, void *context) {
+    if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+    if (threads > count) threads = count;
+    int size = threads < 1 ? count : (count + threads * PARALLEL_SPLIT - 1) / (threads * PARALLEL_SPLIT);
+    size = size < grain ? grain : size;
+    if (threads <= 1 || size >= count) {
+        if (count > 0) task(context, 0, count, 0);
+        return;
+    }
+    pthread_once(&parallelOnce, parallelInit);
+    parallelStart(threads);
+
+    struct ParallelJob job = {.task = task, .context = context, .threads = threads};
+    atomic_init(&job.slots, 0);
+    atomic_init(&job.remaining, (count + size - 1) / size);
+    pthread_cond_init(&job.done, NULL);
+    struct ParallelDeque *deque = &parallelPool.deques[parallelSelf];
+    pthread_mutex_lock(&deque->lock);
+    // Pushed last to first, so the owner starts at the beginning and the thieves at the end
+    for (int begin = (count - 1) / size * size; begin >= 0; begin -= size) {
+        struct ParallelChunk chunk = {&job, begin, begin + size < count ? begin + size : count};
+        parallelPush(deque, chunk);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    parallelSignal();
+
+    while (atomic_load(&job.remaining) > 0) {
+        unsigned long seen = parallelGeneration();
+        struct ParallelChunk chunk;
+        int slot;
+        if (parallelTake(&chunk, &slot)) {
+            parallelRun(&chunk, slot);
+            continue;
+        }
+        parallelWait(&job, seen);
+    }
+    // The last chunk may still be signalling
+    pthread_mutex_lock(&parallelPool.lock);
+    while (!job.finished) {
+        pthread_cond_wait(&job.done, &parallelPool.lock);
+    }
+    pthread_mutex_unlock(&parallelPool.lock);
+    pthread_cond_destroy(&job.done);
+}
+
+void parallelFor(int count, int threads, ParallelTask task, void *context) {
+    parallelForGrain(count, threads, parallelGrain, task, context);
+}
+
+struct ParallelTiling {
+    ParallelTileTask task;
+    void *context;
+    int width;
+    int height;
+    int tileWidth;
+    int tileHeight;
+    int across;
+};
+
+void parallelTilesTask(void *context, int begin, int end, int worker) {
+    const struct ParallelTiling *tiling = context;
+    for (int i = begin; i < end; i++) {
+        int x0 = i % tiling->across * tiling->tileWidth, y0 = i / tiling->across * tiling->tileHeight;
+        int x1 = x0 + tiling->tileWidth < tiling->width ? x0 + tiling->tileWidth : tiling->width;
+        int y1 = y0 + tiling->tileHeight < tiling->height ? y0 + tiling->tileHeight : tiling->height;
+        tiling->task(tiling->context, x0, y0, x1, y1, worker);
+    }
+}
+
+// Run task on the tiles of a width x height image, row of tiles after row of tiles
+void parallelTiles(int width, int height, int threads, ParallelTileTask task, void *context) {
+    if (width < 1 || height < 1) return;
+    struct ParallelTiling tiling = {.task = task, .context = context, .width = width, .height = height,
+                                    .tileWidth = parallelTileWidth, .tileHeight = parallelTileHeight};
+    tiling.across = (width + tiling.tileWidth - 1) / tiling.tileWidth;
+    int down = (height + tiling.tileHeight - 1) / tiling.tileHeight;
+    parallelFor(tiling.across * down, threads, parallelTilesTask, &tiling);
+}
+
+#endif
@@ -0,0 +1,424 @@
+/*
+ * Digital Image Processing
+ * Pipelines of 8-bit image operations declared as a graph
+ *
+ * Note:
+ * Link with -pthread (pool.h, image.h).
+ * Every operation is a node whose inputs are earlier nodes, so the order of creation is already
+ * a topological order of the graph:
+ * PIPELINE_INPUT:   an image given to runPipeline()
+ * PIPELINE_STENCIL: a 3 x 3 stencil of one node, called row by row, the border replicated
+ * PIPELINE_MAP:     a 256-entry table applied to every pixel of one node
+ * PIPELINE_COMBINE: a pixel-wise function of two nodes
+ * runPipeline() plans the graph for the node asked for before it computes anything:
+ * - Nodes the output does not depend on are dropped.
+ * - Nodes are grouped into stages, each one pass over the image writing one buffer. A map or a
+ *   combine whose (last created) input has no other consumer is fused into the stage of that
+ *   input and runs on the row the stage has just computed, while it is still in L1.
+ * - Stages run level by level, a level being the stages whose inputs the earlier levels have
+ *   computed. Independent branches, such as the Laplacian and the Sobel branch of Assignment-3
+ *   p3f, are then run at the same time, and every stage is cut into tiles of parallelTiles().
+ *   Both go to the thread pool of parallel.h, with at most setPipelineThreads() threads.
+ * - The buffer of a stage is taken from the ImagePool when the stage starts and handed back
+ *   as soon as the last stage reading it has finished, so a later stage reuses it.
+ * The plan is kept for the next run with the same output node.
+ */
+#ifndef DIP_PIPELINE_H
+#define DIP_PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "image.h"
+#include "parallel.h"
+#include "trace.h"
+
+#define PIPELINE_MAX_NODES 64   // Stages are tracked in a 64-bit mask
+
+enum PipelineOp {
+    PIPELINE_INPUT,
+    PIPELINE_STENCIL,
+    PIPELINE_MAP,
+    PIPELINE_COMBINE
+};
+
+// out[x] from the pixels x - 1 to x + 1 of the rows above, at and below
+typedef void (*PipelineStencil)(const uint8_t *previous, const uint8_t *row, const uint8_t *next, uint8_t *out,
+                                int width);
+// out may be a or b
+typedef void (*PipelineCombine)(const uint8_t *a, const uint8_t *b, uint8_t *out, int width);
+
+struct PipelineNode {
+    enum PipelineOp op;
+    int inputs[2];
+    int index;                // Of the input images for PIPELINE_INPUT
+    PipelineStencil stencil;
+    PipelineCombine combine;
+    uint8_t table[256];
+    int consumers;            // Needed nodes reading this one, set by the plan
+    int stage;                // -1 when not needed
+};
+
+struct PipelineStage {
+    int nodes[PIPELINE_MAX_NODES];  // The node starting the stage, then the fused ones
+    int count;
+    uint64_t needs;                 // Stages read by this one
+    int halo;                       // 1 when a stencil reads the stage
+    int users;                      // Stages still to read the image while running
+    int level;                      // Stages on the longest path of stages before this one
+    struct Image *image;
+};
+
+struct Pipeline {
+    int width;
+    int height;
+    struct ImagePool *pool;
+    struct PipelineNode nodes[PIPELINE_MAX_NODES];
+    int nodeCount;
+    int inputCount;
+    struct PipelineStage stages[PIPELINE_MAX_NODES];
+    int stageCount;
+    int levelCount;
+    int plannedOutput;              // -1 before the first plan
+};
+
+struct PipelineRun {
+    struct Pipeline *pipeline;
+    const uint8_t *const *inputs;
+    int stride;
+    int stages[PIPELINE_MAX_NODES];  // Of the level being run
+    pthread_mutex_t lock;            // Of the users counts
+};
+
+// Stage of a run, for the tiles
+struct PipelineStageRun {
+    struct PipelineRun *run;
+    int stage;
+};
+
+int pipelineThreads = 1;
+
+// Threads used by runPipeline() from now on
+void setPipelineThreads(int threads) {
+    pipelineThreads = threads;
+}
+
+// Pipeline of width x height images, the intermediate buffers come from pool
+struct Pipeline *createPipeline(int width, int height, struct ImagePool *pool) {
+    if (width < 1 || height < 1) {
+        return NULL;
+    }
+    struct Pipeline *pipeline = calloc(1, sizeof(struct Pipeline));
+    if (pipeline == NULL) {
+        fprintf(stderr, "Cannot allocate the pipeline!\n");
+        exit(1);
+    }
+    pipeline->width = width;
+    pipeline->height = height;
+    pipeline->pool = pool;
+    pipeline->plannedOutput = -1;
+    return pipeline;
+}
+
+void destroyPipeline(struct Pipeline *pipeline) {
+    free(pipeline);
+}
+
+struct PipelineNode *pipelineNode(struct Pipeline *pipeline, enum PipelineOp op, int a, int b) {
+    if (pipeline->nodeCount == PIPELINE_MAX_NODES) {
+        fprintf(stderr, "Too many pipeline nodes!\n");
+        exit(1);
+    }
+    int count = op == PIPELINE_INPUT ? 0 : (op == PIPELINE_COMBINE ? 2 : 1);
+    if ((count > 0 && (a < 0 || a >= pipeline->nodeCount)) || (count > 1 && (b < 0 || b >= pipeline->nodeCount))) {
+        fprintf(stderr, "Invalid pipeline input!\n");
+        exit(1);
+    }
+    struct PipelineNode *node = &pipeline->nodes[pipeline->nodeCount++];
+    memset(node, 0, sizeof(struct PipelineNode));
+    node->op = op;
+    node->inputs[0] = a;
+    node->inputs[1] = b;
+    pipeline->plannedOutput = -1;
+    return node;
+}
+
+// The nodes return their index, which later nodes and runPipeline() take
+
+// The n-th call is the n-th image of runPipeline()
+int pipelineInput(struct Pipeline *pipeline) {
+    pipelineNode(pipeline, PIPELINE_INPUT, -1, -1)->index = pipeline->inputCount++;
+    return pipeline->nodeCount - 1;
+}
+
+int pipelineStencil(struct Pipeline *pipeline, int input, PipelineStencil stencil) {
+    pipelineNode(pipeline, PIPELINE_STENCIL, input, -1)->stencil = stencil;
+    return pipeline->nodeCount - 1;
+}
+
+int pipelineMap(struct Pipeline *pipeline, int input, const uint8_t *table) {
+    memcpy(pipelineNode(pipeline, PIPELINE_MAP, input, -1)->table, table, 256);
+    return pipeline->nodeCount - 1;
+}
+
+int pipelineCombine(struct Pipeline *pipeline, int a, int b, PipelineCombine combine) {
+    pipelineNode(pipeline, PIPELINE_COMBINE, a, b)->combine = combine;
+    return pipeline->nodeCount - 1;
+}
+
+int pipelineInputCount(const struct PipelineNode *node) {
+    return node->op == PIPELINE_INPUT ? 0 : (node->op == PIPELINE_COMBINE ? 2 : 1);
+}
+
+void planPipeline(struct Pipeline *pipeline, int output) {
+    struct PipelineNode *nodes = pipeline->nodes;
+    int needed[PIPELINE_MAX_NODES] = {0};
+    needed[output] = 1;
+    for (int i = output; i >= 0; i--) {
+        nodes[i].consumers = i == output;
+        nodes[i].stage = -1;
+        for (int k = 0; needed[i] && k < pipelineInputCount(&nodes[i]); k++) {
+            needed[nodes[i].inputs[k]] = 1;
+        }
+    }
+    for (int i = 0; i <= output; i++) {
+        for (int k = 0; needed[i] && k < pipelineInputCount(&nodes[i]); k++) {
+            nodes[nodes[i].inputs[k]].consumers++;
+        }
+    }
+
+    pipeline->stageCount = 0;
+    for (int i = 0; i <= output; i++) {
+        if (!needed[i]) continue;
+        struct PipelineNode *node = &nodes[i];
+        int last = node->inputs[0];
+        if (node->op == PIPELINE_COMBINE && node->inputs[1] > last) last = node->inputs[1];
+        int fused = (node->op == PIPELINE_MAP || node->op == PIPELINE_COMBINE) && nodes[last].consumers == 1;
+        // The input is then the last node of its stage, nothing else could have joined after it
+        if (fused) {
+            node->stage = nodes[last].stage;
+        } else {
+            node->stage = pipeline->stageCount++;
+            pipeline->stages[node->stage].count = 0;
+            pipeline->stages[node->stage].needs = 0;
+            pipeline->stages[node->stage].halo = 0;
+        }
+        struct PipelineStage *stage = &pipeline->stages[node->stage];
+        stage->nodes[stage->count++] = i;
+        for (int k = 0; k < pipelineInputCount(node); k++) {
+            struct PipelineNode *input = &nodes[node->inputs[k]];
+            if (input->stage != node->stage) {
+                stage->needs |= (uint64_t) 1 << input->stage;
+            }
+            if (node->op == PIPELINE_STENCIL) {
+                pipeline->stages[input->stage].halo = 1;
+            }
+        }
+    }
+    pipeline->levelCount = 0;
+    for (int s = 0; s < pipeline->stageCount; s++) {
+        struct PipelineStage *stage = &pipeline->stages[s];
+        stage->level = 0;
+        for (int t = 0; t < s; t++) {
+            if ((stage->needs >> t & 1) && pipeline->stages[t].level >= stage->level) {
+                stage->level = pipeline->stages[t].level + 1;
+            }
+        }
+        pipeline->levelCount = stage->level >= pipeline->levelCount ? stage->level + 1 : pipeline->levelCount;
+    }
+    pipeline->plannedOutput = output;
+}
+
+// Stages and their nodes, for checking what was fused
+void printPipelinePlan(const struct Pipeline *pipeline, FILE *out) {
+    static const char *names[] = {"input", "stencil", "map", "combine"};
+    for (int s = 0; s < pipeline->stageCount; s++) {
+        const struct PipelineStage *stage = &pipeline->stages[s];
+        fprintf(out, "Stage %d:", s);
+        for (int i = 0; i < stage->count; i++) {
+            fprintf(out, " %s%d", names[pipeline->nodes[stage->nodes[i]].op], stage->nodes[i]);
+        }
+        fprintf(out, stage->needs ? ", after" : "\n");
+        for (int t = 0; t < s && stage->needs; t++) {
+            if (stage->needs >> t & 1) fprintf(out, " %d", t);
+        }
+        if (stage->needs) fprintf(out, "\n");
+    }
+}
+
+// Pixel (x, y) of the image holding node, the last node of its stage
+const uint8_t *pipelinePixels(const struct Pipeline *pipeline, int node, int x, int y) {
+    return imageRow(pipeline->stages[pipeline->nodes[node].stage].image, y) + x;
+}
+
+void pipelineTileTask(void *context, int x0, int y0, int x1, int y1, int worker) {
+    const struct PipelineStageRun *stageRun = context;
+    const struct PipelineRun *run = stageRun->run;
+    const struct Pipeline *pipeline = run->pipeline;
+    const struct PipelineStage *stage = &pipeline->stages[stageRun->stage];
+    const struct PipelineNode *first = &pipeline->nodes[stage->nodes[0]];
+    int width = x1 - x0;
+    for (int y = y0; y < y1; y++) {
+        uint8_t *out = imageRow(stage->image, y) + x0;
+        const uint8_t *a = first->op == PIPELINE_INPUT ? NULL : pipelinePixels(pipeline, first->inputs[0], x0, y);
+        switch (first->op) {
+            case PIPELINE_INPUT:
+                memcpy(out, run->inputs[first->index] + (size_t) y * run->stride + x0, width);
+                break;
+            case PIPELINE_STENCIL:
+                first->stencil(pipelinePixels(pipeline, first->inputs[0], x0, y - 1), a,
+                               pipelinePixels(pipeline, first->inputs[0], x0, y + 1), out, width);
+                break;
+            case PIPELINE_MAP:
+                for (int x = 0; x < width; x++) {
+                    out[x] = first->table[a[x]];
+                }
+                break;
+            case PIPELINE_COMBINE:
+                first->combine(a, pipelinePixels(pipeline, first->inputs[1], x0, y), out, width);
+                break;
+        }
+        // The fused nodes work on out in place
+        for (int i = 1; i < stage->count; i++) {
+            const struct PipelineNode *node = &pipeline->nodes[stage->nodes[i]];
+            if (node->op == PIPELINE_MAP) {
+                for (int x = 0; x < width; x++) {
+                    out[x] = node->table[out[x]];
+                }
+            } else if (node->inputs[0] == stage->nodes[i - 1]) {
+                node->combine(out, pipelinePixels(pipeline, node->inputs[1], x0, y), out, width);
+            } else {
+                node->combine(pipelinePixels(pipeline, node->inputs[0], x0, y), out, out, width);
+            }
+        }
+    }
+    (void) worker;
+}
+
+// Stages of one level, each computed and then releasing the images it has read
+void pipelineStagesTask(void *context, int begin, int end, int worker) {
+    struct PipelineRun *run = context;
+    struct Pipeline *pipeline = run->pipeline;
+    for (int i = begin; i < end; i++) {
+        struct PipelineStageRun stageRun = {run, run->stages[i]};
+        struct PipelineStage *stage = &pipeline->stages[stageRun.stage];
+        struct TraceSpan span = traceBegin("pipeline stage");
+        stage->image = createImage(pipeline->width, pipeline->height, stage->halo, pipeline->pool);
+        parallelTiles(pipeline->width, pipeline->height, pipelineThreads, pipelineTileTask, &stageRun);
+        if (stage->halo) {
+            fillHalo(stage->image, HALO_REPLICATE, 0);
+        }
+        traceEnd(&span);
+        pthread_mutex_lock(&run->lock);
+        for (int t = 0; t < stageRun.stage; t++) {
+            if ((stage->needs >> t & 1) && --pipeline->stages[t].users == 0) {
+                destroyImage(pipeline->stages[t].image);
+                pipeline->stages[t].image = NULL;
+            }
+        }
+        pthread_mutex_unlock(&run->lock);
+    }
+    (void) worker;
+}
+
+/*
+ * Compute node output of the images inputs, in the order of pipelineInput(), into result
+ * The inputs have rows stride bytes apart, the result resultStride bytes apart
+ */
+void runPipelineStrides(struct Pipeline *pipeline, const uint8_t *const *inputs, int stride, int output,
+                        uint8_t *result, int resultStride) {
+    if (output < 0 || output >= pipeline->nodeCount) {
+        fprintf(stderr, "Invalid pipeline output!\n");
+        exit(1);
+    }
+    if (pipeline->plannedOutput != output) {
+        planPipeline(pipeline, output);
+    }
+    struct PipelineRun run = {.pipeline = pipeline, .inputs = inputs, .stride = stride};
+    struct TraceSpan span = traceBegin("runPipeline");
+    for (int s = 0; s < pipeline->stageCount; s++) {
+        pipeline->stages[s].users = 0;
+    }
+    // The output stage is read once more below
+    pipeline->stages[pipeline->nodes[output].stage].users = 1;
+    for (int s = 0; s < pipeline->stageCount; s++) {
+        for (int t = 0; t < s; t++) {
+            pipeline->stages[t].users += pipeline->stages[s].needs >> t & 1;
+        }
+    }
+    pthread_mutex_init(&run.lock, NULL);
+    for (int level = 0; level < pipeline->levelCount; level++) {
+        int count = 0;
+        for (int s = 0; s < pipeline->stageCount; s++) {
+            if (pipeline->stages[s].level == level) run.stages[count++] = s;
+        }
+        // One chunk per stage, whatever the grain
+        parallelForGrain(count, pipelineThreads, 1, pipelineStagesTask, &run);
+    }
+    pthread_mutex_destroy(&run.lock);
+
+    struct PipelineStage *last = &pipeline->stages[pipeline->nodes[output].stage];
+    storeImage(last->image, result, resultStride);
+    destroyImage(last->image);
+    last->image = NULL;
+    traceEnd(&span);
+}
+
+// Same as runPipelineStrides() with every image rows stride bytes apart
+void runPipeline(struct Pipeline *pipeline, const uint8_t *const *inputs, int stride, int output, uint8_t *result) {
+    runPipelineStrides(pipeline, inputs, stride, output, result, stride);
+}
+
+// Operations of Assignment-3
+
+// Image minus its Laplacian, 4-neighbour, p3b and p3c
+void sharpenRow(const uint8_t *previous, const uint8_t *row, const uint8_t *next, uint8_t *out, int width) {
+    for (int x = 0; x < width; x++) {
+        int laplacian = row[x] * 4 - (previous[x] + next[x] + row[x - 1] + row[x + 1]);
+        out[x] = saturatePixel(row[x] - laplacian);
+    }
+}
+
+// |Gx| + |Gy| of the Sobel operators, p3d
+void sobelRow(const uint8_t *previous, const uint8_t *row, const uint8_t *next, uint8_t *out, int width) {
+    for (int x = 0; x < width; x++) {
+        int gx = previous[x + 1] + 2 * row[x + 1] + next[x + 1] - previous[x - 1] - 2 * row[x - 1] - next[x - 1];
+        int gy = previous[x - 1] + 2 * previous[x] + previous[x + 1] - next[x - 1] - 2 * next[x] - next[x + 1];
+        out[x] = saturatePixel(abs(gx) + abs(gy));
+    }
+}
+
+// 3 x 3 mean, p3e
+void boxRow(const uint8_t *previous, const uint8_t *row, const uint8_t *next, uint8_t *out, int width) {
+    for (int x = 0; x < width; x++) {
+        out[x] = (previous[x - 1] + previous[x] + previous[x + 1] +
+                  row[x - 1] + row[x] + row[x + 1] +
+                  next[x - 1] + next[x] + next[x + 1]) / 9;
+    }
+}
+
+// a * b / 255, p3f
+void multiplyRows(const uint8_t *a, const uint8_t *b, uint8_t *out, int width) {
+    for (int x = 0; x < width; x++) {
+        out[x] = a[x] * b[x] / 255;
+    }
+}
+
+// Saturated a + b, p3g
+void addRows(const uint8_t *a, const uint8_t *b, uint8_t *out, int width) {
+    for (int x = 0; x < width; x++) {
+        out[x] = saturatePixel(a[x] + b[x]);
+    }
+}
+
+// 256 * (v / 256)^gamma, p3h
+void powerLawTable(uint8_t *table, double gamma) {
+    for (int v = 0; v < 256; v++) {
+        table[v] = (uint8_t) (256.0 * pow(v / 256.0, gamma));
+    }
+}
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * Digital Image Processing
+ * Buffer pool for intermediate images and spectra
+ *
+ * Note:
+ * Link with -pthread.
+ * Freed buffers are kept on a free list per size class and handed out again, so a program that
+ * processes frame after frame only asks the system for memory during the first frame and its
+ * pages stay resident. The classes are 8 per power of 2, a buffer is at most 12.5% larger than
+ * asked for, and frame sizes such as 512 x 512 bytes or 1024 x 1024 doubles are classes exactly.
+ * Every buffer starts on a 64-byte cache line. With hugePages set, buffers of 2 MB and more are
+ * allocated in whole 2 MB pages and marked for transparent huge pages where the system has them.
+ * poolReserve() allocates and touches buffers up front, so the first frame does not fault
+ * them in either. The pool counts the bytes in use and their peak for poolReport().
+ * The pool is thread-safe, the buffers are freed all at once by destroyImagePool().
+ */
+#ifndef DIP_POOL_H
+#define DIP_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define POOL_ALIGNMENT 64
+#define POOL_HUGE_PAGE ((size_t) 2 << 20)
+#define POOL_STEPS 8                     // Classes per power of 2
+#define POOL_CLASSES (64 * POOL_STEPS + 1)
+
+// Header in the cache line before every buffer
+union PoolBlock {
+    struct {
+        union PoolBlock *next;   // Free list of the class
+        union PoolBlock *all;    // Every block of the pool
+        size_t size;             // Bytes of the class
+        int sizeClass;
+        int inUse;
+    } header;
+    char line[POOL_ALIGNMENT];
+};
+
+struct ImagePool {
+    int hugePages;
+    union PoolBlock *free[POOL_CLASSES];
+    union PoolBlock *all;
+    size_t inUse;             // Bytes of the buffers handed out, by class size
+    size_t peak;
+    size_t held;              // Bytes of every buffer, in use or free
+    unsigned long allocations;
+    unsigned long systemAllocations;
+    pthread_mutex_t lock;
+};
+
+// Class of a buffer of size bytes, *classSize gets the bytes of the class
+int poolSizeClass(size_t size, size_t *classSize) {
+    if (size <= POOL_ALIGNMENT) {
+        *classSize = POOL_ALIGNMENT;
+        return 0;
+    }
+    int k = 0;
+    while (((size_t) 2 << k) < size) k++;
+    // (base, 2 * base] in POOL_STEPS steps
+    size_t base = (size_t) 1 << k, step = base / POOL_STEPS;
+    size_t n = (size - base + step - 1) / step;
+    *classSize = base + n * step;
+    return k * POOL_STEPS + (int) n;
+}
+
+struct ImagePool *createImagePool(int hugePages) {
+    struct ImagePool *pool = calloc(1, sizeof(struct ImagePool));
+    if (pool == NULL) {
+        fprintf(stderr, "Cannot allocate the pool!\n");
+        exit(1);
+    }
+    pool->hugePages = hugePages;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+union PoolBlock *poolSystemAllocate(const struct ImagePool *pool, size_t size) {
+    size_t alignment = pool->hugePages && size >= POOL_HUGE_PAGE ? POOL_HUGE_PAGE : POOL_ALIGNMENT;
+    // The header and the buffer share the huge pages, whole pages are asked for
+    size_t total = (sizeof(union PoolBlock) + size + alignment - 1) / alignment * alignment;
+    void *base;
+#ifdef _WIN32
+    base = _aligned_malloc(total, alignment);
+#else
+    if (posix_memalign(&base, alignment, total) != 0) {
+        base = NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (base != NULL && alignment == POOL_HUGE_PAGE) {
+        madvise(base, total, MADV_HUGEPAGE);
+    }
+#endif
+#endif
+    if (base == NULL) {
+        fprintf(stderr, "Cannot allocate the pool buffer!\n");
+        exit(1);
+    }
+    return base;
+}
+
+// Buffer of at least size bytes, 64-byte aligned, with the contents of its last use
+void *poolAlloc(struct ImagePool *pool, size_t size) {
+    size_t classSize;
+    int sizeClass = poolSizeClass(size, &classSize);
+    pthread_mutex_lock(&pool->lock);
+    union PoolBlock *block = pool->free[sizeClass];
+    if (block != NULL) {
+        pool->free[sizeClass] = block->header.next;
+    } else {
+        block = poolSystemAllocate(pool, classSize);
+        block->header.size = classSize;
+        block->header.sizeClass = sizeClass;
+        block->header.all = pool->all;
+        pool->all = block;
+        pool->held += classSize;
+        pool->systemAllocations++;
+    }
+    block->header.inUse = 1;
+    pool->inUse += classSize;
+    pool->peak = pool->inUse > pool->peak ? pool->inUse : pool->peak;
+    pool->allocations++;
+    pthread_mutex_unlock(&pool->lock);
+    return block + 1;
+}
+
+void *poolCalloc(struct ImagePool *pool, size_t size) {
+    void *buffer = poolAlloc(pool, size);
+    memset(buffer, 0, size);
+    return buffer;
+}
+
+// Return a buffer of poolAlloc() to the pool, NULL is ignored
+void poolFree(struct ImagePool *pool, void *buffer) {
+    if (buffer == NULL) return;
+    union PoolBlock *block = (union PoolBlock *) buffer - 1;
+    pthread_mutex_lock(&pool->lock);
+    if (!block->header.inUse) {
+        fprintf(stderr, "Pool buffer freed twice!\n");
+        exit(1);
+    }
+    block->header.inUse = 0;
+    block->header.next = pool->free[block->header.sizeClass];
+    pool->free[block->header.sizeClass] = block;
+    pool->inUse -= block->header.size;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Allocate count buffers of size bytes and touch their pages, then keep them free for later
+void poolReserve(struct ImagePool *pool, size_t size, int count) {
+    void **buffers = malloc(count * sizeof(void *));
+    if (buffers == NULL) {
+        fprintf(stderr, "Cannot allocate the pool!\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        buffers[i] = poolCalloc(pool, size);
+    }
+    for (int i = 0; i < count; i++) {
+        poolFree(pool, buffers[i]);
+    }
+    free(buffers);
+}
+
+void poolReport(struct ImagePool *pool, FILE *out, const char *name) {
+    pthread_mutex_lock(&pool->lock);
+    fprintf(out, "%s: peak %.1f KB in use, %.1f KB held, %lu allocations, %lu from the system\n",
+            name, pool->peak / 1024.0, pool->held / 1024.0, pool->allocations, pool->systemAllocations);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Frees every buffer, including those still in use
+void destroyImagePool(struct ImagePool *pool) {
+    if (pool == NULL) return;
+    union PoolBlock *block = pool->all;
+    while (block != NULL) {
+        union PoolBlock *next = block->header.all;
+#ifdef _WIN32
+        _aligned_free(block);
+#else
+        free(block);
+#endif
+        block = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+#endif
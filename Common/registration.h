@@ -0,0 +1,401 @@
+/*
+ * Digital Image Processing
+ * Frame-to-frame registration by phase correlation, with an optional log-polar stage for
+ * rotation and scale
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type.
+ * Frames are height rows of width doubles, the width must be even. A frame is multiplied by a
+ * Hann window and transformed by the real FFT of rfft.h. For the previous spectrum P and the
+ * current spectrum C the inverse transform of C * conj(P) / |C * conj(P)| peaks at the shift
+ * of the current frame, found to a fraction of a pixel from the neighbours of the peak.
+ * The spectrum of the last frame is kept, so registering a stream costs one forward and one
+ * inverse transform per frame, and a single pair two forward transforms and one inverse.
+ *
+ * With logPolar set, the rotation and scale are found first. The magnitude spectrum does not
+ * change with the shift, and rotating and scaling the frame rotates and shrinks it, which in
+ * log-polar coordinates (log radius across, angle down, angles of half a turn since the
+ * magnitude is symmetric) is a shift again, found by phase correlation of the two maps. The
+ * magnitudes are weighted by a high-pass emphasis so the low frequencies do not dominate. The
+ * current frame is then turned and scaled back and phase correlated with the previous one for
+ * the shift, trying both angles of the half-turn ambiguity. That adds a forward transform of
+ * the map, one inverse of the maps, and two forward transforms and two inverses of the frame.
+ *
+ * The plans, the windows, the emphasis and the log-polar sample table are made once by
+ * createRegistration() and reused for every frame. A registration must not be used by two
+ * threads at once.
+ */
+#ifndef DIP_REGISTRATION_H
+#define DIP_REGISTRATION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rfft.h"
+
+/*
+ * The current frame is the previous one turned by angle degrees about the centre
+ * (width / 2, height / 2), from the x axis toward the y axis of the rows, scaled by scale and
+ * then shifted by (dx, dy) pixels
+ */
+struct RegistrationResult {
+    double dx;
+    double dy;
+    double angle;
+    double scale;
+    double peak;   // Height of the correlation peak, 1 for a pure shift, near 0 for unrelated frames
+};
+
+// Bilinear sample of the half-spectrum magnitudes
+struct PolarSample {
+    unsigned int top;     // Index of the top-left magnitude
+    unsigned int bottom;  // Index of the bottom-left magnitude
+    float fx;
+    float fy;
+};
+
+struct Registration {
+    int width;
+    int height;
+    int logPolar;
+    int polarWidth;           // Log radii
+    int polarHeight;          // Angles of half a turn
+    double logBase;           // Log radius step
+    struct FFTPlan *forward;
+    struct FFTPlan *inverse;
+    struct FFTPlan *polarForward;
+    struct FFTPlan *polarInverse;
+    double *windowX;          // Hann window, separable
+    double *windowY;
+    double *frame;            // Current frame as given
+    COMPLEX *current;         // Half spectra of the frames
+    COMPLEX *previous;
+    COMPLEX *cross;           // Normalized cross power, then the correlation surface
+    double *emphasis;         // High-pass emphasis of every half-spectrum value
+    double *magnitude;
+    struct PolarSample *samples;
+    COMPLEX *currentPolar;    // Half spectra of the log-polar maps
+    COMPLEX *previousPolar;
+    COMPLEX *polarCross;
+    double *undone;           // Current frame turned and scaled back
+    COMPLEX *turned;          // Its half spectrum
+    int frames;
+};
+
+double *registrationHann(int n) {
+    double *window = malloc(n * sizeof(double));
+    if (window == NULL) {
+        fprintf(stderr, "Cannot allocate the registration!\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        window[i] = 0.5 - 0.5 * cos(2 * acos(-1) * (i + 0.5) / n);
+    }
+    return window;
+}
+
+COMPLEX *registrationSpectrum(int width, int height) {
+    COMPLEX *c = calloc((size_t) height * halfSpectrumWidth(width), sizeof(COMPLEX));
+    if (c == NULL) {
+        fprintf(stderr, "Cannot allocate the registration!\n");
+        exit(1);
+    }
+    return c;
+}
+
+// Emphasis (1 - X) * (2 - X), X = cos(PI * u / width) * cos(PI * v / height), and the sample table
+void initLogPolar(struct Registration *registration) {
+    int width = registration->width, height = registration->height, hw = halfSpectrumWidth(width);
+    registration->emphasis = malloc((size_t) height * hw * sizeof(double));
+    registration->magnitude = malloc((size_t) height * hw * sizeof(double));
+    if (registration->emphasis == NULL || registration->magnitude == NULL) {
+        fprintf(stderr, "Cannot allocate the registration!\n");
+        exit(1);
+    }
+    for (int v = 0; v < height; v++) {
+        for (int u = 0; u < hw; u++) {
+            double x = cos(acos(-1) * u / width) * cos(acos(-1) * signedFrequency(v, height) / height);
+            registration->emphasis[(size_t) v * hw + u] = (1 - x) * (2 - x);
+        }
+    }
+
+    // Radii from 1 to just inside the highest frequency of the shorter side
+    int pw = registration->polarWidth, ph = registration->polarHeight;
+    double radius = (width < height ? width : height) / 2.0 - 1;
+    registration->logBase = log(radius) / pw;
+    registration->samples = malloc((size_t) pw * ph * sizeof(struct PolarSample));
+    if (registration->samples == NULL) {
+        fprintf(stderr, "Cannot allocate the registration!\n");
+        exit(1);
+    }
+    for (int j = 0; j < ph; j++) {
+        double theta = acos(-1) * j / ph;
+        for (int k = 0; k < pw; k++) {
+            double r = exp(k * registration->logBase);
+            double fu = r * cos(theta), fv = r * sin(theta);
+            // |F(-u, -v)| = |F(u, v)|, only u >= 0 is stored
+            if (fu < 0) {
+                fu = -fu;
+                fv = -fv;
+            }
+            int u = (int) floor(fu), v = (int) floor(fv);
+            struct PolarSample *sample = &registration->samples[(size_t) j * pw + k];
+            sample->top = (unsigned int) (((v + height) % height) * hw + u);
+            sample->bottom = (unsigned int) (((v + 1 + height) % height) * hw + u);
+            sample->fx = (float) (fu - u);
+            sample->fy = (float) (fv - v);
+        }
+    }
+    registration->polarForward = createFFTPlan(FFT_PLAN_REAL, pw, ph, 1);
+    registration->polarInverse = createFFTPlan(FFT_PLAN_REAL, pw, ph, -1);
+    registration->currentPolar = registrationSpectrum(pw, ph);
+    registration->previousPolar = registrationSpectrum(pw, ph);
+    registration->polarCross = registrationSpectrum(pw, ph);
+    registration->undone = malloc((size_t) width * height * sizeof(double));
+    if (registration->undone == NULL) {
+        fprintf(stderr, "Cannot allocate the registration!\n");
+        exit(1);
+    }
+    registration->turned = registrationSpectrum(width, height);
+}
+
+/*
+ * Registration of frames of width x height, logPolar = 1 to estimate rotation and scale too
+ * Returns NULL when the width is odd or the size is too small
+ */
+struct Registration *createRegistration(int width, int height, int logPolar) {
+    if (width < 4 || height < 4 || width % 2 != 0) {
+        return NULL;
+    }
+    struct Registration *registration = calloc(1, sizeof(struct Registration));
+    registration->width = width;
+    registration->height = height;
+    registration->logPolar = logPolar;
+    registration->forward = createFFTPlan(FFT_PLAN_REAL, width, height, 1);
+    registration->inverse = createFFTPlan(FFT_PLAN_REAL, width, height, -1);
+    registration->windowX = registrationHann(width);
+    registration->windowY = registrationHann(height);
+    registration->frame = malloc((size_t) width * height * sizeof(double));
+    if (registration->frame == NULL) {
+        fprintf(stderr, "Cannot allocate the registration!\n");
+        exit(1);
+    }
+    registration->current = registrationSpectrum(width, height);
+    registration->previous = registrationSpectrum(width, height);
+    registration->cross = registrationSpectrum(width, height);
+    if (logPolar) {
+        // A power of 2 of about half the longer side in both directions
+        int n = 8;
+        while (n < (width > height ? width : height) / 2) n *= 2;
+        registration->polarWidth = n;
+        registration->polarHeight = n;
+        initLogPolar(registration);
+    }
+    return registration;
+}
+
+void destroyRegistration(struct Registration *registration) {
+    if (registration == NULL) return;
+    destroyFFTPlan(registration->forward);
+    destroyFFTPlan(registration->inverse);
+    free(registration->windowX);
+    free(registration->windowY);
+    free(registration->frame);
+    free(registration->current);
+    free(registration->previous);
+    free(registration->cross);
+    if (registration->logPolar) {
+        destroyFFTPlan(registration->polarForward);
+        destroyFFTPlan(registration->polarInverse);
+        free(registration->emphasis);
+        free(registration->magnitude);
+        free(registration->samples);
+        free(registration->currentPolar);
+        free(registration->previousPolar);
+        free(registration->polarCross);
+        free(registration->undone);
+        free(registration->turned);
+    }
+    free(registration);
+}
+
+// Row y of the next frame, fill every row before registerFrame()
+double *registrationRow(struct Registration *registration, int y) {
+    return registration->frame + (size_t) y * registration->width;
+}
+
+// Windowed frame -> half spectrum in c
+void registrationTransform(struct Registration *registration, const double *frame, COMPLEX *c) {
+    int width = registration->width;
+    for (int y = 0; y < registration->height; y++) {
+        const double *src = frame + (size_t) y * width;
+        double *row = realRow(c, y, width), wy = registration->windowY[y];
+        for (int x = 0; x < width; x++) {
+            row[x] = src[x] * registration->windowX[x] * wy;
+        }
+    }
+    executeFFTPlan(registration->forward, c);
+}
+
+/*
+ * Offset of a phase correlation peak from its larger neighbour. A shift of d pixels gives a
+ * Dirichlet kernel, about sin(PI * d) / (PI * d), whose two samples around the peak are in the
+ * ratio (1 - |d|) : |d|.
+ */
+double registrationPeakOffset(double left, double centre, double right) {
+    double side = right > left ? right : left, sign = right > left ? 1.0 : -1.0;
+    if (side <= 0.0 || centre <= 0.0) {
+        return 0.0;
+    }
+    return sign * side / (side + centre);
+}
+
+/*
+ * Phase correlation of the half spectra a and b of width x height through plan, cross is
+ * overwritten. (x, y) gets the shift of b from a, from -size / 2 to size / 2, and the height of
+ * the peak is returned.
+ */
+double phaseCorrelate(const COMPLEX *a, const COMPLEX *b, COMPLEX *cross, int width, int height,
+                      const struct FFTPlan *plan, double *x, double *y) {
+    int hw = halfSpectrumWidth(width);
+    for (size_t i = 0; i < (size_t) height * hw; i++) {
+        double re = b[i].real * a[i].real + b[i].imag * a[i].imag;
+        double im = b[i].imag * a[i].real - b[i].real * a[i].imag;
+        double magnitude = sqrt(re * re + im * im);
+        cross[i].real = magnitude > 0.0 ? re / magnitude : 0.0;
+        cross[i].imag = magnitude > 0.0 ? im / magnitude : 0.0;
+    }
+    executeFFTPlan(plan, cross);
+
+    int px = 0, py = 0;
+    double peak = -INFINITY;
+    for (int v = 0; v < height; v++) {
+        const double *row = realRow(cross, v, width);
+        for (int u = 0; u < width; u++) {
+            if (row[u] > peak) {
+                peak = row[u];
+                px = u;
+                py = v;
+            }
+        }
+    }
+    const double *row = realRow(cross, py, width);
+    double left = row[(px + width - 1) % width], right = row[(px + 1) % width];
+    double up = realRow(cross, (py + height - 1) % height, width)[px];
+    double down = realRow(cross, (py + 1) % height, width)[px];
+    *x = signedFrequency(px, width) + registrationPeakOffset(left, peak, right);
+    *y = signedFrequency(py, height) + registrationPeakOffset(up, peak, down);
+    // The inverse is not scaled and the cross power has unit magnitude
+    return peak / ((double) width * height);
+}
+
+// Log-polar map of the emphasized magnitudes of half spectrum c -> half spectrum in polar
+void registrationLogPolar(struct Registration *registration, const COMPLEX *c, COMPLEX *polar) {
+    size_t size = (size_t) registration->height * halfSpectrumWidth(registration->width);
+    double *magnitude = registration->magnitude;
+    for (size_t i = 0; i < size; i++) {
+        magnitude[i] = sqrt(c[i].real * c[i].real + c[i].imag * c[i].imag) * registration->emphasis[i];
+    }
+    int pw = registration->polarWidth;
+    for (int j = 0; j < registration->polarHeight; j++) {
+        double *row = realRow(polar, j, pw);
+        const struct PolarSample *sample = registration->samples + (size_t) j * pw;
+        for (int k = 0; k < pw; k++, sample++) {
+            double top = magnitude[sample->top] + sample->fx * (magnitude[sample->top + 1] - magnitude[sample->top]);
+            double bottom = magnitude[sample->bottom] +
+                            sample->fx * (magnitude[sample->bottom + 1] - magnitude[sample->bottom]);
+            row[k] = top + sample->fy * (bottom - top);
+        }
+    }
+    executeFFTPlan(registration->polarForward, polar);
+}
+
+// The frame turned by -angle degrees and scaled by 1 / scale about the centre, bilinear, 0 outside
+void registrationUndo(const struct Registration *registration, double angle, double scale, double *dst) {
+    int width = registration->width, height = registration->height;
+    double radian = angle * acos(-1) / 180, cx = width / 2, cy = height / 2;
+    double c = cos(radian) * scale, s = sin(radian) * scale;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double sx = c * (x - cx) - s * (y - cy) + cx, sy = s * (x - cx) + c * (y - cy) + cy;
+            int x0 = (int) floor(sx), y0 = (int) floor(sy);
+            double value = 0.0;
+            if (x0 >= 0 && y0 >= 0 && x0 + 1 < width && y0 + 1 < height) {
+                const double *row = registration->frame + (size_t) y0 * width + x0;
+                double fx = sx - x0, fy = sy - y0;
+                double top = row[0] + fx * (row[1] - row[0]), bottom = row[width] + fx * (row[width + 1] - row[width]);
+                value = top + fy * (bottom - top);
+            }
+            dst[(size_t) y * width + x] = value;
+        }
+    }
+}
+
+/*
+ * Register the frame in registrationRow() against the last one
+ * Returns 0 for the first frame, which only becomes the reference, and 1 with result filled
+ */
+int registerFrame(struct Registration *registration, struct RegistrationResult *result) {
+    int width = registration->width, height = registration->height, first = registration->frames++ == 0;
+    COMPLEX *swap = registration->previous;
+    registration->previous = registration->current;
+    registration->current = swap;
+    registrationTransform(registration, registration->frame, registration->current);
+    if (registration->logPolar) {
+        swap = registration->previousPolar;
+        registration->previousPolar = registration->currentPolar;
+        registration->currentPolar = swap;
+        registrationLogPolar(registration, registration->current, registration->currentPolar);
+    }
+    if (first) {
+        return 0;
+    }
+
+    result->angle = 0.0;
+    result->scale = 1.0;
+    if (!registration->logPolar) {
+        result->peak = phaseCorrelate(registration->previous, registration->current, registration->cross, width, height,
+                                      registration->inverse, &result->dx, &result->dy);
+        return 1;
+    }
+
+    // A shift of the map by k radii is a scale of exp(-k * logBase), by j angles a turn of
+    // 180 * j / polarHeight degrees
+    double k, j;
+    phaseCorrelate(registration->previousPolar, registration->currentPolar, registration->polarCross,
+                   registration->polarWidth, registration->polarHeight, registration->polarInverse, &k, &j);
+    double angle = 180 * j / registration->polarHeight, scale = exp(-k * registration->logBase);
+
+    result->peak = -INFINITY;
+    for (int turn = 0; turn < 2; turn++) {
+        double candidate = angle + 180 * turn, dx, dy;
+        registrationUndo(registration, candidate, scale, registration->undone);
+        registrationTransform(registration, registration->undone, registration->turned);
+        double peak = phaseCorrelate(registration->previous, registration->turned, registration->cross, width, height,
+                                     registration->inverse, &dx, &dy);
+        if (peak > result->peak) {
+            result->peak = peak;
+            result->angle = candidate > 180 ? candidate - 360 : candidate;
+            result->scale = scale;
+            // The shift was measured after undoing the turn and scale, turn it forward again
+            double radian = result->angle * acos(-1) / 180;
+            result->dx = scale * (cos(radian) * dx - sin(radian) * dy);
+            result->dy = scale * (sin(radian) * dx + cos(radian) * dy);
+        }
+    }
+    return 1;
+}
+
+// Register b against a, both height rows of width doubles
+int registerImages(struct Registration *registration, const double *a, const double *b,
+                   struct RegistrationResult *result) {
+    size_t size = (size_t) registration->width * registration->height * sizeof(double);
+    registration->frames = 0;
+    memcpy(registration->frame, a, size);
+    registerFrame(registration, result);
+    memcpy(registration->frame, b, size);
+    return registerFrame(registration, result);
+}
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Digital Image Processing
+ * Cached remap tables for repeated geometric transforms of 8-bit images
+ *
+ * Note:
+ * A transform maps every destination pixel to a point of the source image
+ * source = matrix * (destination - origin) + origin
+ * The table stores, for every destination pixel, the index of the source pixel and the
+ * fractional weights in 1/256 units, so applying it again is a single streaming pass.
+ * Tables are cached by (transform, sizes), the cache is not thread-safe. applyRemap() fills the
+ * tiles of parallelTiles() on setParallelThreads() threads (parallel.h), link with -pthread.
+ */
+#ifndef DIP_REMAP_H
+#define DIP_REMAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "parallel.h"
+#include "trace.h"
+
+#define REMAP_OUTSIDE UINT32_MAX
+#define REMAP_CACHE_SIZE 8
+
+enum RemapInterpolation {
+    REMAP_NEAREST,  // Truncates toward the origin like the rotation programs of the assignments
+    REMAP_BILINEAR
+};
+
+struct RemapTransform {
+    double matrix[6];  // srcX = m[0] * dx + m[1] * dy + m[2], srcY = m[3] * dx + m[4] * dy + m[5]
+    int originX;
+    int originY;
+    int bottomUp;      // y counts from the bottom row, as m(x, y) does for bitmaps
+    enum RemapInterpolation interpolation;
+};
+
+struct RemapEntry {
+    uint32_t index;    // Top-left source pixel or REMAP_OUTSIDE
+    uint16_t fx;       // Weight of the right neighbour, 0-256
+    uint16_t fy;       // Weight of the next row, 0-256
+};
+
+struct RemapTable {
+    struct RemapTransform transform;
+    unsigned int srcWidth, srcHeight, srcStride;
+    unsigned int dstWidth, dstHeight, dstStride;
+    struct RemapEntry *entries;
+    unsigned long lastUse;
+};
+
+struct RemapTable *remapCache[REMAP_CACHE_SIZE];
+unsigned long remapClock = 0;
+
+// Rotation by degree about (originX, originY), negative degrees turn clockwise
+struct RemapTransform rotationTransform(double degree, int originX, int originY,
+                                        enum RemapInterpolation interpolation) {
+    double radian = degree * acos(-1) / 180; // PI = acos(-1)
+    struct RemapTransform transform = {
+            {cos(radian), -sin(radian), 0.0, sin(radian), cos(radian), 0.0},
+            originX, originY, 1, interpolation
+    };
+    return transform;
+}
+
+int sameRemapTransform(const struct RemapTransform *a, const struct RemapTransform *b) {
+    for (int i = 0; i < 6; i++) {
+        if (a->matrix[i] != b->matrix[i]) return 0;
+    }
+    return a->originX == b->originX && a->originY == b->originY &&
+           a->bottomUp == b->bottomUp && a->interpolation == b->interpolation;
+}
+
+struct RemapTable *buildRemapTable(const struct RemapTransform *transform,
+                                   unsigned int srcWidth, unsigned int srcHeight, unsigned int srcStride,
+                                   unsigned int dstWidth, unsigned int dstHeight, unsigned int dstStride) {
+    struct RemapTable *table = malloc(sizeof(struct RemapTable));
+    table->entries = malloc((size_t) dstWidth * dstHeight * sizeof(struct RemapEntry));
+    if (table->entries == NULL) {
+        fprintf(stderr, "Cannot allocate the remap table!\n");
+        exit(1);
+    }
+    table->transform = *transform;
+    table->srcWidth = srcWidth;
+    table->srcHeight = srcHeight;
+    table->srcStride = srcStride;
+    table->dstWidth = dstWidth;
+    table->dstHeight = dstHeight;
+    table->dstStride = dstStride;
+    table->lastUse = 0;
+
+    // Signed copies so the bounds tests below neither mix signedness nor wrap on an empty source
+    const int width = (int) srcWidth, height = (int) srcHeight;
+    const double *mat = transform->matrix;
+    struct RemapEntry *entry = table->entries;
+    for (unsigned int row = 0; row < dstHeight; row++) {
+        int dy = (int) (transform->bottomUp ? dstHeight - row - 1 : row) - transform->originY;
+        for (unsigned int x = 0; x < dstWidth; x++, entry++) {
+            int dx = (int) x - transform->originX;
+            double rx = mat[0] * dx + mat[1] * dy + mat[2];
+            double ry = mat[3] * dx + mat[4] * dy + mat[5];
+            entry->index = REMAP_OUTSIDE;
+            entry->fx = 0;
+            entry->fy = 0;
+
+            if (transform->interpolation == REMAP_NEAREST) {
+                int srcX = (int) rx + transform->originX;
+                int srcY = (int) ry + transform->originY;
+                if (srcX >= 0 && srcX < width && srcY >= 0 && srcY < height) {
+                    unsigned int srcRow = transform->bottomUp ? height - srcY - 1 : srcY;
+                    entry->index = srcRow * srcStride + srcX;
+                }
+                continue;
+            }
+
+            double srcX = rx + transform->originX;
+            double srcY = ry + transform->originY;
+            if (srcX < 0 || srcX > width - 1 || srcY < 0 || srcY > height - 1) {
+                continue;
+            }
+            double srcRow = transform->bottomUp ? height - 1 - srcY : srcY;
+            int x0 = (int) srcX, y0 = (int) srcRow;
+            int fx = (int) ((srcX - x0) * 256 + 0.5), fy = (int) ((srcRow - y0) * 256 + 0.5);
+            // Keep both neighbours inside the image on the last column and row
+            if (x0 == width - 1 && x0 > 0) {
+                x0--;
+                fx = 256;
+            }
+            if (y0 == height - 1 && y0 > 0) {
+                y0--;
+                fy = 256;
+            }
+            entry->index = y0 * srcStride + x0;
+            entry->fx = (uint16_t) fx;
+            entry->fy = (uint16_t) fy;
+        }
+    }
+    return table;
+}
+
+void freeRemapTable(struct RemapTable *table) {
+    if (table == NULL) return;
+    free(table->entries);
+    free(table);
+}
+
+// Returns the cached table for this transform and size, building it on a miss
+const struct RemapTable *getRemapTable(const struct RemapTransform *transform,
+                                       unsigned int srcWidth, unsigned int srcHeight, unsigned int srcStride,
+                                       unsigned int dstWidth, unsigned int dstHeight, unsigned int dstStride) {
+    int victim = 0;
+    for (int i = 0; i < REMAP_CACHE_SIZE; i++) {
+        struct RemapTable *table = remapCache[i];
+        if (table == NULL) {
+            victim = i;
+            break;
+        }
+        if (sameRemapTransform(&table->transform, transform) &&
+            table->srcWidth == srcWidth && table->srcHeight == srcHeight && table->srcStride == srcStride &&
+            table->dstWidth == dstWidth && table->dstHeight == dstHeight && table->dstStride == dstStride) {
+            table->lastUse = ++remapClock;
+            return table;
+        }
+        if (remapCache[victim] != NULL && table->lastUse < remapCache[victim]->lastUse) {
+            victim = i;
+        }
+    }
+
+    freeRemapTable(remapCache[victim]);
+    remapCache[victim] = buildRemapTable(transform, srcWidth, srcHeight, srcStride,
+                                         dstWidth, dstHeight, dstStride);
+    remapCache[victim]->lastUse = ++remapClock;
+    return remapCache[victim];
+}
+
+void freeRemapCache(void) {
+    for (int i = 0; i < REMAP_CACHE_SIZE; i++) {
+        freeRemapTable(remapCache[i]);
+        remapCache[i] = NULL;
+    }
+}
+
+struct RemapContext {
+    const struct RemapTable *table;
+    const uint8_t *src;
+    uint8_t *dst;
+    uint8_t background;
+};
+
+void remapTileTask(void *context, int x0, int y0, int x1, int y1, int worker) {
+    const struct RemapContext *remap = context;
+    const struct RemapTable *table = remap->table;
+    const uint8_t *src = remap->src;
+    unsigned int stride = table->srcStride;
+    uint8_t background = remap->background;
+
+    for (int row = y0; row < y1; row++) {
+        const struct RemapEntry *entry = table->entries + (size_t) row * table->dstWidth + x0;
+        uint8_t *out = remap->dst + (size_t) row * table->dstStride;
+        if (table->transform.interpolation == REMAP_NEAREST) {
+            for (int x = x0; x < x1; x++, entry++) {
+                out[x] = entry->index == REMAP_OUTSIDE ? background : src[entry->index];
+            }
+            continue;
+        }
+        for (int x = x0; x < x1; x++, entry++) {
+            if (entry->index == REMAP_OUTSIDE) {
+                out[x] = background;
+                continue;
+            }
+            const uint8_t *p = src + entry->index;
+            unsigned int fx = entry->fx, fy = entry->fy;
+            // The neighbour is only read when its weight is not zero, so 1-pixel images stay in range
+            unsigned int top = p[0] * (256 - fx) + (fx ? p[1] * fx : 0);
+            unsigned int bottom = fy ? p[stride] * (256 - fx) + (fx ? p[stride + 1] * fx : 0) : 0;
+            out[x] = (uint8_t) ((top * (256 - fy) + bottom * fy + 32768) >> 16);
+        }
+    }
+    (void) worker;
+}
+
+// Pixels mapped outside of the source are set to background
+void applyRemap(const struct RemapTable *table, const uint8_t *src, uint8_t *dst, uint8_t background) {
+    struct RemapContext context = {table, src, dst, background};
+    struct TraceSpan span = traceBegin("applyRemap");
+    parallelTiles((int) table->dstWidth, (int) table->dstHeight, parallelThreads, remapTileTask, &context);
+    traceEnd(&span);
+}
+
+// Same-size remap through the cache
+void remap(const struct RemapTransform *transform, const uint8_t *src, uint8_t *dst,
+           unsigned int width, unsigned int height, unsigned int stride, uint8_t background) {
+    applyRemap(getRemapTable(transform, width, height, stride, width, height, stride), src, dst, background);
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Digital Image Processing
+ * Real-to-complex 2D FFT which keeps only the non-redundant half of the spectrum
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type.
+ * The spectrum of a real image is Hermitian, X(u, v) = conj(X(-u, -v)), so only the
+ * columns 0 to width / 2 are stored: height * (width / 2 + 1) COMPLEX values.
+ * The transform is done in place. Before the forward transform the real image is stored in
+ * the same buffer, row y starting at realRow(c, y, width), and the inverse leaves it there.
+ * The scaling follows FFT2D: the forward transform is divided by width * height.
+ * RFFT2D() goes through the plan cache of fftplan.h, use a plan directly to control its lifetime.
+ *
+ * The spectrum is not centred: the zero frequency stays at (0, 0). Instead of multiplying the
+ * image by (-1)^(x+y) before the forward transform and after the inverse, which are two extra
+ * passes over the image, a centred view is read through centredSpectrumAt(). Its quadrant swap
+ * is the fftshift the multiplication did for even sizes, and is exact for odd sizes as well.
+ */
+#ifndef DIP_RFFT_H
+#define DIP_RFFT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fftplan.h"
+
+int halfSpectrumWidth(int width) {
+    return width / 2 + 1;
+}
+
+// Real input / output row of the in-place layout, 2 * halfSpectrumWidth(width) doubles per row
+double *realRow(COMPLEX *c, int y, int width) {
+    return (double *) (c + (size_t) y * halfSpectrumWidth(width));
+}
+
+/*
+ * dir = 1: real image in the in-place layout -> half spectrum
+ * dir = -1: half spectrum -> real image in the in-place layout
+ * Returns 0 when the width is odd or the size is not positive
+ */
+int RFFT2D(COMPLEX *c, int height, int width, int dir) {
+    struct FFTPlan *plan = getFFTPlan(FFT_PLAN_REAL, width, height, dir);
+    return plan != NULL && executeFFTPlan(plan, c);
+}
+
+// Value of the full spectrum at column u, row v, taken from its mirror for u > width / 2
+COMPLEX halfSpectrumAt(const COMPLEX *c, int height, int width, int u, int v) {
+    int hw = halfSpectrumWidth(width);
+    if (u < hw) {
+        return c[(size_t) v * hw + u];
+    }
+    COMPLEX value = c[(size_t) ((height - v) % height) * hw + (width - u)];
+    value.imag = -value.imag;
+    return value;
+}
+
+// Frequency of index i of a length-n transform, from -(n / 2) to (n - 1) / 2
+int signedFrequency(int i, int n) {
+    return i > (n - 1) / 2 ? i - n : i;
+}
+
+// Index of position i of the centred spectrum, which has the zero frequency at n / 2
+int shiftedIndex(int i, int n) {
+    return (i + n - n / 2) % n;
+}
+
+// Value at column u, row v of the centred spectrum
+COMPLEX centredSpectrumAt(const COMPLEX *c, int height, int width, int u, int v) {
+    return halfSpectrumAt(c, height, width, shiftedIndex(u, width), shiftedIndex(v, height));
+}
+
+/*
+ * Value shown at pixel (x, y) of a spectrum image, y counted from the top like m() with the
+ * image stored bottom-up in the rows of c
+ * The programs used to multiply by (-1)^(x+y) in these coordinates, which for an even height
+ * negates the centred spectrum. The sign is kept so the phase images do not change.
+ */
+COMPLEX displayedSpectrumAt(const COMPLEX *c, int height, int width, int x, int y) {
+    COMPLEX value = centredSpectrumAt(c, height, width, x, height - y - 1);
+    if (height % 2 == 0) {
+        value.real = -value.real;
+        value.imag = -value.imag;
+    }
+    return value;
+}
+
+/*
+ * Multiply the half spectrum by a transfer function given in full-spectrum array coordinates
+ * (column u, row v). The function is averaged with its value at (-u, -v), which makes the
+ * result equal to the real part of filtering the full spectrum, as the programs did before.
+ */
+void filterHalfSpectrum(COMPLEX *c, int height, int width,
+                        double (*transfer)(int u, int v, void *context), void *context) {
+    int hw = halfSpectrumWidth(width);
+    for (int v = 0; v < height; v++) {
+        COMPLEX *row = c + (size_t) v * hw;
+        for (int u = 0; u < hw; u++) {
+            double h = (transfer(u, v, context) + transfer((width - u) % width, (height - v) % height, context)) / 2;
+            row[u].real *= h;
+            row[u].imag *= h;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * Digital Image Processing
+ * Exact transpose, flip and 90/180/270 degree rotation for 8-bit images
+ *
+ * Note:
+ * Every function takes the row stride in bytes, so padded bitmap rows can be passed directly
+ * RowSize = floor((BitsPerPixel * ImageWidth + 31) / 32) * 4
+ * The directions are given for a top-down row order. Bitmaps are stored bottom-up, so rotating
+ * the pixel array with rotate270() turns the displayed picture 90 degrees clockwise.
+ *
+ * Pixels are moved in 16x16 blocks. With SSE2 each block is transposed inside registers,
+ * so the source is read and the destination is written one 16-byte row at a time.
+ */
+#ifndef DIP_ROTATE_H
+#define DIP_ROTATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "trace.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ROTATE_BLOCK 16
+
+// Transpose one 16x16 block, rows may be walked backwards with a negative stride
+void transposeBlock16(const uint8_t *src, ptrdiff_t srcStride, uint8_t *dst, ptrdiff_t dstStride) {
+#ifdef __SSE2__
+    __m128i a[16], b[16];
+    for (int i = 0; i < 16; i++) {
+        a[i] = _mm_loadu_si128((const __m128i *) (src + i * srcStride));
+    }
+    // Interleave bytes of row pairs
+    for (int i = 0; i < 8; i++) {
+        b[i] = _mm_unpacklo_epi8(a[2 * i], a[2 * i + 1]);
+        b[i + 8] = _mm_unpackhi_epi8(a[2 * i], a[2 * i + 1]);
+    }
+    // Interleave 16-bit pairs into groups of 4 rows
+    for (int h = 0; h < 16; h += 8) {
+        for (int i = 0; i < 4; i++) {
+            a[h + i] = _mm_unpacklo_epi16(b[h + 2 * i], b[h + 2 * i + 1]);
+            a[h + 4 + i] = _mm_unpackhi_epi16(b[h + 2 * i], b[h + 2 * i + 1]);
+        }
+    }
+    // Interleave 32-bit groups into groups of 8 rows
+    for (int h = 0; h < 16; h += 4) {
+        for (int i = 0; i < 2; i++) {
+            b[h + i] = _mm_unpacklo_epi32(a[h + 2 * i], a[h + 2 * i + 1]);
+            b[h + 2 + i] = _mm_unpackhi_epi32(a[h + 2 * i], a[h + 2 * i + 1]);
+        }
+    }
+    // Join the two halves, each register now holds one source column
+    for (int c = 0; c < 16; c += 2) {
+        _mm_storeu_si128((__m128i *) (dst + c * dstStride), _mm_unpacklo_epi64(b[c], b[c + 1]));
+        _mm_storeu_si128((__m128i *) (dst + (c + 1) * dstStride), _mm_unpackhi_epi64(b[c], b[c + 1]));
+    }
+#else
+    for (int y = 0; y < 16; y++) {
+        for (int x = 0; x < 16; x++) {
+            dst[x * dstStride + y] = src[y * srcStride + x];
+        }
+    }
+#endif
+}
+
+/*
+ * Shared driver of transpose, rotate90 and rotate270
+ * dst(x, y) = src(y, x) with the source rows and/or the destination rows walked in reverse
+ */
+void transposeWalk(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+                   unsigned int width, unsigned int height, int reverseSrcRows, int reverseDstRows) {
+    ptrdiff_t sStep = reverseSrcRows ? -(ptrdiff_t) srcStride : (ptrdiff_t) srcStride;
+    ptrdiff_t dStep = reverseDstRows ? -(ptrdiff_t) dstStride : (ptrdiff_t) dstStride;
+    const uint8_t *sBase = reverseSrcRows ? src + (size_t) (height - 1) * srcStride : src;
+    uint8_t *dBase = reverseDstRows ? dst + (size_t) (width - 1) * dstStride : dst;
+    struct TraceSpan span = traceBegin("transpose");
+
+    unsigned int fullWidth = width - width % ROTATE_BLOCK;
+    unsigned int fullHeight = height - height % ROTATE_BLOCK;
+    for (unsigned int by = 0; by < fullHeight; by += ROTATE_BLOCK) {
+        for (unsigned int bx = 0; bx < fullWidth; bx += ROTATE_BLOCK) {
+            transposeBlock16(sBase + by * sStep + bx, sStep, dBase + bx * dStep + by, dStep);
+        }
+    }
+
+    // Right and bottom edges which do not fill a whole block
+    for (unsigned int y = 0; y < height; y++) {
+        unsigned int x = y < fullHeight ? fullWidth : 0;
+        for (; x < width; x++) {
+            dBase[x * dStep + y] = sBase[y * sStep + x];
+        }
+    }
+    traceEnd(&span);
+}
+
+// dst is height x width, dst(x, y) = src(y, x)
+void transpose(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+               unsigned int width, unsigned int height) {
+    transposeWalk(src, srcStride, dst, dstStride, width, height, 0, 0);
+}
+
+// Clockwise, dst is height x width
+void rotate90(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+              unsigned int width, unsigned int height) {
+    transposeWalk(src, srcStride, dst, dstStride, width, height, 1, 0);
+}
+
+// Counterclockwise, dst is height x width
+void rotate270(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+               unsigned int width, unsigned int height) {
+    transposeWalk(src, srcStride, dst, dstStride, width, height, 0, 1);
+}
+
+// Mirror every row, src and dst may be the same buffer
+void flipHorizontal(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+                    unsigned int width, unsigned int height) {
+    if (width == 0) return;
+    struct TraceSpan span = traceBegin("flipHorizontal");
+    for (unsigned int y = 0; y < height; y++) {
+        const uint8_t *s = src + (size_t) y * srcStride;
+        uint8_t *d = dst + (size_t) y * dstStride;
+        for (unsigned int l = 0, r = width - 1; l < r; l++, r--) {
+            uint8_t temp = s[l];
+            d[l] = s[r];
+            d[r] = temp;
+        }
+        if (width % 2 == 1) {
+            d[width / 2] = s[width / 2];
+        }
+    }
+    traceEnd(&span);
+}
+
+// Reverse the row order, src and dst may be the same buffer
+void flipVertical(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+                  unsigned int width, unsigned int height) {
+    uint8_t row[ROTATE_BLOCK * 64];
+    struct TraceSpan span = traceBegin("flipVertical");
+    for (unsigned int t = 0, b = height - 1; t <= b && b < height; t++, b--) {
+        const uint8_t *sTop = src + (size_t) t * srcStride, *sBottom = src + (size_t) b * srcStride;
+        uint8_t *dTop = dst + (size_t) t * dstStride, *dBottom = dst + (size_t) b * dstStride;
+        for (unsigned int x = 0; x < width; x += sizeof(row)) {
+            size_t n = width - x < sizeof(row) ? width - x : sizeof(row);
+            memcpy(row, sTop + x, n);
+            memmove(dTop + x, sBottom + x, n);
+            memcpy(dBottom + x, row, n);
+        }
+    }
+    traceEnd(&span);
+}
+
+// src and dst may be the same buffer
+void rotate180(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+               unsigned int width, unsigned int height) {
+    flipVertical(src, srcStride, dst, dstStride, width, height);
+    flipHorizontal(dst, dstStride, dst, dstStride, width, height);
+}
+
+// In-place transpose of a size x size image
+void transposeInPlace(uint8_t *data, unsigned int stride, unsigned int size) {
+    uint8_t block[ROTATE_BLOCK * ROTATE_BLOCK];
+    unsigned int full = size - size % ROTATE_BLOCK;
+    struct TraceSpan span = traceBegin("transposeInPlace");
+
+    for (unsigned int by = 0; by < full; by += ROTATE_BLOCK) {
+        // Diagonal block
+        uint8_t *diagonal = data + (size_t) by * stride + by;
+        transposeBlock16(diagonal, stride, block, ROTATE_BLOCK);
+        for (int r = 0; r < ROTATE_BLOCK; r++) {
+            memcpy(diagonal + r * stride, block + r * ROTATE_BLOCK, ROTATE_BLOCK);
+        }
+        // Swap the mirrored pair of blocks above and below the diagonal
+        for (unsigned int bx = by + ROTATE_BLOCK; bx < full; bx += ROTATE_BLOCK) {
+            uint8_t *upper = data + (size_t) by * stride + bx;
+            uint8_t *lower = data + (size_t) bx * stride + by;
+            transposeBlock16(upper, stride, block, ROTATE_BLOCK);
+            transposeBlock16(lower, stride, upper, stride);
+            for (int r = 0; r < ROTATE_BLOCK; r++) {
+                memcpy(lower + r * stride, block + r * ROTATE_BLOCK, ROTATE_BLOCK);
+            }
+        }
+    }
+
+    // Remaining strip along the right and bottom edges
+    for (unsigned int y = 0; y < size; y++) {
+        for (unsigned int x = (y < full ? full : y + 1); x < size; x++) {
+            uint8_t temp = data[(size_t) y * stride + x];
+            data[(size_t) y * stride + x] = data[(size_t) x * stride + y];
+            data[(size_t) x * stride + y] = temp;
+        }
+    }
+    traceEnd(&span);
+}
+
+// Clockwise, in place for a size x size image
+void rotate90InPlace(uint8_t *data, unsigned int stride, unsigned int size) {
+    transposeInPlace(data, stride, size);
+    flipHorizontal(data, stride, data, stride, size, size);
+}
+
+// Counterclockwise, in place for a size x size image
+void rotate270InPlace(uint8_t *data, unsigned int stride, unsigned int size) {
+    transposeInPlace(data, stride, size);
+    flipVertical(data, stride, data, stride, size, size);
+}
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ * Digital Image Processing
+ * Chains of operations given as text, such as "sobel | box:3 | gamma:0.5"
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type. Link with -pthread.
+ * A spec is a list of steps separated by '|', each a name followed by its arguments after colons:
+ * sharpen, sobel, box[:3]     3 x 3 stencils of Assignment-3 (pipeline.h), the border replicated
+ * gamma:g                     256 * (v / 256)^g, Assignment-3 p3h
+ * negative                    255 - v
+ * quantize:levels             levels gray levels, a power of 2, Assignment-1 p3
+ * bitplane:n                  255 where bit n is set, 0 elsewhere
+ * threshold:t                 255 from t up, 0 below
+ * rotate:degree               clockwise about the centre, nearest pixel, black outside (remap.h)
+ * rot90, rot180, rot270       exact turns clockwise (rotate.h), rot90 and rot270 swap the size
+ * flipx, flipy                mirror left-right or top-bottom
+ * ilpf:d0, glpf:d0, blpf:d0[:order] and ihpf, ghpf, bhpf
+ *                             ideal, Gaussian and Butterworth (order 2) filters of filters.h,
+ *                             the width must be even
+ * Images are 8-bit bitmap pixel arrays, stored bottom-up, and the directions are the ones of
+ * the displayed picture.
+ *
+ * parseSpec() reads the text once. A SpecPlan then runs the steps on images one after another:
+ * - Consecutive stencils and maps form one graph of pipeline.h, so a map runs in the pass of the
+ *   stencil before it and the graph is planned once.
+ * - The other steps run on their own, through the remap table cache of remap.h, the FFT plan
+ *   cache of fftplan.h and a transfer table kept by the plan.
+ * - The first step reads the source and the last one writes the destination, the images in
+ *   between and the spectra come from the ImagePool of the plan.
+ * Everything is built on the first image of a size and kept for the next images of that size,
+ * so a batch of equal images only computes. A new size rebuilds the plan.
+ * The caches behind it are not thread-safe, run one plan at a time.
+ */
+#ifndef DIP_SPEC_H
+#define DIP_SPEC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "pipeline.h"
+#include "remap.h"
+#include "rotate.h"
+#include "rfft.h"
+#include "filters.h"
+#include "trace.h"
+
+#define SPEC_MAX_STEPS 32
+#define SPEC_MAX_ARGS 2
+#define SPEC_NAME_SIZE 16
+#define SPEC_ERROR_SIZE 128
+
+enum SpecKind {
+    SPEC_STENCIL,
+    SPEC_MAP,
+    SPEC_REMAP,
+    SPEC_TURN,
+    SPEC_FILTER
+};
+
+// The functions of rotate.h
+typedef void (*SpecTurn)(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+                         unsigned int width, unsigned int height);
+
+struct SpecStep {
+    enum SpecKind kind;
+    char name[SPEC_NAME_SIZE];
+    PipelineStencil stencil;   // SPEC_STENCIL
+    uint8_t table[256];        // SPEC_MAP
+    double degree;             // SPEC_REMAP
+    SpecTurn turn;             // SPEC_TURN
+    int swapsSize;             // SPEC_TURN by 90 degrees
+    struct FilterSpec filter;  // SPEC_FILTER
+};
+
+struct Spec {
+    struct SpecStep steps[SPEC_MAX_STEPS];
+    int count;
+    char error[SPEC_ERROR_SIZE];  // Why parseSpec() failed
+};
+
+// Steps first to last, a pipeline of stencils and maps or a single other step
+struct SpecSegment {
+    int first;
+    int last;
+    int width;                    // Of the input
+    int height;
+    struct Pipeline *pipeline;
+    int output;                   // Node of the pipeline
+    double *transfer;             // Half table of SPEC_FILTER
+};
+
+struct SpecPlan {
+    struct Spec spec;
+    struct ImagePool *pool;
+    int width;                    // Planned input size, 0 before the first image
+    int height;
+    struct SpecSegment segments[SPEC_MAX_STEPS];
+    int segmentCount;
+    size_t bufferSize;            // Of the images between two segments
+    char error[SPEC_ERROR_SIZE];  // Why runSpec() failed
+};
+
+// Rows of the images between the segments start on cache lines
+int specStride(int width) {
+    return (width + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT * POOL_ALIGNMENT;
+}
+
+// Fill step from its name and arguments, returns 0 and sets error when they are not valid
+int specStep(struct SpecStep *step, const char *name, const double *args, int argCount, char *error) {
+    static const char *filters[] = {"ilpf", "blpf", "glpf", "ihpf", "bhpf", "ghpf"};
+    static const enum FilterResponse responses[] = {FILTER_IDEAL, FILTER_BUTTERWORTH, FILTER_GAUSSIAN};
+    int maxArgs = 0;
+    memset(step, 0, sizeof(struct SpecStep));
+    snprintf(step->name, SPEC_NAME_SIZE, "%s", name);
+
+    if (strcmp(name, "sharpen") == 0 || strcmp(name, "sobel") == 0 || strcmp(name, "box") == 0) {
+        step->kind = SPEC_STENCIL;
+        step->stencil = name[0] == 'b' ? boxRow : (name[1] == 'h' ? sharpenRow : sobelRow);
+        maxArgs = name[0] == 'b';
+        if (maxArgs && argCount == 1 && args[0] != 3) {
+            snprintf(error, SPEC_ERROR_SIZE, "box is 3 x 3 only");
+            return 0;
+        }
+    } else if (strcmp(name, "gamma") == 0 && argCount == 1 && args[0] > 0) {
+        step->kind = SPEC_MAP;
+        powerLawTable(step->table, args[0]);
+        maxArgs = 1;
+    } else if (strcmp(name, "negative") == 0) {
+        step->kind = SPEC_MAP;
+        for (int v = 0; v < 256; v++) {
+            step->table[v] = (uint8_t) (255 - v);
+        }
+    } else if (strcmp(name, "quantize") == 0 && argCount == 1) {
+        int levels = (int) args[0];
+        if (levels != args[0] || levels < 2 || levels > 256 || (levels & (levels - 1)) != 0) {
+            snprintf(error, SPEC_ERROR_SIZE, "quantize needs a power of 2 from 2 to 256 levels");
+            return 0;
+        }
+        step->kind = SPEC_MAP;
+        for (int v = 0; v < 256; v++) {
+            step->table[v] = (uint8_t) ((v / (256 / levels)) * (255 / (levels - 1)));
+        }
+        maxArgs = 1;
+    } else if (strcmp(name, "bitplane") == 0 && argCount == 1 && args[0] >= 0 && args[0] <= 7) {
+        step->kind = SPEC_MAP;
+        for (int v = 0; v < 256; v++) {
+            step->table[v] = (v >> (int) args[0] & 1) ? 255 : 0;
+        }
+        maxArgs = 1;
+    } else if (strcmp(name, "threshold") == 0 && argCount == 1 && args[0] >= 0 && args[0] <= 256) {
+        step->kind = SPEC_MAP;
+        for (int v = 0; v < 256; v++) {
+            step->table[v] = v >= args[0] ? 255 : 0;
+        }
+        maxArgs = 1;
+    } else if (strcmp(name, "rotate") == 0 && argCount == 1) {
+        step->kind = SPEC_REMAP;
+        step->degree = -args[0];
+        maxArgs = 1;
+    } else if (strcmp(name, "rot90") == 0 || strcmp(name, "rot270") == 0) {
+        // The rows are bottom-up, which turns the other way round on the screen
+        step->kind = SPEC_TURN;
+        step->turn = name[3] == '9' ? rotate270 : rotate90;
+        step->swapsSize = 1;
+    } else if (strcmp(name, "rot180") == 0 || strcmp(name, "flipx") == 0 || strcmp(name, "flipy") == 0) {
+        step->kind = SPEC_TURN;
+        step->turn = name[0] == 'r' ? rotate180 : (name[4] == 'x' ? flipHorizontal : flipVertical);
+    } else {
+        int filter = 0;
+        while (filter < 6 && strcmp(name, filters[filter]) != 0) filter++;
+        if (filter == 6 || argCount < 1 || args[0] <= 0 || (argCount == 2 && (filter % 3 != 1 || args[1] <= 0))) {
+            snprintf(error, SPEC_ERROR_SIZE, "Unknown step or invalid arguments: %s", name);
+            return 0;
+        }
+        step->kind = SPEC_FILTER;
+        step->filter.band = filter < 3 ? FILTER_LOWPASS : FILTER_HIGHPASS;
+        step->filter.response = responses[filter % 3];
+        step->filter.d0 = args[0];
+        step->filter.order = argCount == 2 ? args[1] : 2;
+        maxArgs = 2;
+    }
+    if (argCount > maxArgs) {
+        snprintf(error, SPEC_ERROR_SIZE, "Too many arguments: %s", name);
+        return 0;
+    }
+    return 1;
+}
+
+// Returns 0 and sets spec->error when the text is not a valid spec
+int parseSpec(struct Spec *spec, const char *text) {
+    memset(spec, 0, sizeof(struct Spec));
+    const char *p = text;
+    for (;;) {
+        char name[SPEC_NAME_SIZE];
+        double args[SPEC_MAX_ARGS];
+        int length = 0, argCount = 0;
+        while (isspace((unsigned char) *p)) p++;
+        while (isalnum((unsigned char) *p) && length < SPEC_NAME_SIZE - 1) name[length++] = *p++;
+        name[length] = '\0';
+        while (*p == ':' && argCount < SPEC_MAX_ARGS) {
+            char *end;
+            args[argCount++] = strtod(p + 1, &end);
+            if (end == p + 1) break;
+            p = end;
+        }
+        while (isspace((unsigned char) *p)) p++;
+        if (length == 0 || (*p != '|' && *p != '\0')) {
+            snprintf(spec->error, SPEC_ERROR_SIZE, "Cannot read step %d at \"%.32s\"", spec->count + 1, p);
+            return 0;
+        }
+        if (spec->count == SPEC_MAX_STEPS) {
+            snprintf(spec->error, SPEC_ERROR_SIZE, "More than %d steps", SPEC_MAX_STEPS);
+            return 0;
+        }
+        if (!specStep(&spec->steps[spec->count++], name, args, argCount, spec->error)) {
+            return 0;
+        }
+        if (*p == '\0') break;
+        p++;
+    }
+    return 1;
+}
+
+// Size of the result of the steps first to last on a width x height image
+void specStepsSize(const struct Spec *spec, int first, int last, int width, int height,
+                   int *outWidth, int *outHeight) {
+    for (int i = first; i <= last; i++) {
+        if (spec->steps[i].swapsSize) {
+            int temp = width;
+            width = height;
+            height = temp;
+        }
+    }
+    *outWidth = width;
+    *outHeight = height;
+}
+
+void specOutputSize(const struct Spec *spec, int width, int height, int *outWidth, int *outHeight) {
+    specStepsSize(spec, 0, spec->count - 1, width, height, outWidth, outHeight);
+}
+
+struct SpecPlan *createSpecPlan(const struct Spec *spec, struct ImagePool *pool) {
+    struct SpecPlan *plan = calloc(1, sizeof(struct SpecPlan));
+    if (plan == NULL) {
+        fprintf(stderr, "Cannot allocate the spec plan!\n");
+        exit(1);
+    }
+    plan->spec = *spec;
+    plan->pool = pool;
+    return plan;
+}
+
+void freeSpecSegments(struct SpecPlan *plan) {
+    for (int s = 0; s < plan->segmentCount; s++) {
+        destroyPipeline(plan->segments[s].pipeline);
+        free(plan->segments[s].transfer);
+    }
+    memset(plan->segments, 0, sizeof(plan->segments));
+    plan->segmentCount = 0;
+    plan->width = 0;
+    plan->height = 0;
+}
+
+void destroySpecPlan(struct SpecPlan *plan) {
+    if (plan == NULL) return;
+    freeSpecSegments(plan);
+    free(plan);
+}
+
+// Cut the steps into segments for width x height images, returns 0 and sets plan->error on failure
+int planSpec(struct SpecPlan *plan, int width, int height) {
+    const struct Spec *spec = &plan->spec;
+    freeSpecSegments(plan);
+    plan->bufferSize = 0;
+    for (int i = 0; i < spec->count; i++) {
+        const struct SpecStep *step = &spec->steps[i];
+        struct SpecSegment *segment = &plan->segments[plan->segmentCount++];
+        segment->first = i;
+        segment->width = width;
+        segment->height = height;
+        if (step->kind == SPEC_STENCIL || step->kind == SPEC_MAP) {
+            segment->pipeline = createPipeline(width, height, plan->pool);
+            segment->output = pipelineInput(segment->pipeline);
+            for (; i < spec->count && (spec->steps[i].kind == SPEC_STENCIL || spec->steps[i].kind == SPEC_MAP); i++) {
+                segment->output = spec->steps[i].kind == SPEC_STENCIL ?
+                                  pipelineStencil(segment->pipeline, segment->output, spec->steps[i].stencil) :
+                                  pipelineMap(segment->pipeline, segment->output, spec->steps[i].table);
+            }
+            i--;
+        } else if (step->kind == SPEC_FILTER) {
+            // The in-place real transform of rfft.h needs an even width
+            if (width % 2 != 0) {
+                snprintf(plan->error, SPEC_ERROR_SIZE, "%s needs an even width, not %d", step->name, width);
+                freeSpecSegments(plan);
+                return 0;
+            }
+            segment->transfer = makeTransfer(&step->filter, width, height, 1);
+        }
+        segment->last = i;
+        specStepsSize(spec, segment->first, segment->last, width, height, &width, &height);
+        // The result of the last segment goes to the destination
+        size_t size = (size_t) specStride(width) * height;
+        if (i + 1 < spec->count && size > plan->bufferSize) {
+            plan->bufferSize = size;
+        }
+    }
+    plan->width = plan->segments[0].width;
+    plan->height = plan->segments[0].height;
+    return 1;
+}
+
+// Filter src into dst through the half spectrum, the result truncated like Assignment-5
+void runSpecFilter(struct SpecPlan *plan, const struct SpecSegment *segment, const uint8_t *src, int srcStride,
+                   uint8_t *dst, int dstStride) {
+    int width = segment->width, height = segment->height;
+    COMPLEX *c = poolAlloc(plan->pool, (size_t) height * halfSpectrumWidth(width) * sizeof(COMPLEX));
+    for (int y = 0; y < height; y++) {
+        double *row = realRow(c, y, width);
+        for (int x = 0; x < width; x++) {
+            row[x] = src[(size_t) y * srcStride + x];
+        }
+    }
+    RFFT2D(c, height, width, 1);
+    applyTransfer(c, segment->transfer, width, height, 1);
+    RFFT2D(c, height, width, -1);
+    for (int y = 0; y < height; y++) {
+        const double *row = realRow(c, y, width);
+        for (int x = 0; x < width; x++) {
+            int temp = (int) row[x];
+            dst[(size_t) y * dstStride + x] = (uint8_t) (temp < 0 ? 0 : (temp > 255 ? 255 : temp));
+        }
+    }
+    poolFree(plan->pool, c);
+}
+
+/*
+ * Run the spec on the width x height image src into dst, rows srcStride and dstStride bytes apart
+ * dst has the size of specOutputSize(). Returns 0 and sets plan->error when the size does not suit
+ * the spec, dst is then left as it is
+ */
+int runSpec(struct SpecPlan *plan, const uint8_t *src, int width, int height, int srcStride,
+            uint8_t *dst, int dstStride) {
+    if (width < 1 || height < 1) {
+        snprintf(plan->error, SPEC_ERROR_SIZE, "Invalid image size %d x %d", width, height);
+        return 0;
+    }
+    if ((width != plan->width || height != plan->height) && !planSpec(plan, width, height)) {
+        return 0;
+    }
+    struct TraceSpan span = traceBegin("runSpec");
+    uint8_t *buffers[2] = {NULL, NULL};
+    for (int b = 0; b < 2 && b + 1 < plan->segmentCount; b++) {
+        buffers[b] = poolAlloc(plan->pool, plan->bufferSize);
+    }
+    const uint8_t *in = src;
+    int inStride = srcStride;
+    for (int s = 0; s < plan->segmentCount; s++) {
+        const struct SpecSegment *segment = &plan->segments[s];
+        const struct SpecStep *step = &plan->spec.steps[segment->first];
+        unsigned int w = (unsigned int) segment->width, h = (unsigned int) segment->height;
+        int outWidth, outHeight;
+        specStepsSize(&plan->spec, segment->first, segment->last, segment->width, segment->height,
+                      &outWidth, &outHeight);
+        uint8_t *out = s + 1 == plan->segmentCount ? dst : buffers[s % 2];
+        int outStride = s + 1 == plan->segmentCount ? dstStride : specStride(outWidth);
+        if (segment->pipeline != NULL) {
+            runPipelineStrides(segment->pipeline, &in, inStride, segment->output, out, outStride);
+        } else if (step->kind == SPEC_REMAP) {
+            struct RemapTransform transform = rotationTransform(step->degree, (int) w / 2, (int) h / 2,
+                                                                REMAP_NEAREST);
+            applyRemap(getRemapTable(&transform, w, h, inStride, w, h, outStride), in, out, 0);
+        } else if (step->kind == SPEC_TURN) {
+            step->turn(in, inStride, out, outStride, w, h);
+        } else {
+            runSpecFilter(plan, segment, in, inStride, out, outStride);
+        }
+        in = out;
+        inStride = outStride;
+    }
+    for (int b = 0; b < 2; b++) {
+        if (buffers[b] != NULL) poolFree(plan->pool, buffers[b]);
+    }
+    traceEnd(&span);
+    return 1;
+}
+
+// Segments of the plan and the stages of their pipelines, for checking what was fused
+void printSpecPlan(struct SpecPlan *plan, FILE *out) {
+    for (int s = 0; s < plan->segmentCount; s++) {
+        const struct SpecSegment *segment = &plan->segments[s];
+        fprintf(out, "Segment %d, %d x %d:", s, segment->width, segment->height);
+        for (int i = segment->first; i <= segment->last; i++) {
+            fprintf(out, " %s", plan->spec.steps[i].name);
+        }
+        fprintf(out, "\n");
+        if (segment->pipeline != NULL) {
+            if (segment->pipeline->plannedOutput != segment->output) {
+                planPipeline(segment->pipeline, segment->output);
+            }
+            printPipelinePlan(segment->pipeline, out);
+        }
+    }
+}
+
+#endif
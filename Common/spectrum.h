@@ -0,0 +1,128 @@
+/*
+ * Digital Image Processing
+ * Spectrum and phase images of a half spectrum in one pass
+ *
+ * Note:
+ * Include fft.h before this file for the COMPLEX type. Link with -pthread.
+ * The images show the spectrum centred like displayedSpectrumAt() of rfft.h:
+ * spectrum = 30 * log(1 + 10000 * |F| / max |F|), phase = 127 * arg(F) / PI + 127
+ * They are 8-bit bitmap pixel arrays, rows of stride bytes stored bottom-up like m().
+ *
+ * Both images are written from the stored half: a stored coefficient gives its own pixel and
+ * the pixel of its mirror, which has the same magnitude and the opposite phase, so every stored
+ * coefficient costs one squared magnitude, one atan2 and no square root or logarithm. The log
+ * scale is a table of the 256 squared magnitudes where the level goes up, searched in 8 steps.
+ * The max is reduced in two phases: every thread finds the max of its rows, then the partial
+ * maxima are combined before the images are written. The threads are the ones of setFFTThreads().
+ */
+#ifndef DIP_SPECTRUM_H
+#define DIP_SPECTRUM_H
+
+#include <stdint.h>
+#include <math.h>
+#include "rfft.h"
+#include "parallel.h"
+#include "trace.h"
+
+struct SpectrumContext {
+    const COMPLEX *c;
+    int width;
+    int height;
+    uint8_t *spectrumImage;
+    uint8_t *phaseImage;
+    int stride;
+    double partialMax[PARALLEL_MAX_THREADS];  // Squared magnitudes
+    double levels[256];                       // Squared magnitude where level k starts
+};
+
+void spectrumMaxTask(void *context, int begin, int end, int worker) {
+    struct SpectrumContext *spectrum = context;
+    int hw = halfSpectrumWidth(spectrum->width);
+    double max = 0.0;
+    for (size_t i = (size_t) begin * hw; i < (size_t) end * hw; i++) {
+        double m2 = spectrum->c[i].real * spectrum->c[i].real + spectrum->c[i].imag * spectrum->c[i].imag;
+        max = m2 > max ? m2 : max;
+    }
+    // A worker may get several ranges
+    spectrum->partialMax[worker] = max > spectrum->partialMax[worker] ? max : spectrum->partialMax[worker];
+}
+
+// Level of a squared magnitude, the last k with levels[k] <= m2
+int spectrumLevel(const double *levels, double m2) {
+    int k = 0;
+    for (int step = 128; step > 0; step >>= 1) {
+        k += levels[k + step] <= m2 ? step : 0;
+    }
+    return k;
+}
+
+uint8_t phaseLevel(double phase) {
+    int temp = (int) (127 * phase / acos(-1) + 127);
+    if (temp > 255) temp = 255;
+    if (temp < 0) temp = 0;
+    return (uint8_t) temp;
+}
+
+// Stored rows [begin, end), each row also fills the mirrored pixels
+void spectrumImageTask(void *context, int begin, int end, int worker) {
+    struct SpectrumContext *spectrum = context;
+    int width = spectrum->width, height = spectrum->height, hw = halfSpectrumWidth(width);
+    // displayedSpectrumAt() negates the spectrum of even heights
+    double sign = height % 2 == 0 ? -1.0 : 1.0;
+    for (int v = begin; v < end; v++) {
+        const COMPLEX *row = spectrum->c + (size_t) v * hw;
+        // The image row of centred row r is r, the centred position of index i is (i + n / 2) % n
+        size_t own = (size_t) ((v + height / 2) % height) * spectrum->stride;
+        size_t mirror = (size_t) (((height - v) % height + height / 2) % height) * spectrum->stride;
+        for (int u = 0; u < hw; u++) {
+            double re = sign * row[u].real, im = sign * row[u].imag;
+            int x = (u + width / 2) % width, mx = (width - u + width / 2) % width;
+            int mirrored = u > 0 && width - u >= hw;
+            if (spectrum->spectrumImage != NULL) {
+                uint8_t level = (uint8_t) spectrumLevel(spectrum->levels, re * re + im * im);
+                spectrum->spectrumImage[own + x] = level;
+                if (mirrored) spectrum->spectrumImage[mirror + mx] = level;
+            }
+            if (spectrum->phaseImage != NULL) {
+                double phase = atan2(im, re);
+                spectrum->phaseImage[own + x] = phaseLevel(phase);
+                if (mirrored) spectrum->phaseImage[mirror + mx] = phaseLevel(-phase);
+            }
+        }
+    }
+    (void) worker;
+}
+
+/*
+ * Write the spectrum and phase images of a half spectrum, either image may be NULL
+ * Returns the largest magnitude of the spectrum
+ */
+double spectrumImages(const COMPLEX *c, int height, int width, uint8_t *spectrumImage, uint8_t *phaseImage,
+                      int stride) {
+    struct SpectrumContext context = {.c = c, .width = width, .height = height, .spectrumImage = spectrumImage,
+                                      .phaseImage = phaseImage, .stride = stride};
+    struct TraceSpan span = traceBegin("spectrumImages");
+    int threads = fftThreads < 1 ? 1 : (fftThreads > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : fftThreads);
+    for (int i = 0; i < threads; i++) {
+        context.partialMax[i] = 0.0;
+    }
+    parallelFor(height, threads, spectrumMaxTask, &context);
+    double max2 = 0.0;
+    for (int i = 0; i < threads; i++) {
+        max2 = context.partialMax[i] > max2 ? context.partialMax[i] : max2;
+    }
+    double max = sqrt(max2);
+
+    // 30 * log(1 + 10000 * |F| / max) >= k where |F| >= max * (exp(k / 30) - 1) / 10000,
+    // an empty spectrum is black
+    context.levels[0] = 0.0;
+    for (int k = 1; k < 256; k++) {
+        double magnitude = max * (exp(k / 30.0) - 1) / 10000;
+        context.levels[k] = max > 0 ? magnitude * magnitude : INFINITY;
+    }
+    parallelFor(height, threads, spectrumImageTask, &context);
+    traceEnd(&span);
+    return max;
+}
+
+#endif
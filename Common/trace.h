@@ -0,0 +1,334 @@
+/*
+ * Digital Image Processing
+ * Timers and hardware counters of the hot paths, dumped as a summary and a Chrome trace
+ *
+ * Note:
+ * A span is started with traceBegin() and ended with traceEnd() in the same function:
+ *     struct TraceSpan span = traceBegin("readBitmap");
+ *     ...
+ *     traceEnd(&span);
+ * Tracing is compiled in but off until the environment variable DIP_TRACE names a file, or the
+ * program calls startTrace(). While off, traceBegin() and traceEnd() only read one flag, and the
+ * timers cost nothing worth measuring even in a kernel called per row.
+ * While on, every thread that ends a span gets a ring buffer of TRACE_RING_SIZE events which
+ * only this thread writes, so recording takes no lock: the event is written, then the count of
+ * the ring is published. A full ring overwrites its oldest events. The rings are chained into a
+ * list when they are created and kept until the program ends.
+ * With DIP_TRACE_COUNTERS=1 (or counters set for startTrace()) every span also counts the CPU
+ * cycles, the instructions and the last-level cache misses of its thread in user mode, through
+ * perf_event_open() on Linux. Where the counters cannot be opened, for example when
+ * /proc/sys/kernel/perf_event_paranoid forbids it, they are left out with a warning.
+ * At exit the spans are summed up by name on stderr, calls, total, mean and longest time, and
+ * written to the file as Chrome trace JSON, one complete event per span and one track per
+ * thread, to be opened with chrome://tracing or https://ui.perfetto.dev. The pool threads may
+ * still be ending spans while the dump runs, so it takes the events a ring has published with an
+ * acquire load of its count, and leaves out any event the thread overwrote while it was read.
+ * Spans still running at exit are not written.
+ */
+#ifndef DIP_TRACE_H
+#define DIP_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define TRACE_PERF 1
+#else
+#define TRACE_PERF 0
+#endif
+
+#define TRACE_RING_SIZE 16384
+#define TRACE_COUNTERS 3      // Cycles, instructions, last-level cache misses
+#define TRACE_MAX_NAMES 128
+
+struct TraceSpan {
+    const char *name;
+    uint64_t start;           // Nanoseconds, 0 when tracing is off
+    uint64_t counters[TRACE_COUNTERS];
+};
+
+struct TraceEvent {
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    uint64_t counters[TRACE_COUNTERS];
+};
+
+struct TraceRing {
+    struct TraceEvent events[TRACE_RING_SIZE];
+    atomic_ullong count;      // Events ever written, the last TRACE_RING_SIZE are kept
+    int thread;
+    int counterGroup;         // perf group leader, -1 without counters
+    struct TraceRing *next;
+};
+
+// -1 before the first span, 0 off, 1 on, 2 while the first span reads the environment
+atomic_int traceState = -1;
+const char *tracePath = NULL;
+atomic_int traceCounters = 0;     // Cleared when the counters cannot be opened
+uint64_t traceEpoch = 0;
+_Atomic(struct TraceRing *) traceRings = NULL;
+atomic_int traceThreads = 0;
+_Thread_local struct TraceRing *traceRing = NULL;
+
+uint64_t traceNow(void) {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t) ((double) counter.QuadPart / frequency.QuadPart * 1e9);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#endif
+}
+
+// Counter group of the calling thread, -1 when it cannot be opened
+int traceOpenCounters(void) {
+#if TRACE_PERF
+    static const uint64_t configs[TRACE_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    int leader = -1;
+    for (int i = 0; i < TRACE_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (fd < 0) {
+            if (leader >= 0) close(leader);
+            if (atomic_exchange(&traceCounters, 0) != 0) {
+                fprintf(stderr, "Cannot open the hardware counters, they are left out of the trace!\n");
+            }
+            return -1;
+        }
+        leader = leader < 0 ? fd : leader;
+    }
+    return leader;
+#else
+    return -1;
+#endif
+}
+
+void traceReadCounters(uint64_t *counters) {
+#if TRACE_PERF
+    uint64_t values[1 + TRACE_COUNTERS];
+    if (traceRing != NULL && traceRing->counterGroup >= 0 &&
+        read(traceRing->counterGroup, values, sizeof(values)) == (ssize_t) sizeof(values)) {
+        memcpy(counters, values + 1, sizeof(uint64_t) * TRACE_COUNTERS);
+        return;
+    }
+#endif
+    memset(counters, 0, sizeof(uint64_t) * TRACE_COUNTERS);
+}
+
+struct TraceRing *traceThreadRing(void) {
+    if (traceRing != NULL) return traceRing;
+    struct TraceRing *ring = calloc(1, sizeof(struct TraceRing));
+    if (ring == NULL) {
+        fprintf(stderr, "Cannot allocate the trace buffer!\n");
+        exit(1);
+    }
+    atomic_init(&ring->count, 0);
+    ring->thread = atomic_fetch_add(&traceThreads, 1);
+    ring->counterGroup = traceCounters ? traceOpenCounters() : -1;
+    ring->next = atomic_load(&traceRings);
+    while (!atomic_compare_exchange_weak(&traceRings, &ring->next, ring));
+    traceRing = ring;
+    return ring;
+}
+
+/*
+ * Copy of event i of ring into event, 0 when the ring has wrapped past it. The copy is checked
+ * after it is taken, so an event the thread overwrote meanwhile is not returned torn.
+ */
+int traceReadEvent(struct TraceRing *ring, uint64_t i, struct TraceEvent *event) {
+    *event = ring->events[i % TRACE_RING_SIZE];
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&ring->count, memory_order_relaxed) < i + TRACE_RING_SIZE;
+}
+
+struct TraceTotal {
+    const char *name;
+    long calls;
+    uint64_t total;
+    uint64_t longest;
+    uint64_t counters[TRACE_COUNTERS];
+};
+
+void traceSummary(FILE *out) {
+    struct TraceTotal totals[TRACE_MAX_NAMES];
+    int names = 0;
+    uint64_t lost = 0;
+    for (struct TraceRing *ring = atomic_load(&traceRings); ring != NULL; ring = ring->next) {
+        uint64_t count = atomic_load_explicit(&ring->count, memory_order_acquire);
+        uint64_t first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+        lost += first;
+        for (uint64_t i = first; i < count; i++) {
+            struct TraceEvent copy;
+            const struct TraceEvent *event = &copy;
+            if (!traceReadEvent(ring, i, &copy)) {
+                lost++;
+                continue;
+            }
+            int k = 0;
+            while (k < names && strcmp(totals[k].name, event->name) != 0) k++;
+            if (k == names) {
+                if (names == TRACE_MAX_NAMES) continue;
+                memset(&totals[names++], 0, sizeof(struct TraceTotal));
+                totals[k].name = event->name;
+            }
+            totals[k].calls++;
+            totals[k].total += event->duration;
+            totals[k].longest = event->duration > totals[k].longest ? event->duration : totals[k].longest;
+            for (int c = 0; c < TRACE_COUNTERS; c++) {
+                totals[k].counters[c] += event->counters[c];
+            }
+        }
+    }
+
+    fprintf(out, "%-24s %8s %12s %11s %11s", "Span", "Calls", "Total ms", "Mean ms", "Max ms");
+    fprintf(out, traceCounters ? " %14s %6s %12s\n" : "\n", "Cycles/call", "IPC", "LLC miss/call");
+    for (int k = 0; k < names; k++) {
+        const struct TraceTotal *t = &totals[k];
+        fprintf(out, "%-24s %8ld %12.3f %11.4f %11.4f", t->name, t->calls, t->total * 1e-6,
+                t->total * 1e-6 / t->calls, t->longest * 1e-6);
+        if (traceCounters) {
+            fprintf(out, " %14.4g %6.2f %12.4g\n", (double) t->counters[0] / t->calls,
+                    t->counters[0] ? (double) t->counters[1] / t->counters[0] : 0.0,
+                    (double) t->counters[2] / t->calls);
+        } else {
+            fprintf(out, "\n");
+        }
+    }
+    if (lost > 0) {
+        fprintf(out, "%llu older spans were overwritten and are not counted\n", (unsigned long long) lost);
+    }
+}
+
+void traceWriteJSON(const char *filename) {
+    FILE *fptr = fopen(filename, "w");
+    if (fptr == NULL) {
+        fprintf(stderr, "Cannot open the trace file!\n");
+        return;
+    }
+    fprintf(fptr, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    const char *separator = "\n";
+    for (struct TraceRing *ring = atomic_load(&traceRings); ring != NULL; ring = ring->next) {
+        fprintf(fptr, "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                      "\"args\": {\"name\": \"%s %d\"}}", separator, ring->thread,
+                ring->thread == 0 ? "main" : "thread", ring->thread);
+        separator = ",\n";
+        uint64_t count = atomic_load_explicit(&ring->count, memory_order_acquire);
+        for (uint64_t i = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0; i < count; i++) {
+            struct TraceEvent copy;
+            const struct TraceEvent *event = &copy;
+            if (!traceReadEvent(ring, i, &copy)) {
+                continue;
+            }
+            fprintf(fptr, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                    event->name, ring->thread, (event->start - traceEpoch) * 1e-3, event->duration * 1e-3);
+            if (ring->counterGroup >= 0) {
+                fprintf(fptr, ", \"args\": {\"cycles\": %llu, \"instructions\": %llu, \"llc_misses\": %llu}",
+                        (unsigned long long) event->counters[0], (unsigned long long) event->counters[1],
+                        (unsigned long long) event->counters[2]);
+            }
+            fprintf(fptr, "}");
+        }
+    }
+    fprintf(fptr, "\n]}\n");
+    fclose(fptr);
+}
+
+void traceDump(void) {
+    if (atomic_load(&traceState) != 1) return;
+    atomic_store(&traceState, 0);
+    traceSummary(stderr);
+    if (tracePath != NULL) {
+        traceWriteJSON(tracePath);
+    }
+}
+
+/*
+ * Turn tracing on, the Chrome trace goes to path (NULL for the summary only) when the program
+ * exits. counters adds the hardware counters to the spans of the threads which start afterwards
+ */
+void startTrace(const char *path, int counters) {
+    static atomic_int registered = 0;
+    tracePath = path;
+    traceCounters = counters;
+    traceEpoch = traceNow();
+    if (atomic_exchange(&registered, 1) == 0) {
+        atexit(traceDump);
+    }
+    atomic_store(&traceState, 1);
+}
+
+// Reads DIP_TRACE and DIP_TRACE_COUNTERS once, from the first span
+int traceInit(void) {
+    int unknown = -1;
+    if (!atomic_compare_exchange_strong(&traceState, &unknown, 2)) {
+        return atomic_load(&traceState) == 1;
+    }
+    const char *path = getenv("DIP_TRACE"), *counters = getenv("DIP_TRACE_COUNTERS");
+    if (path != NULL && *path != '\0') {
+        startTrace(path, counters != NULL && atoi(counters) != 0);
+        return 1;
+    }
+    atomic_store(&traceState, 0);
+    return 0;
+}
+
+struct TraceSpan traceBegin(const char *name) {
+    struct TraceSpan span = {.name = name};
+    int state = atomic_load_explicit(&traceState, memory_order_relaxed);
+    if (state == 0 || (state != 1 && !traceInit())) {
+        return span;
+    }
+    if (traceCounters) {
+        traceThreadRing();
+        traceReadCounters(span.counters);
+    }
+    span.start = traceNow();
+    return span;
+}
+
+void traceEnd(const struct TraceSpan *span) {
+    if (span->start == 0 || atomic_load_explicit(&traceState, memory_order_relaxed) != 1) return;
+    uint64_t end = traceNow();
+    struct TraceRing *ring = traceThreadRing();
+    uint64_t count = atomic_load_explicit(&ring->count, memory_order_relaxed);
+    // Pairs with the fence of traceReadEvent(): a dump that sees these stores sees the count too
+    atomic_thread_fence(memory_order_release);
+    struct TraceEvent *event = &ring->events[count % TRACE_RING_SIZE];
+    event->name = span->name;
+    event->start = span->start;
+    event->duration = end - span->start;
+    if (traceCounters) {
+        traceReadCounters(event->counters);
+        for (int c = 0; c < TRACE_COUNTERS; c++) {
+            event->counters[c] -= span->counters[c];
+        }
+    }
+    atomic_store_explicit(&ring->count, count + 1, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,471 @@
+/*
+ * Digital Image Processing
+ * Benchmark of the kernels of the assignments
+ *
+ * Note:
+ * Build like the programs of Assignment-5, with fft.h on the include path:
+ * gcc -O2 benchmark.c -o benchmark -lm -pthread
+ * Usage: benchmark [-min 256] [-max 8192] [-repeat 5] [-threads 1] [-kernel name] [-json file]
+ * Every kernel runs on square images from -min to -max pixels wide, doubling the width. The
+ * images are synthetic and the same on every run: a gradient, rings and hashed noise, so the
+ * histogram is full and no kernel can skip work on flat regions. After one warm-up run the
+ * kernel is timed -repeat times and the median is reported, with the throughput in output
+ * pixels and the bytes per pixel a kernel reads and writes at least (1 for an 8-bit pixel, 8
+ * for a double, a complex of the half spectrum counted as 8 per pixel). Tables which the
+ * programs build once, such as transfer functions and remap tables, are built before timing.
+ * With -json the results are also written as JSON, one object per kernel and size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "fft.h"
+#include "../Common/filters.h"
+#include "../Common/remap.h"
+#include "../Common/pipeline.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define BENCH_MAX_REPEAT 101
+
+struct BenchCase {
+    int width;
+    int height;
+    int stride;
+    uint8_t *src;               // width x height, rows stride bytes apart
+    uint8_t *dst;
+    uint8_t *small;             // Source of the resize, a quarter of the size
+    struct Image *image;        // src with a halo for the stencils
+    COMPLEX *spectrum;
+    double *transfer;
+    double table[2][256];
+    int target[256];            // Histogram specification of Assignment-3 p1
+    PipelineStencil stencil;
+};
+
+struct BenchKernel {
+    const char *name;
+    const char *source;         // Program the kernel comes from
+    double bytesPerPixel;
+    void (*setup)(struct BenchCase *bench);
+    void (*run)(struct BenchCase *bench);
+    void (*cleanup)(struct BenchCase *bench);
+};
+
+struct BenchResult {
+    const char *kernel;
+    const char *source;
+    int width;
+    int height;
+    double median;              // Milliseconds
+    double best;
+    double pixelRate;           // Mpixel/s
+    double bytesPerPixel;
+};
+
+double benchClock(void) {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+// Same pixel for the same (x, y) and width on every run
+uint8_t benchPixel(int x, int y, int width) {
+    uint32_t h = (uint32_t) x * 0x9E3779B1u ^ (uint32_t) y * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 13;
+    double u = (double) x / width - 0.5, v = (double) y / width - 0.5;
+    double value = 96 + 80 * u + 40 * cos(60 * sqrt(u * u + v * v)) + (int) (h & 63) - 32;
+    return (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+void *benchAllocate(size_t size) {
+    void *buffer = malloc(size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Cannot allocate the benchmark images!\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+void noSetup(struct BenchCase *bench) {
+    (void) bench;
+}
+
+// Assignment-1 p3, 4 gray levels through a table
+void quantizeRun(struct BenchCase *bench) {
+    int levels = 4;
+    uint8_t table[256];
+    for (int v = 0; v < 256; v++) {
+        table[v] = (uint8_t) ((v / (256 / levels)) * (255 / (levels - 1)));
+    }
+    size_t size = (size_t) bench->stride * bench->height;
+    for (size_t i = 0; i < size; i++) {
+        bench->dst[i] = table[bench->src[i]];
+    }
+}
+
+// Assignment-2 p2, bit plane 0
+void bitPlaneRun(struct BenchCase *bench) {
+    size_t size = (size_t) bench->stride * bench->height;
+    for (size_t i = 0; i < size; i++) {
+        bench->dst[i] = bench->src[i] & 1 ? 0 : 255;
+    }
+}
+
+void resizeSetup(struct BenchCase *bench) {
+    int width = bench->width / 4, height = bench->height / 4;
+    bench->small = benchAllocate((size_t) width * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            bench->small[(size_t) y * width + x] = benchPixel(x, y, width);
+        }
+    }
+}
+
+// Assignment-2 p1 (c), 4 times larger by bilinear interpolation
+void resizeRun(struct BenchCase *bench) {
+    int ratio = 4, srcWidth = bench->width / ratio, srcHeight = bench->height / ratio;
+    for (int y = 0; y < bench->height; y++) {
+        int srcY = y / ratio;
+        if (srcY + 1 > srcHeight - 1) continue;
+        const uint8_t *top = bench->small + (size_t) srcY * srcWidth, *bottom = top + srcWidth;
+        uint8_t *out = bench->dst + (size_t) y * bench->stride;
+        double fy = (double) (y % ratio) / ratio;
+        for (int x = 0; x < bench->width; x++) {
+            int srcX = x / ratio;
+            if (srcX + 1 > srcWidth - 1) continue;
+            double fx = (double) (x % ratio) / ratio;
+            double dst1 = fx * top[srcX] + (1 - fx) * top[srcX + 1];
+            double dst2 = fx * bottom[srcX] + (1 - fx) * bottom[srcX + 1];
+            out[x] = (uint8_t) (fy * dst1 + (1 - fy) * dst2);
+        }
+    }
+}
+
+void resizeCleanup(struct BenchCase *bench) {
+    free(bench->small);
+    bench->small = NULL;
+}
+
+struct RemapTransform benchRotation(const struct BenchCase *bench) {
+    return rotationTransform(-21, bench->width / 2, bench->height / 2, REMAP_NEAREST);
+}
+
+void rotateSetup(struct BenchCase *bench) {
+    struct RemapTransform transform = benchRotation(bench);
+    getRemapTable(&transform, bench->width, bench->height, bench->stride, bench->width, bench->height, bench->stride);
+}
+
+// Assignment-2 p3 and Assignment-4 p3, -21 degrees through the cached remap table
+void rotateRun(struct BenchCase *bench) {
+    struct RemapTransform transform = benchRotation(bench);
+    remap(&transform, bench->src, bench->dst, bench->width, bench->height, bench->stride, 0);
+}
+
+void rotateCleanup(struct BenchCase *bench) {
+    (void) bench;
+    freeRemapCache();
+}
+
+// The specified histogram of Assignment-3 p1, cumulative and scaled to 0-255
+void histogramSetup(struct BenchCase *bench) {
+    int *s = bench->target;
+    int t = 70000 / 12;
+    memset(s, 0, 256 * sizeof(int));
+    for (int j = 0; j <= 12; j++) s[j] = t * j;
+    for (int j = 13; j <= 20; j++) s[j] = t * (24 - j);
+    t = 4 * t / (184 - 21);
+    for (int j = 21; j <= 184; j++) s[j] = t * (184 - j);
+    t = 9000 / (224 - 184);
+    for (int j = 185; j <= 224; j++) s[j] = t * (j - 185);
+    t = 9000 / (255 - 224);
+    for (int j = 225; j <= 255; j++) s[j] = t * (255 - j);
+    for (int i = 1; i < 256; i++) s[i] += s[i - 1];
+    t = s[255];
+    for (int i = 0; i < 256; i++) s[i] = s[i] * 255 / t;
+}
+
+// Assignment-3 p1, histogram, equalization and the inverse of the specification
+void histogramRun(struct BenchCase *bench) {
+    long long histogram[256] = {0};
+    int gInverse[256] = {0};
+    uint8_t table[256];
+    for (int y = 0; y < bench->height; y++) {
+        const uint8_t *row = bench->src + (size_t) y * bench->stride;
+        for (int x = 0; x < bench->width; x++) {
+            histogram[row[x]]++;
+        }
+    }
+    for (int i = 1; i < 256; i++) histogram[i] += histogram[i - 1];
+    for (int i = 0; i < 256; i++) gInverse[bench->target[i]] = i;
+    for (int i = 1; i < 256; i++) {
+        if (!gInverse[i]) gInverse[i] = gInverse[i - 1];
+    }
+    for (int i = 0; i < 256; i++) {
+        table[i] = (uint8_t) gInverse[histogram[i] * 255 / histogram[255]];
+    }
+    for (int y = 0; y < bench->height; y++) {
+        const uint8_t *row = bench->src + (size_t) y * bench->stride;
+        uint8_t *out = bench->dst + (size_t) y * bench->stride;
+        for (int x = 0; x < bench->width; x++) {
+            out[x] = table[row[x]];
+        }
+    }
+}
+
+void stencilSetup(struct BenchCase *bench) {
+    bench->image = createImage(bench->width, bench->height, 1, NULL);
+    loadImage(bench->image, bench->src, bench->stride);
+    fillHalo(bench->image, HALO_REPLICATE, 0);
+}
+
+void stencilTileTask(void *context, int x0, int y0, int x1, int y1, int worker) {
+    const struct BenchCase *bench = context;
+    for (int y = y0; y < y1; y++) {
+        bench->stencil(imageRow(bench->image, y - 1) + x0, imageRow(bench->image, y) + x0,
+                       imageRow(bench->image, y + 1) + x0, bench->dst + (size_t) y * bench->stride + x0, x1 - x0);
+    }
+    (void) worker;
+}
+
+// Assignment-3 p3, the 3 x 3 stencils as the pipelines run them
+void stencilRun(struct BenchCase *bench) {
+    parallelTiles(bench->width, bench->height, parallelThreads, stencilTileTask, bench);
+}
+
+void laplacianSetup(struct BenchCase *bench) {
+    bench->stencil = sharpenRow;
+    stencilSetup(bench);
+}
+
+void sobelSetup(struct BenchCase *bench) {
+    bench->stencil = sobelRow;
+    stencilSetup(bench);
+}
+
+void boxSetup(struct BenchCase *bench) {
+    bench->stencil = boxRow;
+    stencilSetup(bench);
+}
+
+void stencilCleanup(struct BenchCase *bench) {
+    destroyImage(bench->image);
+    bench->image = NULL;
+}
+
+// The powers of the 256 pixel values, the sums are the same as with pow() per pixel
+void contraharmonicSetup(struct BenchCase *bench) {
+    double q = 1.5;
+    for (int v = 0; v < 256; v++) {
+        bench->table[0][v] = pow(v, q + 1);
+        bench->table[1][v] = pow(v, q);
+    }
+    memset(bench->dst, 0, (size_t) bench->stride * bench->height);
+}
+
+// Assignment-5 p3, order 1.5 inside the border
+void contraharmonicRun(struct BenchCase *bench) {
+    for (int y = 1; y < bench->height - 1; y++) {
+        const uint8_t *row = bench->src + (size_t) y * bench->stride;
+        uint8_t *out = bench->dst + (size_t) y * bench->stride;
+        for (int x = 1; x < bench->width - 1; x++) {
+            double sum1 = 0, sum2 = 0;
+            for (int r = -1; r <= 1; r++) {
+                for (int c = -1; c <= 1; c++) {
+                    uint8_t v = row[r * bench->stride + x + c];
+                    sum1 += bench->table[0][v];
+                    sum2 += bench->table[1][v];
+                }
+            }
+            out[x] = (uint8_t) (sum1 / sum2);
+        }
+    }
+}
+
+void spectrumSetup(struct BenchCase *bench) {
+    bench->spectrum = benchAllocate((size_t) bench->height * halfSpectrumWidth(bench->width) * sizeof(COMPLEX));
+    for (int y = 0; y < bench->height; y++) {
+        double *row = realRow(bench->spectrum, y, bench->width);
+        for (int x = 0; x < bench->width; x++) {
+            row[x] = bench->src[(size_t) y * bench->stride + x];
+        }
+    }
+}
+
+// Forward and inverse real FFT, the image comes back
+void fftRun(struct BenchCase *bench) {
+    RFFT2D(bench->spectrum, bench->height, bench->width, 1);
+    RFFT2D(bench->spectrum, bench->height, bench->width, -1);
+}
+
+void spectrumCleanup(struct BenchCase *bench) {
+    free(bench->spectrum);
+    free(bench->transfer);
+    bench->spectrum = NULL;
+    bench->transfer = NULL;
+}
+
+// Assignment-5 p1, D0 = width / 16
+void idealSetup(struct BenchCase *bench) {
+    struct FilterSpec ideal = {.band = FILTER_LOWPASS, .response = FILTER_IDEAL, .d0 = bench->width / 16.0};
+    spectrumSetup(bench);
+    bench->transfer = makeTransfer(&ideal, bench->width, bench->height, 1);
+}
+
+// Assignment-5 p2, 8 Butterworth notches of radius 9 spread over the spectrum
+void notchSetup(struct BenchCase *bench) {
+    double notches[8][2];
+    for (int i = 0; i < 8; i++) {
+        notches[i][0] = (i % 4 - 1.5) * bench->width / 6;
+        notches[i][1] = (i / 4 - 0.5) * bench->height / 3;
+    }
+    struct FilterSpec reject = {.band = FILTER_NOTCHREJECT, .response = FILTER_BUTTERWORTH, .d0 = 9, .order = 2,
+                                .notches = (const double (*)[2]) notches, .notchCount = 8};
+    spectrumSetup(bench);
+    bench->transfer = makeTransfer(&reject, bench->width, bench->height, 1);
+}
+
+// Forward FFT, transfer function and inverse FFT
+void filterRun(struct BenchCase *bench) {
+    RFFT2D(bench->spectrum, bench->height, bench->width, 1);
+    applyTransfer(bench->spectrum, bench->transfer, bench->width, bench->height, 1);
+    RFFT2D(bench->spectrum, bench->height, bench->width, -1);
+}
+
+const struct BenchKernel benchKernels[] = {
+        {"quantization",   "Assignment-1/p3",  2,      noSetup,              quantizeRun,        NULL},
+        {"bit-plane",      "Assignment-2/p2",  2,      noSetup,              bitPlaneRun,        NULL},
+        {"resize",         "Assignment-2/p1",  1.0625, resizeSetup,          resizeRun,          resizeCleanup},
+        {"rotation",       "Assignment-4/p3",  10,     rotateSetup,          rotateRun,          rotateCleanup},
+        {"histogram",      "Assignment-3/p1",  3,      histogramSetup,       histogramRun,       NULL},
+        {"laplacian",      "Assignment-3/p3b", 2,      laplacianSetup,       stencilRun,         stencilCleanup},
+        {"sobel",          "Assignment-3/p3d", 2,      sobelSetup,           stencilRun,         stencilCleanup},
+        {"box",            "Assignment-3/p3e", 2,      boxSetup,             stencilRun,         stencilCleanup},
+        {"contraharmonic", "Assignment-5/p3",  2,      contraharmonicSetup,  contraharmonicRun,  NULL},
+        {"fft2d",          "Assignment-5/p1",  32,     spectrumSetup,        fftRun,             spectrumCleanup},
+        {"ilpf",           "Assignment-5/p1",  52,     idealSetup,           filterRun,          spectrumCleanup},
+        {"notch",          "Assignment-5/p2",  52,     notchSetup,           filterRun,          spectrumCleanup},
+};
+
+int compareTimes(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+struct BenchResult runBenchmark(const struct BenchKernel *kernel, struct BenchCase *bench, int repeat) {
+    double times[BENCH_MAX_REPEAT];
+    kernel->setup(bench);
+    kernel->run(bench);
+    for (int i = 0; i < repeat; i++) {
+        double start = benchClock();
+        kernel->run(bench);
+        times[i] = (benchClock() - start) * 1000;
+    }
+    if (kernel->cleanup != NULL) {
+        kernel->cleanup(bench);
+    }
+    qsort(times, repeat, sizeof(double), compareTimes);
+    double median = repeat % 2 ? times[repeat / 2] : (times[repeat / 2 - 1] + times[repeat / 2]) / 2;
+    struct BenchResult result = {kernel->name, kernel->source, bench->width, bench->height, median, times[0],
+                                 (double) bench->width * bench->height / (median * 1000), kernel->bytesPerPixel};
+    return result;
+}
+
+void writeJSON(const char *filename, const struct BenchResult *results, int count, int repeat, int threads) {
+    FILE *fptr = fopen(filename, "w");
+    if (fptr == NULL) {
+        fprintf(stderr, "Cannot open the output file!\n");
+        exit(1);
+    }
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(fptr, "{\n  \"date\": \"%s\",\n  \"repeat\": %d,\n  \"threads\": %d,\n  \"results\": [\n",
+            date, repeat, threads);
+    for (int i = 0; i < count; i++) {
+        const struct BenchResult *r = &results[i];
+        fprintf(fptr, "    {\"kernel\": \"%s\", \"source\": \"%s\", \"width\": %d, \"height\": %d, "
+                      "\"median_ms\": %.4f, \"min_ms\": %.4f, \"mpixels_per_s\": %.2f, \"bytes_per_pixel\": %.4g}%s\n",
+                r->kernel, r->source, r->width, r->height, r->median, r->best, r->pixelRate, r->bytesPerPixel,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(fptr, "  ]\n}\n");
+    fclose(fptr);
+}
+
+int main(int argc, char **argv) {
+    int minSize = 256, maxSize = 8192, repeat = 5, threads = 1;
+    const char *only = NULL, *json = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-min") == 0) {
+            minSize = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-max") == 0) {
+            maxSize = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-repeat") == 0) {
+            repeat = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-threads") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-kernel") == 0) {
+            only = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-json") == 0) {
+            json = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [-min 256] [-max 8192] [-repeat 5] [-threads 1] [-kernel name] [-json file]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (minSize < 16 || maxSize < minSize || repeat < 1 || repeat > BENCH_MAX_REPEAT) {
+        fprintf(stderr, "Invalid benchmark settings!\n");
+        exit(1);
+    }
+    setFFTThreads(threads);
+    setParallelThreads(threads);
+    setPipelineThreads(threads);
+
+    int kernelCount = sizeof(benchKernels) / sizeof(benchKernels[0]);
+    struct BenchResult *results = benchAllocate(kernelCount * 32 * sizeof(struct BenchResult));
+    int count = 0;
+    printf("%-15s %-17s %11s %11s %12s %9s\n", "Kernel", "Size", "Median ms", "Min ms", "Mpixel/s", "B/pixel");
+    for (int size = minSize; size <= maxSize && size > 0; size *= 2) {
+        struct BenchCase bench = {.width = size, .height = size, .stride = (size * 8 + 31) / 32 * 4};
+        bench.src = benchAllocate((size_t) bench.stride * size);
+        bench.dst = benchAllocate((size_t) bench.stride * size);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < bench.stride; x++) {
+                bench.src[(size_t) y * bench.stride + x] = x < size ? benchPixel(x, y, size) : 0;
+            }
+        }
+        memset(bench.dst, 0, (size_t) bench.stride * size);
+        for (int k = 0; k < kernelCount; k++) {
+            if (only != NULL && strcmp(only, benchKernels[k].name) != 0) continue;
+            struct BenchResult r = runBenchmark(&benchKernels[k], &bench, repeat);
+            printf("%-15s %6d x %-8d %11.3f %11.3f %12.1f %9.4g\n",
+                   r.kernel, r.width, r.height, r.median, r.best, r.pixelRate, r.bytesPerPixel);
+            fflush(stdout);
+            results[count++] = r;
+        }
+        free(bench.src);
+        free(bench.dst);
+    }
+    if (json != NULL) {
+        writeJSON(json, results, count, repeat, threads);
+    }
+    freeFFTPlanCache();
+    freeDistanceMaps();
+    free(results);
+    return 0;
+}
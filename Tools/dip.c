@@ -0,0 +1,880 @@
+/*
+ * Digital Image Processing
+ * Command-line tool running a spec of operations on many bitmaps in one process
+ *
+ * Note:
+ * Build like benchmark.c, with fft.h on the include path (POSIX, add -lrt before glibc 2.34):
+ * gcc -O2 dip.c -o dip -lm -pthread
+ * Usage: dip [-threads 1] [-plan] -o output spec input...
+ *        dip -serve socket [-threads 1] [-queue 16]
+ *        dip -connect socket [-shm] -o output spec input...
+ * e.g.   dip -o "*-edges.bmp" "sobel | box:3 | gamma:0.5" "Fig*.bmp"
+ * The steps of spec are listed in Common/spec.h. Every input is a file or a glob pattern, quote
+ * it to have it expanded here instead of by the shell. The * of output is replaced by the name
+ * of the input without its directory and .bmp, it may only be left out for a single input.
+ * The spec is parsed once and planned on the first image of every size, the later images reuse
+ * the plan, the FFT plans, the remap tables and the buffers. -plan prints the plan of every new
+ * size, with the stages the stencils and maps were fused into.
+ * The inputs are 8-bit bitmaps, the outputs keep their color table. An input which cannot be
+ * read or processed is reported and skipped, the exit status is then 1.
+ *
+ * -serve keeps all of that warm across processes. It listens on the Unix domain socket, takes
+ * one request per connection and answers it on the same connection:
+ * - The request holds the spec and either the path of the input, opened by the server, or with
+ *   -shm the whole bitmap file in a shared memory object whose descriptor comes along with it.
+ * - The reply holds the result as a bitmap file in a new shared memory object, again passed as
+ *   a descriptor. Both objects are unlinked as soon as they are opened, so nothing is left
+ *   behind when either side exits.
+ * - The plans of the last DIP_PLAN_CACHE pairs of spec and image size are kept, and with them
+ *   their pipelines and transfer tables, next to the FFT plan and remap table caches and one
+ *   ImagePool, so clients sending images of different sizes do not replan each other's.
+ * - The caches are not thread-safe, so one thread serves the requests in turn, each one on
+ *   -threads threads. Accepted connections wait in a queue of -queue entries. When it is full
+ *   the connection is answered DIP_BUSY at once, and -connect retries after a growing pause.
+ * - A client which sends nothing for DIP_TIMEOUT seconds is dropped.
+ * SIGINT or SIGTERM stops the server after the queued requests and removes the socket.
+ * -connect is the client. It processes the inputs like the first form, through the server.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "fft.h"
+#include "../Common/spec.h"
+
+#define DIP_MAGIC 0x31504944u      // "DIP1"
+#define DIP_SPEC_SIZE 1024
+#define DIP_PATH_SIZE 4096
+#define DIP_PLAN_CACHE 16
+#define DIP_MAX_QUEUE 1024
+#define DIP_TIMEOUT 5              // Seconds
+#define DIP_RETRIES 10             // Of a busy request, after 10 ms, 20 ms, ...
+
+enum DipStatus {
+    DIP_OK,
+    DIP_FAILED,
+    DIP_BUSY
+};
+
+struct BitmapHeader {
+    char format[2];
+    unsigned int fileSize;
+    __attribute__((unused)) unsigned int reserved;
+    unsigned int offset;
+};
+
+struct DipHeader {
+    unsigned int headerSize;
+    unsigned int imageWidth;
+    unsigned int imageHeight;
+    unsigned short int colorPlanes;
+    unsigned short int colorDepth;
+    unsigned int compression;
+    unsigned int imageSize;
+    int xPixelPerMeter;
+    int yPixelPerMeter;
+    unsigned int colorCount;
+    unsigned int importantColorCount;
+};
+
+// A bitmap whose pixel buffer is kept and grown from one file to the next
+struct BitmapFile {
+    struct BitmapHeader bitmapHeader;
+    struct DipHeader dipHeader;
+    uint8_t colorTable[1024];
+    uint8_t *imageData;
+    size_t capacity;
+};
+
+struct DipOptions {
+    int threads;
+    int showPlan;
+    int queue;
+    int shm;
+    const char *output;
+    const char *spec;
+    const char *serve;
+    const char *connect;
+    glob_t inputs;
+};
+
+struct DipRequest {
+    uint32_t magic;
+    uint32_t hasImage;             // The bitmap file comes as a descriptor instead of a path
+    uint64_t imageSize;            // Bytes of the bitmap file
+    char spec[DIP_SPEC_SIZE];
+    char path[DIP_PATH_SIZE];
+};
+
+struct DipReply {
+    int32_t status;
+    uint32_t reserved;
+    uint64_t size;                 // Bytes of the bitmap file of the descriptor
+    char error[256];
+};
+
+// Accepted connections waiting for the serving thread
+struct DipQueue {
+    int connections[DIP_MAX_QUEUE];
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+struct DipPlanEntry {
+    char spec[DIP_SPEC_SIZE];
+    int width;
+    int height;
+    struct SpecPlan *plan;
+    unsigned long lastUse;
+};
+
+struct DipServer {
+    struct DipQueue queue;
+    struct ImagePool *pool;
+    struct DipPlanEntry plans[DIP_PLAN_CACHE];
+    unsigned long planClock;
+    struct BitmapFile bitmap;
+    uint8_t *result;
+    size_t resultCapacity;
+    unsigned long served, failed, busy, planMisses;
+};
+
+volatile sig_atomic_t dipStop = 0;
+
+double dipClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int bitmapStride(int width) {
+    return (width * 8 + 31) / 32 * 4;
+}
+
+// Bytes of the file of a width x height bitmap with its color table
+size_t bitmapFileSize(int width, int height) {
+    return 2 + 3 * sizeof(unsigned int) + sizeof(struct DipHeader) + 1024 + (size_t) bitmapStride(width) * height;
+}
+
+void *reserveBuffer(void *buffer, size_t *capacity, size_t size) {
+    if (size > *capacity) {
+        free(buffer);
+        buffer = malloc(size);
+        if (buffer == NULL) {
+            fprintf(stderr, "Cannot allocate the image!\n");
+            exit(1);
+        }
+        *capacity = size;
+    }
+    return buffer;
+}
+
+// Like readBitmap() of the programs, without printing the headers. Returns 0 when it is not an 8-bit bitmap
+int readBitmapStream(FILE *fptr, struct BitmapFile *bitmap) {
+    struct DipHeader *dipHeader = &bitmap->dipHeader;
+    int ok = fread(bitmap->bitmapHeader.format, 2, 1, fptr) == 1 &&
+             fread(&bitmap->bitmapHeader.fileSize, 3 * sizeof(unsigned int), 1, fptr) == 1 &&
+             fread(dipHeader, sizeof(struct DipHeader), 1, fptr) == 1 &&
+             bitmap->bitmapHeader.format[0] == 'B' && bitmap->bitmapHeader.format[1] == 'M' &&
+             dipHeader->headerSize == 40 && dipHeader->compression == 0 && dipHeader->colorDepth == 8 &&
+             dipHeader->imageWidth > 0 && dipHeader->imageWidth < 65536 &&
+             dipHeader->imageHeight > 0 && dipHeader->imageHeight < 65536;
+    if (ok) {
+        dipHeader->imageSize = bitmapStride((int) dipHeader->imageWidth) * dipHeader->imageHeight;
+        bitmap->imageData = reserveBuffer(bitmap->imageData, &bitmap->capacity, dipHeader->imageSize);
+        ok = fread(bitmap->colorTable, 1024, 1, fptr) == 1 &&
+             fseek(fptr, (long) bitmap->bitmapHeader.offset, SEEK_SET) == 0 &&
+             fread(bitmap->imageData, dipHeader->imageSize, 1, fptr) == 1;
+    }
+    return ok;
+}
+
+int loadBitmap(const char *filename, struct BitmapFile *bitmap) {
+    struct TraceSpan span = traceBegin("readBitmap");
+    FILE *fptr = fopen(filename, "rb");
+    if (fptr == NULL) {
+        fprintf(stderr, "Cannot open %s!\n", filename);
+        return 0;
+    }
+    int ok = readBitmapStream(fptr, bitmap);
+    fclose(fptr);
+    if (!ok) {
+        fprintf(stderr, "Cannot load %s, it is not an 8-bit bitmap!\n", filename);
+    }
+    traceEnd(&span);
+    return ok;
+}
+
+// The headers of bitmap for width x height pixels
+void resultHeaders(const struct BitmapFile *bitmap, int width, int height, struct BitmapHeader *bitmapHeader,
+                   struct DipHeader *dipHeader) {
+    *bitmapHeader = bitmap->bitmapHeader;
+    *dipHeader = bitmap->dipHeader;
+    dipHeader->imageWidth = (unsigned int) width;
+    dipHeader->imageHeight = (unsigned int) height;
+    dipHeader->imageSize = (unsigned int) bitmapStride(width) * height;
+    bitmapHeader->fileSize = (unsigned int) bitmapFileSize(width, height);
+    bitmapHeader->offset = bitmapHeader->fileSize - dipHeader->imageSize;
+}
+
+// Like writeBitmap() of the programs, with the headers of bitmap and the size of the pixels
+int writeBitmapStream(FILE *fptr, const struct BitmapFile *bitmap, int width, int height,
+                      const uint8_t *imageData) {
+    struct BitmapHeader bitmapHeader;
+    struct DipHeader dipHeader;
+    resultHeaders(bitmap, width, height, &bitmapHeader, &dipHeader);
+    fwrite(bitmapHeader.format, 2 * sizeof(char), 1, fptr);
+    fwrite(&bitmapHeader.fileSize, 3 * sizeof(unsigned int), 1, fptr);
+    fwrite(&dipHeader, sizeof(dipHeader), 1, fptr);
+    fwrite(bitmap->colorTable, 1024, 1, fptr);
+    return fwrite(imageData, dipHeader.imageSize, 1, fptr) == 1;
+}
+
+// The same file into data, which holds bitmapFileSize() bytes
+void storeBitmapFile(uint8_t *data, const struct BitmapFile *bitmap, int width, int height,
+                     const uint8_t *imageData) {
+    struct BitmapHeader bitmapHeader;
+    struct DipHeader dipHeader;
+    resultHeaders(bitmap, width, height, &bitmapHeader, &dipHeader);
+    memcpy(data, bitmapHeader.format, 2 * sizeof(char));
+    memcpy(data + 2, &bitmapHeader.fileSize, 3 * sizeof(unsigned int));
+    data += 2 + 3 * sizeof(unsigned int);
+    memcpy(data, &dipHeader, sizeof(dipHeader));
+    memcpy(data + sizeof(dipHeader), bitmap->colorTable, 1024);
+    memcpy(data + sizeof(dipHeader) + 1024, imageData, dipHeader.imageSize);
+}
+
+int saveBitmap(const char *filename, const struct BitmapFile *bitmap, int width, int height,
+               const uint8_t *imageData) {
+    struct TraceSpan span = traceBegin("writeBitmap");
+    FILE *fptr = fopen(filename, "wb");
+    if (fptr == NULL) {
+        fprintf(stderr, "Cannot open the output file %s!\n", filename);
+        return 0;
+    }
+    int ok = writeBitmapStream(fptr, bitmap, width, height, imageData);
+    ok = fclose(fptr) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Cannot write %s!\n", filename);
+    }
+    traceEnd(&span);
+    return ok;
+}
+
+/*
+ * Run the plan on bitmap into *result, grown to the output size in *outWidth x *outHeight
+ * Returns 0 when the spec does not suit the size, plan->error tells why
+ */
+int processBitmap(struct SpecPlan *plan, const struct BitmapFile *bitmap, uint8_t **result, size_t *capacity,
+                  int *outWidth, int *outHeight) {
+    int width = (int) bitmap->dipHeader.imageWidth, height = (int) bitmap->dipHeader.imageHeight;
+    specOutputSize(&plan->spec, width, height, outWidth, outHeight);
+    int stride = bitmapStride(*outWidth);
+    *result = reserveBuffer(*result, capacity, (size_t) stride * *outHeight);
+    if (!runSpec(plan, bitmap->imageData, width, height, bitmapStride(width), *result, stride)) {
+        return 0;
+    }
+    // The padding at the end of the rows is written as well
+    for (int y = 0; y < *outHeight && stride > *outWidth; y++) {
+        memset(*result + (size_t) y * stride + *outWidth, 0, stride - *outWidth);
+    }
+    return 1;
+}
+
+// output with its * replaced by the name of input, without the directory and .bmp
+void outputName(char *name, size_t size, const char *output, const char *input) {
+    const char *base = strrchr(input, '/') != NULL ? strrchr(input, '/') + 1 : input;
+    int length = (int) strlen(base);
+    if (length > 4 && strcmp(base + length - 4, ".bmp") == 0) {
+        length -= 4;
+    }
+    const char *star = strchr(output, '*');
+    if (star == NULL) {
+        snprintf(name, size, "%s", output);
+    } else {
+        snprintf(name, size, "%.*s%.*s%s", (int) (star - output), output, length, base, star + 1);
+    }
+}
+
+int batchMain(struct DipOptions *options, const struct Spec *spec) {
+    setFFTThreads(options->threads);
+    setParallelThreads(options->threads);
+    setPipelineThreads(options->threads);
+
+    struct ImagePool *pool = createImagePool(0);
+    struct SpecPlan *plan = createSpecPlan(spec, pool);
+    struct BitmapFile bitmap = {0};
+    uint8_t *result = NULL;
+    size_t resultCapacity = 0;
+    int failures = 0;
+    double start = dipClock();
+    for (size_t k = 0; k < options->inputs.gl_pathc; k++) {
+        const char *input = options->inputs.gl_pathv[k];
+        char name[DIP_PATH_SIZE];
+        int outWidth, outHeight;
+        if (!loadBitmap(input, &bitmap)) {
+            failures++;
+            continue;
+        }
+        int planned = plan->width == (int) bitmap.dipHeader.imageWidth &&
+                      plan->height == (int) bitmap.dipHeader.imageHeight;
+        if (!processBitmap(plan, &bitmap, &result, &resultCapacity, &outWidth, &outHeight)) {
+            fprintf(stderr, "Cannot process %s: %s!\n", input, plan->error);
+            failures++;
+            continue;
+        }
+        if (options->showPlan && !planned) {
+            printSpecPlan(plan, stdout);
+        }
+        outputName(name, sizeof(name), options->output, input);
+        failures += !saveBitmap(name, &bitmap, outWidth, outHeight, result);
+    }
+    double elapsed = dipClock() - start;
+    printf("%zu images in %.1f ms, %d failed\n", options->inputs.gl_pathc, elapsed * 1000, failures);
+
+    destroySpecPlan(plan);
+    destroyImagePool(pool);
+    freeFFTPlanCache();
+    freeRemapCache();
+    freeDistanceMaps();
+    free(bitmap.imageData);
+    free(result);
+    return failures == 0 ? 0 : 1;
+}
+
+// Messages and descriptors
+
+// Send size bytes of data, with the descriptor fd unless it is -1. Returns 0 when the peer is gone
+int sendMessage(int socket, const void *data, size_t size, int fd) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {(void *) data, size};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+    ssize_t sent = sendmsg(socket, &message, 0);
+    // The descriptor went with the first byte, the rest is plain data
+    for (size_t done = sent > 0 ? (size_t) sent : 0; sent > 0 && done < size; done += (size_t) sent) {
+        sent = send(socket, (const char *) data + done, size - done, 0);
+    }
+    return sent > 0;
+}
+
+/*
+ * Receive size bytes into data, and a descriptor into *fd or -1
+ * Returns 0 when the peer is gone or sent more than one descriptor, some of which the kernel
+ * may have dropped
+ */
+int receiveMessage(int socket, void *data, size_t size, int *fd) {
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {data, size};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    *fd = -1;
+    ssize_t received = recvmsg(socket, &message, 0);
+    // The padding of the buffer may hold a second descriptor, any but the first are closed
+    int extra = 0;
+    struct cmsghdr *header = received > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    for (; header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+        size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int descriptor;
+            memcpy(&descriptor, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (*fd < 0) {
+                *fd = descriptor;
+            } else {
+                close(descriptor);
+                extra = 1;
+            }
+        }
+    }
+    if (received > 0 && (extra || (message.msg_flags & MSG_CTRUNC))) {
+        received = -1;
+    }
+    for (size_t done = received > 0 ? (size_t) received : 0; received > 0 && done < size; done += (size_t) received) {
+        received = recv(socket, (char *) data + done, size - done, 0);
+    }
+    if (received <= 0 && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+    return received > 0;
+}
+
+// Shared memory object of size bytes mapped into *data, already unlinked. Returns its descriptor or -1
+int createSharedBuffer(size_t size, uint8_t **data) {
+    static unsigned long counter = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/dip-%ld-%lu", (long) getpid(), counter++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return -1;
+    shm_unlink(name);
+    void *mapped = MAP_FAILED;
+    if (ftruncate(fd, (off_t) size) == 0) {
+        mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    *data = mapped;
+    return fd;
+}
+
+// Map size bytes of a received object for reading, NULL when it is smaller
+uint8_t *mapSharedBuffer(int fd, size_t size) {
+    struct stat status;
+    if (size == 0 || fstat(fd, &status) != 0 || (size_t) status.st_size < size) {
+        return NULL;
+    }
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+// Server
+
+// Returns 0 when the queue is full
+int pushConnection(struct DipQueue *queue, int connection) {
+    pthread_mutex_lock(&queue->lock);
+    int pushed = queue->count < queue->capacity;
+    if (pushed) {
+        queue->connections[(queue->head + queue->count++) % queue->capacity] = connection;
+        pthread_cond_signal(&queue->ready);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return pushed;
+}
+
+// Waits for a connection, returns -1 once the queue is closed and empty
+int popConnection(struct DipQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+    int connection = -1;
+    if (queue->count > 0) {
+        connection = queue->connections[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return connection;
+}
+
+/*
+ * The cached plan of the spec text for width x height images, parsed on a miss
+ * Returns NULL and sets error when the spec is not valid
+ */
+struct SpecPlan *getServerPlan(struct DipServer *server, const char *text, int width, int height,
+                               char *error, size_t errorSize) {
+    int victim = 0;
+    for (int i = 0; i < DIP_PLAN_CACHE; i++) {
+        struct DipPlanEntry *entry = &server->plans[i];
+        if (entry->plan == NULL) {
+            victim = i;
+            break;
+        }
+        if (entry->width == width && entry->height == height && strcmp(entry->spec, text) == 0) {
+            entry->lastUse = ++server->planClock;
+            return entry->plan;
+        }
+        if (server->plans[victim].plan != NULL && entry->lastUse < server->plans[victim].lastUse) {
+            victim = i;
+        }
+    }
+
+    struct Spec spec;
+    if (!parseSpec(&spec, text)) {
+        snprintf(error, errorSize, "Invalid spec: %s", spec.error);
+        return NULL;
+    }
+    struct DipPlanEntry *entry = &server->plans[victim];
+    destroySpecPlan(entry->plan);
+    snprintf(entry->spec, DIP_SPEC_SIZE, "%s", text);
+    entry->width = width;
+    entry->height = height;
+    entry->plan = createSpecPlan(&spec, server->pool);
+    entry->lastUse = ++server->planClock;
+    server->planMisses++;
+    return entry->plan;
+}
+
+// Read the request of connection, run it and reply. Fills reply and returns the result descriptor or -1
+int runRequest(struct DipServer *server, int connection, struct DipReply *reply) {
+    struct DipRequest request;
+    int imageFd;
+    if (!receiveMessage(connection, &request, sizeof(request), &imageFd) || request.magic != DIP_MAGIC) {
+        snprintf(reply->error, sizeof(reply->error), "Invalid request");
+        if (imageFd >= 0) close(imageFd);
+        return -1;
+    }
+    request.spec[DIP_SPEC_SIZE - 1] = '\0';
+    request.path[DIP_PATH_SIZE - 1] = '\0';
+
+    // The input, from the path or the bitmap file in the shared memory of the request
+    int loaded = 0;
+    if (request.hasImage) {
+        uint8_t *image = imageFd >= 0 ? mapSharedBuffer(imageFd, request.imageSize) : NULL;
+        FILE *fptr = image != NULL ? fmemopen(image, request.imageSize, "rb") : NULL;
+        loaded = fptr != NULL && readBitmapStream(fptr, &server->bitmap);
+        if (fptr != NULL) fclose(fptr);
+        if (image != NULL) munmap(image, request.imageSize);
+        if (!loaded) snprintf(reply->error, sizeof(reply->error), "Cannot load the shared bitmap");
+    } else {
+        FILE *fptr = fopen(request.path, "rb");
+        loaded = fptr != NULL && readBitmapStream(fptr, &server->bitmap);
+        if (fptr != NULL) fclose(fptr);
+        if (!loaded) snprintf(reply->error, sizeof(reply->error), "Cannot load %.200s", request.path);
+    }
+    if (imageFd >= 0) close(imageFd);
+    if (!loaded) return -1;
+    struct SpecPlan *plan = getServerPlan(server, request.spec, (int) server->bitmap.dipHeader.imageWidth,
+                                          (int) server->bitmap.dipHeader.imageHeight,
+                                          reply->error, sizeof(reply->error));
+    int outWidth, outHeight;
+    if (plan == NULL) return -1;
+    if (!processBitmap(plan, &server->bitmap, &server->result, &server->resultCapacity, &outWidth, &outHeight)) {
+        snprintf(reply->error, sizeof(reply->error), "%s", plan->error);
+        return -1;
+    }
+
+    // The result goes back as a bitmap file in a new shared memory object
+    size_t size = bitmapFileSize(outWidth, outHeight);
+    uint8_t *data;
+    int fd = createSharedBuffer(size, &data);
+    if (fd < 0) {
+        snprintf(reply->error, sizeof(reply->error), "Cannot allocate the shared result");
+        return -1;
+    }
+    storeBitmapFile(data, &server->bitmap, outWidth, outHeight, server->result);
+    munmap(data, size);
+    reply->status = DIP_OK;
+    reply->size = size;
+    return fd;
+}
+
+void *serverMain(void *argument) {
+    struct DipServer *server = argument;
+    int connection;
+    while ((connection = popConnection(&server->queue)) >= 0) {
+        struct DipReply reply = {.status = DIP_FAILED};
+        struct TraceSpan span = traceBegin("request");
+        int fd = runRequest(server, connection, &reply);
+        traceEnd(&span);
+        sendMessage(connection, &reply, sizeof(reply), fd);
+        if (fd >= 0) close(fd);
+        close(connection);
+        if (reply.status == DIP_OK) {
+            server->served++;
+        } else {
+            server->failed++;
+        }
+    }
+    return NULL;
+}
+
+void stopServer(int signal) {
+    dipStop = 1;
+    (void) signal;
+}
+
+int serveMain(struct DipOptions *options) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(options->serve) >= sizeof(address.sun_path) || options->queue < 1 || options->queue > DIP_MAX_QUEUE) {
+        fprintf(stderr, "Invalid server settings!\n");
+        exit(1);
+    }
+    strcpy(address.sun_path, options->serve);
+    setFFTThreads(options->threads);
+    setParallelThreads(options->threads);
+    setPipelineThreads(options->threads);
+
+    // A socket left by a server which did not stop cleanly is replaced
+    struct stat status;
+    if (stat(options->serve, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(options->serve);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, options->queue) != 0) {
+        fprintf(stderr, "Cannot listen on %s!\n", options->serve);
+        exit(1);
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct DipServer *server = calloc(1, sizeof(struct DipServer));
+    if (server == NULL) {
+        fprintf(stderr, "Cannot allocate the server!\n");
+        exit(1);
+    }
+    server->queue.capacity = options->queue;
+    pthread_mutex_init(&server->queue.lock, NULL);
+    pthread_cond_init(&server->queue.ready, NULL);
+    server->pool = createImagePool(0);
+
+    // The signals are left to this thread, so that they interrupt accept()
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serverMain, server) != 0) {
+        fprintf(stderr, "Cannot start the server thread!\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    printf("Serving %s, %d threads, queue of %d\n", options->serve, options->threads, options->queue);
+    fflush(stdout);
+
+    struct timeval timeout = {DIP_TIMEOUT, 0};
+    while (!dipStop) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Cannot accept on %s!\n", options->serve);
+            break;
+        }
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (!pushConnection(&server->queue, connection)) {
+            struct DipReply reply = {.status = DIP_BUSY};
+            snprintf(reply.error, sizeof(reply.error), "Server busy");
+            sendMessage(connection, &reply, sizeof(reply), -1);
+            close(connection);
+            server->busy++;
+        }
+    }
+    close(listener);
+    unlink(options->serve);
+
+    pthread_mutex_lock(&server->queue.lock);
+    server->queue.closed = 1;
+    pthread_cond_broadcast(&server->queue.ready);
+    pthread_mutex_unlock(&server->queue.lock);
+    pthread_join(thread, NULL);
+    printf("Served %lu requests, %lu failed, %lu busy, %lu plans made\n",
+           server->served, server->failed, server->busy, server->planMisses);
+    poolReport(server->pool, stdout, "Server");
+
+    for (int i = 0; i < DIP_PLAN_CACHE; i++) {
+        destroySpecPlan(server->plans[i].plan);
+    }
+    destroyImagePool(server->pool);
+    pthread_mutex_destroy(&server->queue.lock);
+    pthread_cond_destroy(&server->queue.ready);
+    free(server->bitmap.imageData);
+    free(server->result);
+    free(server);
+    freeFFTPlanCache();
+    freeRemapCache();
+    freeDistanceMaps();
+    return 0;
+}
+
+// Client
+
+// The bitmap file of input in a shared memory object, returns its descriptor or -1
+int shareBitmapFile(const char *input, uint64_t *size) {
+    FILE *fptr = fopen(input, "rb");
+    struct stat status;
+    if (fptr == NULL || fstat(fileno(fptr), &status) != 0 || status.st_size == 0) {
+        if (fptr != NULL) fclose(fptr);
+        return -1;
+    }
+    uint8_t *data;
+    *size = (uint64_t) status.st_size;
+    int fd = createSharedBuffer(*size, &data);
+    if (fd >= 0) {
+        if (fread(data, *size, 1, fptr) != 1) {
+            close(fd);
+            fd = -1;
+        }
+        munmap(data, *size);
+    }
+    fclose(fptr);
+    return fd;
+}
+
+// One request, retried while the server is busy. Returns the descriptor of the result or -1
+int requestImage(const char *socketPath, const struct DipRequest *request, int imageFd, struct DipReply *reply) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    useconds_t pause = 10000;
+    for (int attempt = 0; attempt <= DIP_RETRIES; attempt++, pause *= 2) {
+        memset(reply, 0, sizeof(struct DipReply));
+        int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connection < 0 || connect(connection, (struct sockaddr *) &address, sizeof(address)) != 0) {
+            fprintf(stderr, "Cannot connect to %s!\n", socketPath);
+            exit(1);
+        }
+        // A busy server replies without reading the request, so the send may fail while the reply is there
+        int fd = -1;
+        int sent = sendMessage(connection, request, sizeof(struct DipRequest), imageFd);
+        if (!receiveMessage(connection, reply, sizeof(struct DipReply), &fd) || (!sent && reply->status != DIP_BUSY)) {
+            reply->status = DIP_FAILED;
+            snprintf(reply->error, sizeof(reply->error), "The server closed the connection");
+        }
+        close(connection);
+        reply->error[sizeof(reply->error) - 1] = '\0';
+        if (reply->status != DIP_BUSY) {
+            if (reply->status != DIP_OK && fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            return fd;
+        }
+        if (fd >= 0) close(fd);
+        usleep(pause);
+    }
+    return -1;
+}
+
+int clientMain(struct DipOptions *options) {
+    struct DipRequest request = {.magic = DIP_MAGIC};
+    if (strlen(options->spec) >= DIP_SPEC_SIZE) {
+        fprintf(stderr, "The spec is too long!\n");
+        exit(1);
+    }
+    strcpy(request.spec, options->spec);
+    signal(SIGPIPE, SIG_IGN);
+    int failures = 0;
+    double start = dipClock();
+    for (size_t k = 0; k < options->inputs.gl_pathc; k++) {
+        const char *input = options->inputs.gl_pathv[k];
+        char name[DIP_PATH_SIZE];
+        int imageFd = -1;
+        request.hasImage = (uint32_t) options->shm;
+        if (options->shm && (imageFd = shareBitmapFile(input, &request.imageSize)) < 0) {
+            fprintf(stderr, "Cannot share %s!\n", input);
+            failures++;
+            continue;
+        }
+        // The server has its own working directory
+        if (!options->shm && realpath(input, request.path) == NULL) {
+            fprintf(stderr, "Cannot open %s!\n", input);
+            failures++;
+            continue;
+        }
+
+        struct DipReply reply;
+        int fd = requestImage(options->connect, &request, imageFd, &reply);
+        if (imageFd >= 0) close(imageFd);
+        if (fd < 0) {
+            fprintf(stderr, "Cannot process %s: %s!\n", input, reply.error);
+            failures++;
+            continue;
+        }
+        uint8_t *data = mapSharedBuffer(fd, reply.size);
+        outputName(name, sizeof(name), options->output, input);
+        FILE *fptr = data != NULL ? fopen(name, "wb") : NULL;
+        int ok = fptr != NULL && fwrite(data, reply.size, 1, fptr) == 1;
+        ok = fptr != NULL && fclose(fptr) == 0 && ok;
+        if (!ok) {
+            fprintf(stderr, "Cannot write %s!\n", name);
+            failures++;
+        }
+        if (data != NULL) munmap(data, reply.size);
+        close(fd);
+    }
+    double elapsed = dipClock() - start;
+    printf("%zu images in %.1f ms, %d failed\n", options->inputs.gl_pathc, elapsed * 1000, failures);
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    struct DipOptions options = {.threads = 1, .queue = 16};
+    int patterns = 0, usage = 0;
+    for (int i = 1; i < argc && !usage; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-threads") == 0) {
+            options.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-plan") == 0) {
+            options.showPlan = 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "-queue") == 0) {
+            options.queue = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-shm") == 0) {
+            options.shm = 1;
+        } else if (i + 1 < argc && strcmp(argv[i], "-o") == 0) {
+            options.output = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-serve") == 0) {
+            options.serve = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-connect") == 0) {
+            options.connect = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage = 1;
+        } else if (options.spec == NULL) {
+            options.spec = argv[i];
+        } else if (glob(argv[i], patterns++ > 0 ? GLOB_APPEND : 0, NULL, &options.inputs) == GLOB_NOMATCH) {
+            fprintf(stderr, "No input matches %s!\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (usage || (options.serve == NULL && (options.output == NULL || options.spec == NULL || patterns == 0)) ||
+        (options.serve != NULL && (options.spec != NULL || options.connect != NULL))) {
+        fprintf(stderr, "Usage: %s [-threads 1] [-plan] -o output spec input...\n"
+                        "       %s -serve socket [-threads 1] [-queue 16]\n"
+                        "       %s -connect socket [-shm] -o output spec input...\n", argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+    if (options.threads < 1) {
+        fprintf(stderr, "Invalid number of threads!\n");
+        exit(1);
+    }
+    if (options.serve != NULL) {
+        return serveMain(&options);
+    }
+    if (strchr(options.output, '*') == NULL && options.inputs.gl_pathc > 1) {
+        fprintf(stderr, "Several inputs need a * in the output!\n");
+        exit(1);
+    }
+    // Checked here as well, so a bad spec stops the client before the first request
+    struct Spec spec;
+    if (!parseSpec(&spec, options.spec)) {
+        fprintf(stderr, "Invalid spec: %s!\n", spec.error);
+        exit(1);
+    }
+    int status = options.connect != NULL ? clientMain(&options) : batchMain(&options, &spec);
+    globfree(&options.inputs);
+    return status;
+}
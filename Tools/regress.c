@@ -0,0 +1,882 @@
+/*
+ * Digital Image Processing
+ * Regression checks of the outputs of the programs and of the variants of the kernels
+ *
+ * Note:
+ * Build like benchmark.c, with fft.h on the include path:
+ * gcc -O2 regress.c -o regress -lm -pthread
+ * Usage: regress compare result.bmp expected.bmp [-maxabs 0] [-psnr 0] [-border 0]
+ *        regress variants [-size 512] [-threads 4] [-check name]
+ * compare checks a bitmap written by a program against the expected one checked in next to it.
+ * Only the pixels and the color table count, not the padding at the end of the rows, which the
+ * programs leave uninitialized. Every pixel must be equal unless a tolerance is given for a float
+ * path: -maxabs n lets a pixel differ by n gray levels, -psnr db asks for a PSNR of at least db
+ * over the whole image, and -border n leaves out the n pixels next to the edges.
+ * variants runs every fast kernel of Common against a plain reference: the SIMD paths against a
+ * scalar loop of the same formula, the FFT plans against the FFT2D of fft.h or a direct DFT, and
+ * every multithreaded, tiled or out-of-core run against the same kernel on one thread. Integer
+ * kernels must match exactly; float kernels within a bound relative to the largest reference
+ * value. The template matcher and the registration are checked against a known answer instead:
+ * templates pasted into the scene must be found at their corners with an NCC of 1, and a frame
+ * shifted, or turned, scaled and shifted, must give back those parameters. The SIMD paths are
+ * chosen at compile time, so regress.sh builds this file once per instruction set. The images
+ * are synthetic, of odd sizes so that the edges of the blocks and tiles are covered.
+ * Prints one line per comparison and exits with 1 when one of them fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "fft.h"
+#include "../Common/rotate.h"
+#include "../Common/layout.h"
+#include "../Common/remap.h"
+#include "../Common/pipeline.h"
+#include "../Common/convolve.h"
+#include "../Common/rfft.h"
+#include "../Common/fftsplit.h"
+#include "../Common/fftdisk.h"
+#include "../Common/match.h"
+#include "../Common/registration.h"
+
+struct BitmapHeader {
+    char format[2];
+    unsigned int fileSize;
+    __attribute__((unused)) unsigned int reserved;
+    unsigned int offset;
+};
+
+struct DipHeader {
+    unsigned int headerSize;
+    unsigned int imageWidth;
+    unsigned int imageHeight;
+    unsigned short int colorPlanes;
+    unsigned short int colorDepth;
+    unsigned int compression;
+    unsigned int imageSize;
+    int xPixelPerMeter;
+    int yPixelPerMeter;
+    unsigned int colorCount;
+    unsigned int importantColorCount;
+};
+
+struct Variants {
+    int size;
+    int threads;
+    int failures;
+};
+
+// Like readBitmap() of the programs, without printing the headers
+void readPixels(const char *filename, struct DipHeader *dipHeader, uint8_t *colorTable, uint8_t **imageData) {
+    struct BitmapHeader bitmapHeader;
+    FILE *fptr = fopen(filename, "rb");
+    if (fptr == NULL) {
+        fprintf(stderr, "Cannot open %s!\n", filename);
+        exit(1);
+    }
+    fread(bitmapHeader.format, 2, 1, fptr);
+    fread(&bitmapHeader.fileSize, 3 * sizeof(unsigned int), 1, fptr);
+    fread(dipHeader, sizeof(struct DipHeader), 1, fptr);
+    if (bitmapHeader.format[0] != 'B' || bitmapHeader.format[1] != 'M' || dipHeader->headerSize != 40 ||
+        dipHeader->compression != 0 || dipHeader->colorDepth != 8) {
+        fprintf(stderr, "Cannot load %s!\n", filename);
+        fclose(fptr);
+        exit(1);
+    }
+    dipHeader->imageSize = (dipHeader->imageWidth * 8 + 31) / 32 * 4 * dipHeader->imageHeight;
+    fread(colorTable, 1024, 1, fptr);
+    fseek(fptr, (long) bitmapHeader.offset, SEEK_SET);
+    *imageData = calloc(dipHeader->imageSize, 1);
+    if (*imageData == NULL || fread(*imageData, dipHeader->imageSize, 1, fptr) != 1) {
+        fprintf(stderr, "Cannot load %s!\n", filename);
+        fclose(fptr);
+        exit(1);
+    }
+    fclose(fptr);
+}
+
+int compareMain(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s compare result.bmp expected.bmp [-maxabs 0] [-psnr 0] [-border 0]\n", argv[0]);
+        exit(1);
+    }
+    int maxAbsLimit = -1, border = 0;
+    double psnrLimit = 0;
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-maxabs") == 0) {
+            maxAbsLimit = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-psnr") == 0) {
+            psnrLimit = atof(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-border") == 0) {
+            border = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s compare result.bmp expected.bmp [-maxabs 0] [-psnr 0] [-border 0]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (maxAbsLimit < 0 && psnrLimit <= 0) {
+        maxAbsLimit = 0;
+    }
+
+    struct DipHeader result, expected;
+    uint8_t resultColors[1024], expectedColors[1024];
+    uint8_t *resultData, *expectedData;
+    readPixels(argv[2], &result, resultColors, &resultData);
+    readPixels(argv[3], &expected, expectedColors, &expectedData);
+    if (result.imageWidth != expected.imageWidth || result.imageHeight != expected.imageHeight) {
+        printf("%s: FAIL, %u x %u instead of %u x %u\n", argv[2], result.imageWidth, result.imageHeight,
+               expected.imageWidth, expected.imageHeight);
+        return 1;
+    }
+    if (memcmp(resultColors, expectedColors, 1024) != 0) {
+        printf("%s: FAIL, the color table differs\n", argv[2]);
+        return 1;
+    }
+
+    int width = (int) result.imageWidth, height = (int) result.imageHeight;
+    int stride = (width * 8 + 31) / 32 * 4;
+    int maxAbs = 0;
+    long differing = 0, count = 0;
+    double squares = 0;
+    for (int y = border; y < height - border; y++) {
+        for (int x = border; x < width - border; x++) {
+            int d = abs(resultData[y * stride + x] - expectedData[y * stride + x]);
+            maxAbs = d > maxAbs ? d : maxAbs;
+            differing += d != 0;
+            squares += (double) d * d;
+            count++;
+        }
+    }
+    double psnr = squares == 0 ? INFINITY : 10 * log10(255.0 * 255.0 * count / squares);
+    int ok = (maxAbsLimit < 0 || maxAbs <= maxAbsLimit) && (psnrLimit <= 0 || psnr >= psnrLimit);
+    printf("%s: %s, %ld of %ld pixels differ, max |diff| %d, PSNR %.2f dB\n", argv[2], ok ? "ok" : "FAIL",
+           differing, count, maxAbs, psnr);
+    free(resultData);
+    free(expectedData);
+    return ok ? 0 : 1;
+}
+
+// Same pixel for the same (x, y) on every run, like benchPixel() of benchmark.c
+uint8_t variantPixel(int x, int y) {
+    uint32_t h = (uint32_t) x * 0x9E3779B1u ^ (uint32_t) y * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 13;
+    double value = 128 + 60 * sin(x * 0.05) * cos(y * 0.07) + (int) (h & 63) - 32;
+    return (uint8_t) (value < 0 ? 0 : (value > 255 ? 255 : value));
+}
+
+void *variantAllocate(size_t size) {
+    void *buffer = calloc(size, 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Cannot allocate the test images!\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+uint8_t *variantImage(int width, int height, int stride) {
+    uint8_t *image = variantAllocate((size_t) stride * height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            image[(size_t) y * stride + x] = variantPixel(x, y);
+        }
+    }
+    return image;
+}
+
+// One thread, then v->threads, then 0 to stop
+int nextThreads(const struct Variants *v, int threads) {
+    return threads == 1 && v->threads > 1 ? v->threads : 0;
+}
+
+// width x height pixels, rows stride bytes apart in both
+void reportBytes(struct Variants *v, const char *check, const char *variant, const uint8_t *a, const uint8_t *b,
+                 int width, int height, int stride) {
+    int maxAbs = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int d = abs(a[(size_t) y * stride + x] - b[(size_t) y * stride + x]);
+            maxAbs = d > maxAbs ? d : maxAbs;
+        }
+    }
+    printf("%-10s %-36s max |diff| %-10d %s\n", check, variant, maxAbs, maxAbs == 0 ? "ok" : "FAIL");
+    v->failures += maxAbs != 0;
+}
+
+// |a - b| <= tolerance * max |b| for all count values
+void reportDoubles(struct Variants *v, const char *check, const char *variant, const double *a, const double *b,
+                   size_t count, double tolerance) {
+    double maxAbs = 0, scale = 0;
+    for (size_t i = 0; i < count; i++) {
+        double d = fabs(a[i] - b[i]);
+        maxAbs = d > maxAbs || d != d ? d : maxAbs;
+        scale = fabs(b[i]) > scale ? fabs(b[i]) : scale;
+    }
+    int ok = maxAbs <= tolerance * scale;
+    printf("%-10s %-36s max |diff| %-10.3g %s\n", check, variant, maxAbs, ok ? "ok" : "FAIL");
+    v->failures += !ok;
+}
+
+// |error| <= tolerance, for the checks against a known answer instead of a reference run
+void reportError(struct Variants *v, const char *check, const char *variant, double error, double tolerance) {
+    int ok = error <= tolerance;
+    printf("%-10s %-36s max |diff| %-10.3g %s\n", check, variant, error, ok ? "ok" : "FAIL");
+    v->failures += !ok;
+}
+
+void checkRotate(struct Variants *v) {
+    int width = v->size + 5, height = v->size - 3;
+    int srcStride = (width + 3) / 4 * 4, dstStride = (height + 3) / 4 * 4;
+    uint8_t *src = variantImage(width, height, srcStride);
+    uint8_t *dst = variantAllocate((size_t) dstStride * width);
+    uint8_t *expected = variantAllocate((size_t) dstStride * width);
+
+    for (int kind = 0; kind < 3; kind++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint8_t p = src[(size_t) y * srcStride + x];
+                if (kind == 0) expected[(size_t) x * dstStride + y] = p;
+                if (kind == 1) expected[(size_t) x * dstStride + (height - 1 - y)] = p;
+                if (kind == 2) expected[(size_t) (width - 1 - x) * dstStride + y] = p;
+            }
+        }
+        const char *names[] = {"transpose", "rotate90", "rotate270"};
+        if (kind == 0) transpose(src, srcStride, dst, dstStride, width, height);
+        if (kind == 1) rotate90(src, srcStride, dst, dstStride, width, height);
+        if (kind == 2) rotate270(src, srcStride, dst, dstStride, width, height);
+        reportBytes(v, "rotate", names[kind], dst, expected, height, width, dstStride);
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            expected[(size_t) (height - 1 - y) * srcStride + (width - 1 - x)] = src[(size_t) y * srcStride + x];
+        }
+    }
+    rotate180(src, srcStride, src, srcStride, width, height);
+    reportBytes(v, "rotate", "rotate180 in place", src, expected, width, height, srcStride);
+
+    // Square, in place
+    int size = height;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            src[(size_t) y * srcStride + x] = variantPixel(x, y);
+            expected[(size_t) x * srcStride + (size - 1 - y)] = variantPixel(x, y);
+        }
+    }
+    rotate90InPlace(src, srcStride, size);
+    reportBytes(v, "rotate", "rotate90 in place", src, expected, size, size, srcStride);
+    free(src);
+    free(dst);
+    free(expected);
+}
+
+// The rows of src with the edge pixels replicated, then stencil applied to every row
+void stencilImage(const uint8_t *src, uint8_t *dst, int width, int height, int stride, PipelineStencil stencil) {
+    struct Image *image = createImage(width, height, 1, NULL);
+    loadImage(image, src, stride);
+    fillHalo(image, HALO_REPLICATE, 0);
+    for (int y = 0; y < height; y++) {
+        stencil(imageRow(image, y - 1), imageRow(image, y), imageRow(image, y + 1), dst + (size_t) y * stride, width);
+    }
+    destroyImage(image);
+}
+
+void checkLayout(struct Variants *v) {
+    int width = v->size + 37, height = v->size - 21, stride = (width + 3) / 4 * 4;
+    uint8_t *src = variantImage(width, height, stride);
+    uint8_t *dst = variantAllocate((size_t) stride * height);
+    uint8_t *expected = variantAllocate((size_t) stride * height);
+    struct LayoutRotation rotation = {-30, width / 2, height / 3, 7};
+
+    // The loop of the rotation programs of Assignment-4
+    double radian = rotation.degree * acos(-1) / 180, c = cos(radian), s = sin(radian);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int originX = x - rotation.originX, originY = y - rotation.originY;
+            int srcX = (int) (originX * c - originY * s) + rotation.originX;
+            int srcY = (int) (originX * s + originY * c) + rotation.originY;
+            int inside = srcX >= 0 && srcX < width && srcY >= 0 && srcY < height;
+            expected[(size_t) y * stride + x] = inside ? src[(size_t) srcY * stride + srcX] : rotation.background;
+        }
+    }
+
+    const char *names[] = {"scanline", "tiled", "Morton"};
+    enum ImageLayout layouts[] = {LAYOUT_SCANLINE, LAYOUT_TILED, LAYOUT_MORTON};
+    for (int i = 0; i < 3; i++) {
+        for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+            char variant[64];
+            snprintf(variant, sizeof(variant), "rotateLayout %s, threads %d", names[i], threads);
+            struct LayoutKernel kernel = {layouts[i], rotateLayout};
+            setParallelThreads(threads);
+            memset(dst, 0, (size_t) stride * height);
+            runLayoutKernel(&kernel, src, dst, width, height, stride, &rotation);
+            reportBytes(v, "layout", variant, dst, expected, width, height, stride);
+        }
+    }
+
+    // The Sobel stencil of the pipeline, on the bitmap order of the programs
+    stencilImage(src, expected, width, height, stride, sobelRow);
+    size_t top = (size_t) (height - 1) * stride;
+    for (int i = 0; i < 3; i++) {
+        for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+            char variant[64];
+            snprintf(variant, sizeof(variant), "sobelLayout %s, threads %d", names[i], threads);
+            struct LayoutKernel kernel = {layouts[i], sobelLayout};
+            setParallelThreads(threads);
+            memset(dst, 0, (size_t) stride * height);
+            runLayoutKernel(&kernel, src + top, dst + top, width, height, -stride, NULL);
+            reportBytes(v, "layout", variant, dst, expected, width, height, stride);
+        }
+    }
+    setParallelThreads(1);
+    free(src);
+    free(dst);
+    free(expected);
+}
+
+void checkRemap(struct Variants *v) {
+    int width = v->size + 11, height = v->size + 3, stride = (width + 3) / 4 * 4;
+    uint8_t *src = variantImage(width, height, stride);
+    uint8_t *expected = variantAllocate((size_t) stride * height);
+    uint8_t *dst = variantAllocate((size_t) stride * height);
+    const char *names[] = {"nearest", "bilinear"};
+    for (int i = 0; i < 2; i++) {
+        enum RemapInterpolation interpolation = i ? REMAP_BILINEAR : REMAP_NEAREST;
+        struct RemapTransform transform = rotationTransform(17, width / 2, height / 2, interpolation);
+        setParallelThreads(1);
+        remap(&transform, src, expected, width, height, stride, 0);
+        // Small tiles of odd sizes, so that many tiles end inside a row
+        setParallelThreads(v->threads);
+        setParallelTileSize(37, 5);
+        remap(&transform, src, dst, width, height, stride, 0);
+        setParallelTileSize(256, 64);
+        char variant[64];
+        snprintf(variant, sizeof(variant), "%s, threads %d, 37 x 5 tiles", names[i], v->threads);
+        reportBytes(v, "remap", variant, dst, expected, width, height, stride);
+    }
+    setParallelThreads(1);
+    freeRemapCache();
+    free(src);
+    free(expected);
+    free(dst);
+}
+
+void checkPipeline(struct Variants *v) {
+    int width = v->size + 29, height = v->size + 13, stride = (width + 3) / 4 * 4;
+    size_t size = (size_t) stride * height;
+    uint8_t *src = variantImage(width, height, stride);
+    uint8_t *sharpened = variantAllocate(size), *edges = variantAllocate(size), *blurred = variantAllocate(size);
+    uint8_t *expected = variantAllocate(size), *dst = variantAllocate(size);
+    uint8_t table[256];
+    powerLawTable(table, 0.5);
+
+    // One operation after the other on whole images: p3f, the power law of p3h, and p3g
+    stencilImage(src, sharpened, width, height, stride, sharpenRow);
+    stencilImage(src, edges, width, height, stride, sobelRow);
+    stencilImage(edges, blurred, width, height, stride, boxRow);
+    for (int y = 0; y < height; y++) {
+        size_t row = (size_t) y * stride;
+        multiplyRows(sharpened + row, blurred + row, expected + row, width);
+        for (int x = 0; x < width; x++) {
+            expected[row + x] = table[expected[row + x]];
+        }
+        addRows(expected + row, src + row, expected + row, width);
+    }
+
+    struct Pipeline *pipeline = createPipeline(width, height, NULL);
+    int image = pipelineInput(pipeline);
+    int c = pipelineStencil(pipeline, image, sharpenRow);
+    int blur = pipelineStencil(pipeline, pipelineStencil(pipeline, image, sobelRow), boxRow);
+    int sum = pipelineCombine(pipeline, pipelineMap(pipeline, pipelineCombine(pipeline, c, blur, multiplyRows), table),
+                              image, addRows);
+    const uint8_t *inputs[] = {src};
+    int tiles[][2] = {{256, 64}, {37, 5}};
+    for (int i = 0; i < 2; i++) {
+        for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+            char variant[64];
+            snprintf(variant, sizeof(variant), "fused, threads %d, %d x %d tiles", threads, tiles[i][0], tiles[i][1]);
+            setPipelineThreads(threads);
+            setParallelTileSize(tiles[i][0], tiles[i][1]);
+            memset(dst, 0, size);
+            runPipeline(pipeline, inputs, stride, sum, dst);
+            reportBytes(v, "pipeline", variant, dst, expected, width, height, stride);
+        }
+    }
+    setPipelineThreads(1);
+    setParallelTileSize(256, 64);
+    destroyPipeline(pipeline);
+    free(src);
+    free(sharpened);
+    free(edges);
+    free(blurred);
+    free(expected);
+    free(dst);
+}
+
+void checkConvolve(struct Variants *v) {
+    int width = v->size + 7, height = v->size / 2 + 9;
+    size_t count = (size_t) width * height;
+    double *src = variantAllocate(count * sizeof(double));
+    double *expected = variantAllocate(count * sizeof(double)), *dst = variantAllocate(count * sizeof(double));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            src[(size_t) y * width + x] = variantPixel(x, y);
+        }
+    }
+    // A dense 7 x 5 kernel and a sparse 3 x 3 one, which skips its zero taps
+    double dense[35], sparse[9] = {0, -1, 0, -1, 5, -1, 0, -1, 0};
+    for (int i = 0; i < 35; i++) {
+        dense[i] = (variantPixel(i, 35) - 128) / 512.0;
+    }
+    struct ConvolveKernel kernels[] = {{7, 5, dense}, {3, 3, sparse}};
+    const char *methods[] = {"", "direct", "FFT"};
+    const char *borders[] = {"zero", "replicate"};
+
+    for (int k = 0; k < 2; k++) {
+        const struct ConvolveKernel *kernel = &kernels[k];
+        for (enum ConvolveBorder border = CONVOLVE_ZERO; border <= CONVOLVE_REPLICATE; border++) {
+            int ax = kernel->width / 2, ay = kernel->height / 2;
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    double sum = 0;
+                    for (int j = 0; j < kernel->height; j++) {
+                        for (int i = 0; i < kernel->width; i++) {
+                            sum += kernel->weights[j * kernel->width + i] *
+                                   convolveSample(src, width, height, x + i - ax, y + j - ay, border);
+                        }
+                    }
+                    expected[(size_t) y * width + x] = sum;
+                }
+            }
+            for (enum ConvolveMethod method = CONVOLVE_DIRECT; method <= CONVOLVE_FFT; method++) {
+                for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+                    char variant[64];
+                    snprintf(variant, sizeof(variant), "%d x %d %s %s, threads %d", kernel->width, kernel->height,
+                             borders[border], methods[method], threads);
+                    setConvolveThreads(threads);
+                    convolve(src, dst, width, height, kernel, border, method);
+                    reportDoubles(v, "convolve", variant, dst, expected, count, 1e-12);
+                }
+            }
+        }
+    }
+    setConvolveThreads(1);
+    free(src);
+    free(expected);
+    free(dst);
+}
+
+// Forward DFT of height rows of width values, divided by width * height like FFT2D
+void directDFT(const COMPLEX *src, COMPLEX *dst, int width, int height) {
+    double pi = acos(-1);
+    for (int v = 0; v < height; v++) {
+        for (int u = 0; u < width; u++) {
+            double real = 0, imag = 0;
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    double angle = -2 * pi * ((double) u * x / width + (double) v * y / height);
+                    const COMPLEX *p = &src[y * width + x];
+                    real += p->real * cos(angle) - p->imag * sin(angle);
+                    imag += p->real * sin(angle) + p->imag * cos(angle);
+                }
+            }
+            dst[v * width + u].real = real / (width * height);
+            dst[v * width + u].imag = imag / (width * height);
+        }
+    }
+}
+
+COMPLEX *variantSpectrum(int width, int height) {
+    COMPLEX *c = variantAllocate((size_t) width * height * sizeof(COMPLEX));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            c[(size_t) y * width + x].real = variantPixel(x, y);
+        }
+    }
+    return c;
+}
+
+void checkFFT(struct Variants *v) {
+    // Powers of 2 against FFT2D of fft.h
+    int width = v->size, height = v->size / 2;
+    size_t count = (size_t) width * height;
+    COMPLEX *expected = variantSpectrum(width, height), *c = variantAllocate(count * sizeof(COMPLEX));
+    FFT2D(expected, height, width, 1);
+    for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+        char variant[64];
+        setFFTThreads(threads);
+        COMPLEX *image = variantSpectrum(width, height);
+        memcpy(c, image, count * sizeof(COMPLEX));
+        PlannedFFT2D(c, height, width, 1);
+        snprintf(variant, sizeof(variant), "complex %d x %d, threads %d", width, height, threads);
+        reportDoubles(v, "fft", variant, (double *) c, (double *) expected, 2 * count, 1e-12);
+        PlannedFFT2D(c, height, width, -1);
+        snprintf(variant, sizeof(variant), "complex inverse, threads %d", threads);
+        reportDoubles(v, "fft", variant, (double *) c, (double *) image, 2 * count, 1e-12);
+
+        // The half spectrum against the columns 0 to width / 2 of the full one
+        int hw = halfSpectrumWidth(width);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                realRow(c, y, width)[x] = image[(size_t) y * width + x].real;
+            }
+        }
+        RFFT2D(c, height, width, 1);
+        for (int y = 0; y < height; y++) {
+            memcpy(image + (size_t) y * hw, expected + (size_t) y * width, hw * sizeof(COMPLEX));
+        }
+        snprintf(variant, sizeof(variant), "real %d x %d, threads %d", width, height, threads);
+        reportDoubles(v, "fft", variant, (double *) c, (double *) image, 2 * (size_t) height * hw, 1e-12);
+        free(image);
+    }
+    free(expected);
+    free(c);
+
+    // Mixed radix and Bluestein against a direct DFT
+    int sizes[][2] = {{30, 18}, {17, 22}};
+    for (int i = 0; i < 2; i++) {
+        width = sizes[i][0], height = sizes[i][1], count = (size_t) width * height;
+        COMPLEX *image = variantSpectrum(width, height);
+        expected = variantAllocate(count * sizeof(COMPLEX));
+        directDFT(image, expected, width, height);
+        for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+            char variant[64];
+            setFFTThreads(threads);
+            c = variantSpectrum(width, height);
+            PlannedFFT2D(c, height, width, 1);
+            snprintf(variant, sizeof(variant), "complex %d x %d, threads %d", width, height, threads);
+            reportDoubles(v, "fft", variant, (double *) c, (double *) expected, 2 * count, 1e-12);
+            free(c);
+        }
+        free(image);
+        free(expected);
+    }
+    setFFTThreads(1);
+    freeFFTPlanCache();
+
+    // A 62 x 31 plan saved under the name of the 30 x 18 one must be rebuilt, not run on the smaller buffer
+    char *directory = getenv("DIP_FFT_PLAN_DIR") != NULL ? strdup(getenv("DIP_FFT_PLAN_DIR")) : NULL;
+    char path[1024];
+    width = 30, height = 18, count = (size_t) width * height;
+    setenv("DIP_FFT_PLAN_DIR", ".", 1);
+    fftPlanPath(path, sizeof(path), ".", FFT_PLAN_REAL, width, height, 1);
+    struct FFTPlan *stale = createFFTPlan(FFT_PLAN_REAL, 62, 31, 1);
+    saveFFTPlan(stale, path);
+    destroyFFTPlan(stale);
+    COMPLEX *image = variantSpectrum(width, height);
+    int hw = halfSpectrumWidth(width);
+    expected = variantAllocate(count * sizeof(COMPLEX));
+    c = variantAllocate(count * sizeof(COMPLEX));
+    directDFT(image, expected, width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            realRow(c, y, width)[x] = image[(size_t) y * width + x].real;
+        }
+        memcpy(image + (size_t) y * hw, expected + (size_t) y * width, hw * sizeof(COMPLEX));
+    }
+    RFFT2D(c, height, width, 1);
+    reportDoubles(v, "fft", "stale plan file, real 30 x 18", (double *) c, (double *) image,
+                  2 * (size_t) height * hw, 1e-12);
+    freeFFTPlanCache();
+    struct FFTPlan *saved = loadFFTPlan(path, FFT_PLAN_REAL, width, height, 1);
+    reportError(v, "fft", "stale plan file rewritten", saved == NULL, 0);
+    if (saved != NULL) {
+        destroyFFTPlan(saved);
+    }
+    remove(path);
+    if (directory != NULL) {
+        setenv("DIP_FFT_PLAN_DIR", directory, 1);
+    } else {
+        unsetenv("DIP_FFT_PLAN_DIR");
+    }
+    free(directory);
+    free(image);
+    free(expected);
+    free(c);
+}
+
+void checkSplitFFT(struct Variants *v) {
+    int width = v->size, height = v->size / 2;
+    size_t count = (size_t) width * height;
+    COMPLEX *expected = variantSpectrum(width, height);
+    PlannedFFT2D(expected, height, width, 1);
+    float *real = allocateSplitPlane(count), *imag = allocateSplitPlane(count);
+    double *c = variantAllocate(2 * count * sizeof(double));
+    struct SplitFFTPlan *plan = createSplitFFTPlan(width, height, 1);
+    for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+        for (size_t i = 0; i < count; i++) {
+            real[i] = variantPixel((int) (i % width), (int) (i / width));
+            imag[i] = 0;
+        }
+        setSplitFFTPlanThreads(plan, threads);
+        executeSplitFFTPlan(plan, real, imag);
+        for (size_t i = 0; i < count; i++) {
+            c[2 * i] = real[i];
+            c[2 * i + 1] = imag[i];
+        }
+        // Single precision, see the accuracy in the note of fftsplit.h
+        char variant[64];
+        snprintf(variant, sizeof(variant), "float %d x %d, threads %d", width, height, threads);
+        reportDoubles(v, "fftsplit", variant, c, (double *) expected, 2 * count, 1e-5);
+    }
+    destroySplitFFTPlan(plan);
+    freeSplitPlane(real);
+    freeSplitPlane(imag);
+    free(expected);
+    free(c);
+    freeFFTPlanCache();
+}
+
+struct DiskImage {
+    int width;
+    double *pixels;
+};
+
+void diskRead(int y, double *row, void *context) {
+    const struct DiskImage *image = context;
+    memcpy(row, image->pixels + (size_t) y * image->width, image->width * sizeof(double));
+}
+
+void diskWrite(int y, const double *row, void *context) {
+    const struct DiskImage *image = context;
+    memcpy(image->pixels + (size_t) y * image->width, row, image->width * sizeof(double));
+}
+
+void checkDiskFFT(struct Variants *v) {
+    int width = v->size + 2, height = v->size / 2 + 3, hw = halfSpectrumWidth(width);
+    size_t count = (size_t) width * height;
+    COMPLEX *expected = variantAllocate((size_t) height * hw * sizeof(COMPLEX));
+    double *image = variantAllocate(count * sizeof(double)), *result = variantAllocate(count * sizeof(double));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            image[(size_t) y * width + x] = realRow(expected, y, width)[x] = variantPixel(x, y);
+        }
+    }
+    RFFT2D(expected, height, width, 1);
+    COMPLEX *spectrum = variantAllocate((size_t) height * hw * sizeof(COMPLEX));
+
+    for (int threads = 1; threads > 0; threads = nextThreads(v, threads)) {
+        // A budget of an eighth of the spectrum, so that every pass takes several chunks and blocks
+        setFFTThreads(threads);
+        struct DiskFFT *disk = createDiskFFT(width, height, "regress.scratch", (size_t) height * hw * 2);
+        if (disk == NULL) {
+            fprintf(stderr, "Cannot create the out-of-core transform!\n");
+            exit(1);
+        }
+        struct DiskImage in = {width, image}, out = {width, result};
+        diskFFTForward(disk, diskRead, &in);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < hw; x++) {
+                spectrum[(size_t) y * hw + x] = diskSpectrumAt(disk, x, y);
+            }
+        }
+        char variant[64];
+        snprintf(variant, sizeof(variant), "forward %d x %d, threads %d", width, height, threads);
+        reportDoubles(v, "fftdisk", variant, (double *) spectrum, (double *) expected, 2 * (size_t) height * hw, 1e-12);
+        diskFFTInverse(disk, diskWrite, &out);
+        snprintf(variant, sizeof(variant), "inverse, threads %d", threads);
+        reportDoubles(v, "fftdisk", variant, result, image, count, 1e-12);
+        destroyDiskFFT(disk);
+    }
+    setFFTThreads(1);
+    free(expected);
+    free(spectrum);
+    free(image);
+    free(result);
+    freeFFTPlanCache();
+}
+
+// Every template is cut from a second pattern and pasted into the scene at a known corner
+void checkMatch(struct Variants *v) {
+    int width = v->size + 7, height = v->size / 2 + 9;
+    int sizes[][2] = {{12, 8}, {15, 9}, {9, 13}, {16, 16}};
+    int corners[][2] = {{3, 2}, {width - 20, 4}, {6, height - 15}, {width / 2, height / 2 - 4}};
+    int templateCount = sizeof(sizes) / sizeof(sizes[0]);
+    double *scene = variantAllocate((size_t) width * height * sizeof(double));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            scene[(size_t) y * width + x] = variantPixel(x, y);
+        }
+    }
+    double *pixels[4];
+    for (int i = 0; i < templateCount; i++) {
+        pixels[i] = variantAllocate((size_t) sizes[i][0] * sizes[i][1] * sizeof(double));
+        for (int y = 0; y < sizes[i][1]; y++) {
+            for (int x = 0; x < sizes[i][0]; x++) {
+                double value = variantPixel(3 * x + 1000 * (i + 1), 5 * y + 7);
+                pixels[i][y * sizes[i][0] + x] = value;
+                scene[(size_t) (corners[i][1] + y) * width + corners[i][0] + x] = value;
+            }
+        }
+    }
+
+    struct MatchPeak peaks[4];
+    int found[4];
+    for (int poolSize = 1; poolSize > 0; poolSize = nextThreads(v, poolSize)) {
+        struct TemplateMatcher *matcher = createTemplateMatcher(width, height, poolSize);
+        struct MatchTemplate *templates[4];
+        for (int i = 0; i < templateCount; i++) {
+            templates[i] = createMatchTemplate(matcher, pixels[i], sizes[i][0], sizes[i][1]);
+        }
+        for (int y = 0; y < height; y++) {
+            memcpy(matchSceneRow(matcher, y), scene + (size_t) y * width, width * sizeof(double));
+        }
+        setMatchScene(matcher);
+
+        // The refinement may move the peak by less than half a pixel
+        matchTemplates(matcher, templates, templateCount, peaks, 1, found);
+        double position = 0, score = 0;
+        for (int i = 0; i < templateCount; i++) {
+            double dx = found[i] == 1 ? fabs(peaks[i].x - corners[i][0]) : INFINITY;
+            double dy = found[i] == 1 ? fabs(peaks[i].y - corners[i][1]) : INFINITY;
+            position = fmax(position, fmax(dx, dy));
+            score = fmax(score, found[i] == 1 ? fabs(peaks[i].score - 1) : INFINITY);
+        }
+        char variant[64];
+        snprintf(variant, sizeof(variant), "corner, %d templates, pool %d", templateCount, poolSize);
+        reportError(v, "match", variant, position, 0.5);
+        snprintf(variant, sizeof(variant), "NCC, %d templates, pool %d", templateCount, poolSize);
+        reportError(v, "match", variant, score, 1e-6);
+
+        // No peaks asked for, none found
+        matchTemplates(matcher, templates, templateCount, peaks, 0, found);
+        int most = 0;
+        for (int i = 0; i < templateCount; i++) {
+            most = found[i] > most ? found[i] : most;
+        }
+        snprintf(variant, sizeof(variant), "no peaks, pool %d", poolSize);
+        reportError(v, "match", variant, most, 0);
+
+        for (int i = 0; i < templateCount; i++) {
+            destroyMatchTemplate(templates[i]);
+        }
+        destroyTemplateMatcher(matcher);
+    }
+    for (int i = 0; i < templateCount; i++) {
+        free(pixels[i]);
+    }
+    free(scene);
+}
+
+// variantPixel() between the grid points, bilinear
+double variantSample(double x, double y) {
+    int x0 = (int) floor(x), y0 = (int) floor(y);
+    double fx = x - x0, fy = y - y0;
+    double top = variantPixel(x0, y0) + fx * (variantPixel(x0 + 1, y0) - variantPixel(x0, y0));
+    double bottom = variantPixel(x0, y0 + 1) + fx * (variantPixel(x0 + 1, y0 + 1) - variantPixel(x0, y0 + 1));
+    return top + fy * (bottom - top);
+}
+
+// The frame turned by angle degrees about the centre, scaled by scale and shifted, see RegistrationResult
+void registrationFrame(double *frame, int width, int height, double angle, double scale, double dx, double dy) {
+    double radian = angle * acos(-1) / 180, cx = width / 2, cy = height / 2;
+    double c = cos(radian) / scale, s = sin(radian) / scale;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double px = x - dx - cx, py = y - dy - cy;
+            frame[(size_t) y * width + x] = variantSample(c * px + s * py + cx, -s * px + c * py + cy);
+        }
+    }
+}
+
+void checkRegistration(struct Variants *v) {
+    int width = v->size, height = v->size + 6;
+    double *a = variantAllocate((size_t) width * height * sizeof(double));
+    double *b = variantAllocate((size_t) width * height * sizeof(double));
+    registrationFrame(a, width, height, 0, 1, 0, 0);
+    // A shift alone, then a turn and a scale with a shift, on the single threaded plans of the registration
+    double cases[][4] = {{0, 1, 7, -4}, {12, 1.1, 3, 5}};
+    for (int logPolar = 0; logPolar < 2; logPolar++) {
+        const double *known = cases[logPolar];
+        registrationFrame(b, width, height, known[0], known[1], known[2], known[3]);
+        struct Registration *registration = createRegistration(width, height, logPolar);
+        struct RegistrationResult result;
+        double shift = INFINITY, angle = INFINITY, scale = INFINITY;
+        if (registerImages(registration, a, b, &result)) {
+            shift = fmax(fabs(result.dx - known[2]), fabs(result.dy - known[3]));
+            angle = fabs(result.angle - known[0]);
+            scale = fabs(result.scale / known[1] - 1);
+        }
+        destroyRegistration(registration);
+        char variant[64];
+        snprintf(variant, sizeof(variant), "%s %d x %d, shift", logPolar ? "log-polar" : "plain", width, height);
+        reportError(v, "register", variant, shift, logPolar ? 1.0 : 0.25);
+        if (logPolar) {
+            // About a third of the angle and log radius steps of the map
+            reportError(v, "register", "log-polar angle", angle, 0.5);
+            reportError(v, "register", "log-polar scale", scale, 0.015);
+        }
+    }
+    free(a);
+    free(b);
+}
+
+struct VariantCheck {
+    const char *name;
+    void (*run)(struct Variants *v);
+};
+
+const struct VariantCheck variantChecks[] = {
+        {"rotate",   checkRotate},
+        {"layout",   checkLayout},
+        {"remap",    checkRemap},
+        {"pipeline", checkPipeline},
+        {"convolve", checkConvolve},
+        {"fft",      checkFFT},
+        {"fftsplit", checkSplitFFT},
+        {"fftdisk",  checkDiskFFT},
+        {"match",    checkMatch},
+        {"register", checkRegistration},
+};
+
+int variantsMain(int argc, char **argv) {
+    struct Variants v = {512, 4, 0};
+    const char *only = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-size") == 0) {
+            v.size = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-threads") == 0) {
+            v.threads = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-check") == 0) {
+            only = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s variants [-size 512] [-threads 4] [-check name]\n", argv[0]);
+            exit(1);
+        }
+    }
+    // The power-of-2 transforms need a power of 2
+    if (v.size < 64 || (v.size & (v.size - 1)) != 0 || v.threads < 1) {
+        fprintf(stderr, "Invalid regression settings!\n");
+        exit(1);
+    }
+#ifdef __AVX2__
+    printf("Instruction set: AVX2\n");
+#elif defined(__SSE2__)
+    printf("Instruction set: SSE2\n");
+#else
+    printf("Instruction set: scalar\n");
+#endif
+    for (size_t k = 0; k < sizeof(variantChecks) / sizeof(variantChecks[0]); k++) {
+        if (only == NULL || strcmp(only, variantChecks[k].name) == 0) {
+            variantChecks[k].run(&v);
+            fflush(stdout);
+        }
+    }
+    freeDistanceMaps();
+    printf("%d failed\n", v.failures);
+    return v.failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "compare") == 0) {
+        return compareMain(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "variants") == 0) {
+        return variantsMain(argc, argv);
+    }
+    fprintf(stderr, "Usage: %s compare result.bmp expected.bmp [-maxabs 0] [-psnr 0] [-border 0]\n"
+                    "       %s variants [-size 512] [-threads 4] [-check name]\n", argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,193 @@
+#!/bin/sh
+#
+# Digital Image Processing
+# Regression run of the programs against the outputs checked in next to them
+#
+# Note:
+# Usage: Tools/regress.sh [-threads 4] [-keep]
+# CFLAGS must put fft.h on the include path, e.g. CFLAGS=-I/path/to/fft, CC picks the compiler.
+# The programs are built once per instruction set, scalar (SSE2 and AVX2 turned off), SSE2 and
+# AVX2 when the CPU has it, because the SIMD paths of Common are chosen at compile time. Every
+# build of a program runs in a copy of its directory and each output is compared with
+# "regress compare", and every build of regress.c runs "regress variants", which compares the
+# SIMD, multithreaded and tiled kernels with their plain versions on synthetic images.
+# The table below lists the outputs. A program runs once per line, with the line given on its
+# standard input when it asks for one, and is skipped when its input is not in the repository.
+# The inputs are looked for next to the program, then in the directory above it, where the
+# inputs of Assignment-1 are. Fig2.19(a)_256.bmp of Assignment-2/p1/main-c.c is not checked in,
+# so that line is skipped on every build. The skipped lines are printed and counted on the last
+# line, next to the failures.
+# Two expected outputs need a tolerance:
+# Assignment-4/p3/b-phase.bmp: the phase of the coefficients which are 0 up to rounding is
+#   rounding noise, and some of them flip between -PI and PI
+# Assignment-5/p3/Result*.bmp: the programs leave the outermost pixels uninitialized
+# Tools/dip.c is checked the same way, with specs which reproduce an output of a program.
+# The work directory is removed at the end unless -keep is given. Exits with 1 when a check fails.
+#
+
+threads=4
+keep=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -threads) threads="$2"; shift 2 ;;
+        -keep) keep=1; shift ;;
+        *) echo "Usage: $0 [-threads 4] [-keep]" >&2; exit 1 ;;
+    esac
+done
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/dip-regress.XXXXXX") || exit 1
+CC=${CC:-cc}
+
+# source  inputs  stdin  output  expected  compare options
+outputs='
+Assignment-1/p1/p1.c Fig2.20.bmp - Result.bmp Result.bmp
+Assignment-1/p2/p2.c Fig2.20.bmp - Result.bmp Result.bmp
+Assignment-1/p3/p3.c Fig2.24(a).bmp 2 Result.bmp Result2.bmp
+Assignment-1/p3/p3.c Fig2.24(a).bmp 4 Result.bmp Result4.bmp
+Assignment-1/p3/p3.c Fig2.24(a).bmp 8 Result.bmp Result8.bmp
+Assignment-1/p3/p3.c Fig2.24(a).bmp 16 Result.bmp Result16.bmp
+Assignment-1/p3/p3.c Fig2.24(a).bmp 32 Result.bmp Result32.bmp
+Assignment-1/p3/p3.c Fig2.24(a).bmp 64 Result.bmp Result64.bmp
+Assignment-1/p3/p3.c Fig2.24(a).bmp 128 Result.bmp Result128.bmp
+Assignment-2/p1/main-b.c Fig2.19(a).bmp - Result.bmp Result-b.bmp
+Assignment-2/p1/main-c.c Fig2.19(a)_256.bmp - Result.bmp Result-c.bmp
+Assignment-2/p2/main.c Fig0230(a)(washington_infrared).bmp - Result.bmp Result.bmp
+Assignment-2/p3/main.c Fig0240(a)(letter_T).bmp - Result.bmp Result.bmp
+Assignment-3/p1/p1.c Fig3.23(a).bmp - p1.bmp p1.bmp
+Assignment-3/p2/p2a.c Fig0338(a).bmp - p2a.bmp p2a.bmp
+Assignment-3/p2/p2b.c Fig0338(a).bmp - p2b.bmp p2b.bmp
+Assignment-3/p2/p2c.c Fig0338(a).bmp - p2c.bmp p2c.bmp
+Assignment-3/p3/p3b.c Fig3.43(a).bmp - p3b.bmp p3b.bmp
+Assignment-3/p3/p3c.c Fig3.43(a).bmp - p3c.bmp p3c.bmp
+Assignment-3/p3/p3d.c Fig3.43(a).bmp - p3d.bmp p3d.bmp
+Assignment-3/p3/p3e.c Fig3.43(a).bmp - p3e.bmp p3e.bmp
+Assignment-3/p3/p3f.c Fig3.43(a).bmp - p3f.bmp p3f.bmp
+Assignment-3/p3/p3g.c Fig3.43(a).bmp - p3g.bmp p3g.bmp
+Assignment-3/p3/p3h.c Fig3.43(a).bmp - p3h.bmp p3h.bmp
+Assignment-4/p1/p1a.c Fig0417(a).bmp - a.bmp a.bmp
+Assignment-4/p1/p1b.c Fig0417(a).bmp - b.bmp b.bmp
+Assignment-4/p2/p2a.c Lines.bmp - Result.bmp a.bmp
+Assignment-4/p2/p2b.c Lines.bmp - Result.bmp b.bmp
+Assignment-4/p3/p3a.c Fig0424(a).bmp - Result.bmp a.bmp
+Assignment-4/p3/p3b.c Fig0424(a).bmp - b-spectrum.bmp b-spectrum.bmp
+Assignment-4/p3/p3b.c Fig0424(a).bmp - b-phase.bmp b-phase.bmp -psnr 25
+Assignment-5/p1/p1.c testpattern1024.bmp - ILPF_10.bmp ILPF_10.bmp
+Assignment-5/p1/p1.c testpattern1024.bmp - ILPF_30.bmp ILPF_30.bmp
+Assignment-5/p1/p1.c testpattern1024.bmp - ILPF_60.bmp ILPF_60.bmp
+Assignment-5/p1/p1.c testpattern1024.bmp - ILPF_160.bmp ILPF_160.bmp
+Assignment-5/p1/p1.c testpattern1024.bmp - ILPF_460.bmp ILPF_460.bmp
+Assignment-5/p2/p2.c Fig0464(a).bmp - Result.bmp Result.bmp
+Assignment-5/p3/p3.c Fig0508(a).bmp,Fig0508(b).bmp - ResultA.bmp ResultA.bmp -border 1
+Assignment-5/p3/p3.c Fig0508(a).bmp,Fig0508(b).bmp - ResultB.bmp ResultB.bmp -border 1
+'
+
+# spec  input  expected, relative to the root
+specs='
+sharpen Assignment-3/p3/Fig3.43(a).bmp Assignment-3/p3/p3c.bmp
+sobel|box:3 Assignment-3/p3/Fig3.43(a).bmp Assignment-3/p3/p3e.bmp
+ilpf:30 Assignment-5/p1/testpattern1024.bmp Assignment-5/p1/ILPF_30.bmp
+rot90|flipx|rot90|flipx Assignment-3/p3/Fig3.43(a).bmp Assignment-3/p3/Fig3.43(a).bmp
+'
+
+isas="scalar sse2"
+if grep -q avx2 /proc/cpuinfo 2>/dev/null; then
+    isas="$isas avx2"
+fi
+
+for isa in $isas; do
+    case $isa in
+        scalar) flags="-U__SSE2__ -U__AVX2__" ;;
+        sse2) flags="" ;;
+        avx2) flags="-mavx2 -mfma" ;;
+    esac
+    echo "== $isa"
+    mkdir -p "$work/$isa"
+    # shellcheck disable=SC2086
+    if ! $CC -O2 $CFLAGS $flags "$root/Tools/regress.c" -o "$work/$isa/regress" -lm -pthread; then
+        echo "Tools/regress.c: FAIL, cannot build"
+        exit 1
+    fi
+    if ! (cd "$work/$isa" && ./regress variants -threads "$threads" > variants.log); then
+        echo fail >> "$work/failures"
+    fi
+    grep -v ' ok$' "$work/$isa/variants.log"
+
+    echo "$outputs" | while read -r source inputs stdin output expected options; do
+        [ -z "$source" ] && continue
+        dir=$(dirname "$source")
+        name=$(basename "$source" .c)
+        run="$work/$isa/$dir/$name-$stdin"
+        # An input is looked for next to the program, then in the directory above it
+        missing=""
+        paths=""
+        for input in $(echo "$inputs" | tr , ' '); do
+            if [ -f "$root/$dir/$input" ]; then
+                paths="$paths $dir/$input"
+            elif [ -f "$root/$(dirname "$dir")/$input" ]; then
+                paths="$paths $(dirname "$dir")/$input"
+            else
+                missing="$input"
+            fi
+        done
+        if [ -n "$missing" ]; then
+            echo "$dir/$name: $expected: skipped, $missing is not in the repository"
+            echo skip >> "$work/skipped"
+            continue
+        fi
+        # Built and run once for all the outputs of the line's program and input
+        if [ ! -d "$run" ]; then
+            mkdir -p "$run"
+            for path in $paths; do
+                cp "$root/$path" "$run/"
+            done
+            # shellcheck disable=SC2086
+            if ! $CC -O2 $CFLAGS $flags "$root/$source" -o "$run/program" -lm -pthread ||
+               ! (cd "$run" && echo "$stdin" | ./program > program.log 2>&1); then
+                echo "$source: FAIL, cannot build or run, see $run"
+                echo fail >> "$work/failures"
+                continue
+            fi
+        fi
+        if [ ! -f "$run/$output" ]; then
+            echo "$dir/$name: $output: FAIL, not written"
+            echo fail >> "$work/failures"
+            continue
+        fi
+        # shellcheck disable=SC2086
+        if ! "$work/$isa/regress" compare "$run/$output" "$root/$dir/$expected" $options > "$run/compare.log"; then
+            echo fail >> "$work/failures"
+        fi
+        sed "s|^$run/|$dir/$name: |" "$run/compare.log"
+    done
+
+    # shellcheck disable=SC2086
+    if ! $CC -O2 $CFLAGS $flags "$root/Tools/dip.c" -o "$work/$isa/dip" -lm -pthread; then
+        echo "Tools/dip.c: FAIL, cannot build"
+        exit 1
+    fi
+    echo "$specs" | while read -r spec input expected; do
+        [ -z "$spec" ] && continue
+        if ! "$work/$isa/dip" -threads "$threads" -o "$work/$isa/dip.bmp" "$spec" "$root/$input" > /dev/null ||
+           ! "$work/$isa/regress" compare "$work/$isa/dip.bmp" "$root/$expected" > "$work/$isa/compare.log"; then
+            echo fail >> "$work/failures"
+        fi
+        sed "s#^$work/$isa/dip.bmp#dip $spec#" "$work/$isa/compare.log"
+    done
+done
+
+failures=0
+if [ -f "$work/failures" ]; then
+    failures=$(wc -l < "$work/failures")
+fi
+skipped=0
+if [ -f "$work/skipped" ]; then
+    skipped=$(wc -l < "$work/skipped")
+fi
+if [ $keep -eq 0 ]; then
+    rm -rf "$work"
+else
+    echo "Kept $work"
+fi
+echo "$failures failed, $skipped skipped"
+[ $failures -eq 0 ]